@@ -0,0 +1,350 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <absorption.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include <logging.h>
+#include <constants.h>
+#include <capture_queue.h>
+#include <szs_tracker_trace.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int absorbWindowMs = ABSORB_DEFAULT_WINDOW_MS;
+module_param_named( absorb_window_ms, absorbWindowMs, uint, 0644 );
+MODULE_PARM_DESC( absorb_window_ms, "Time in ms captured changes wait for overwrites before being queued, async and completion modes (0 = off)" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+#define EXTENT_START( record ) ( ( sector_t )( record )->header->sector )
+#define EXTENT_LAST( record )  ( EXTENT_START( record ) + ( record )->header->length / BIO_SECTOR_SIZE - 1 )
+
+INTERVAL_TREE_DEFINE( struct change_record, extentNode, sector_t, extentSubtreeLast, EXTENT_START, EXTENT_LAST, static, pending_extent )
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Records that order the stream close the window; so does an empty range, which has no place
+// in the tree.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool is_barrier( struct change_record* record )
+{
+	return record->header->opType != SZS_OP_WRITE || record->header->length == 0 ||
+	       ( record->header->flags & ( SZS_RECORD_FLAG_PREFLUSH | SZS_RECORD_FLAG_FUA ) );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Only captured data records can be merged; their payload is still the raw data.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool is_mergeable( struct change_record* record )
+{
+	return record->ownsPages && record->nrVecs > 0 && record->header->payloadLength == record->header->length &&
+	       !( record->header->flags & ( SZS_RECORD_FLAG_LZ4 | SZS_RECORD_FLAG_CRC32C ) );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Zero and discard records carry a range but no payload; two of a kind merge by extending the
+// range.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool is_range_only( struct change_record* record )
+{
+	uint8_t kind = record->header->flags & ( SZS_RECORD_FLAG_ZERO | SZS_RECORD_FLAG_DISCARD );
+	return record->header->payloadLength == 0 && kind != 0 && record->header->flags == kind;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function queues a record that has its sequence number. When the queue is full, the
+// range is left to the overflow tracker.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void queue_record( struct absorption_window* window, struct change_record* record )
+{
+	if( capture_queue_enqueue( record ) == 0 )
+	{
+		return;
+	}
+
+	if( printk_ratelimit() )
+	{
+		LOG_WARN( "Capture queue is full, range marked for resync." );
+	}
+
+	stats_add( window->stats, STATS_RECORDS_DROPPED, 1 );
+	trace_szs_record_dropped( window->deviceId, record->header->sector, record->header->length, DROP_QUEUE_FULL );
+	overflow_mark( window->overflow, record->header->sector, record->header->length );
+	free_change_record( record );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void queue_records( struct absorption_window* window, struct list_head* records )
+{
+	struct change_record *record, *next;
+	list_for_each_entry_safe( record, next, records, list )
+	{
+		list_del_init( &record->list );
+		queue_record( window, record );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function empties the window into 'ready', numbering the records in capture order.
+// Called with the window lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void take_pending( struct absorption_window* window, struct list_head* ready )
+{
+	struct change_record* record;
+	list_for_each_entry( record, &window->records, list )
+	{
+		record->header->sequence = atomic64_inc_return( window->sequence );
+	}
+
+	list_splice_tail_init( &window->records, ready );
+	window->extents = RB_ROOT_CACHED;
+	window->nrPending = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function frees the pending records whose whole range 'record' covers. It tells whether
+// some pending record still overlaps 'record' partially. Called with the window lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool absorb_overwritten( struct absorption_window* window, struct change_record* record )
+{
+	sector_t first = EXTENT_START( record );
+	sector_t last = EXTENT_LAST( record );
+	bool partialOverlap = false;
+	LIST_HEAD( overwritten );
+
+	struct change_record* pending = pending_extent_iter_first( &window->extents, first, last );
+	while( pending != NULL )
+	{
+		if( EXTENT_START( pending ) >= first && EXTENT_LAST( pending ) <= last )
+		{
+			list_move_tail( &pending->list, &overwritten );
+		}
+		else
+		{
+			partialOverlap = true;
+		}
+
+		pending = pending_extent_iter_next( pending, first, last );
+	}
+
+	struct change_record* next;
+	list_for_each_entry_safe( pending, next, &overwritten, list )
+	{
+		pending_extent_remove( pending, &window->extents );
+		list_del_init( &pending->list );
+		window->nrPending--;
+		stats_add( window->stats, STATS_BYTES_ABSORBED, pending->header->payloadLength );
+		free_change_record( pending );
+	}
+
+	return partialOverlap;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function extends a pending zero or discard record over the range of 'record', which
+// follows it, and frees 'record'. Called with the window lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void extend_pending_range( struct absorption_window* window, struct change_record* pending, struct change_record* record )
+{
+	pending_extent_remove( pending, &window->extents );
+	pending->header->length += record->header->length;
+	pending->header->timestampNs = record->header->timestampNs;
+	pending_extent_insert( pending, &window->extents );
+
+	free_change_record( record );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function appends 'record' to the pending record that ends where it starts, if there is
+// one that can take it: data goes after data, a zero or discard range extends a range of the
+// same kind. Moving 'record' up to the place of that record in the stream is only safe
+// because no pending record overlaps it. It tells whether 'record' was consumed. Called with
+// the window lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool append_to_pending( struct absorption_window* window, struct change_record* record )
+{
+	sector_t first = EXTENT_START( record );
+	bool rangeOnly = is_range_only( record );
+	if( first == 0 || ( !rangeOnly && !is_mergeable( record ) ) )
+	{
+		return false;
+	}
+
+	struct change_record* pending = pending_extent_iter_first( &window->extents, first - 1, first - 1 );
+	while( pending != NULL && EXTENT_LAST( pending ) != first - 1 )
+	{
+		pending = pending_extent_iter_next( pending, first - 1, first - 1 );
+	}
+
+	if( pending == NULL )
+	{
+		return false;
+	}
+
+	if( rangeOnly )
+	{
+		if( pending->header->flags != record->header->flags || !is_range_only( pending ) ||
+		    ( uint64_t )pending->header->length + record->header->length > U32_MAX - BIO_SECTOR_SIZE + 1 )
+		{
+			return false;
+		}
+
+		extend_pending_range( window, pending, record );
+		return true;
+	}
+
+	if( !is_mergeable( pending ) || !PAGE_ALIGNED( pending->header->payloadLength ) ||
+	    pending->header->length + record->header->length > ABSORB_MAX_EXTENT )
+	{
+		return false;
+	}
+
+	// The merged record takes the place of the pending one
+	struct list_head* position = pending->list.prev;
+	pending_extent_remove( pending, &window->extents );
+	list_del_init( &pending->list );
+
+	struct change_record* merged = merge_change_records( pending, record, GFP_ATOMIC | __GFP_NOWARN );
+	if( merged == NULL )
+	{
+		list_add( &pending->list, position );
+		pending_extent_insert( pending, &window->extents );
+		return false;
+	}
+
+	list_add( &merged->list, position );
+	pending_extent_insert( merged, &window->extents );
+
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands a captured record to the window of its device; the window numbers it
+// and queues it, now or when it releases. It never sleeps.
+//
+// With the window off and nothing pending, the record is numbered and queued right away
+// without taking the lock.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void absorption_add( struct absorption_window* window, struct change_record* record )
+{
+	unsigned int windowMs = READ_ONCE( absorbWindowMs );
+	if( windowMs == 0 && READ_ONCE( window->nrPending ) == 0 )
+	{
+		record->header->sequence = atomic64_inc_return( window->sequence );
+		queue_record( window, record );
+		return;
+	}
+
+	LIST_HEAD( ready );
+	unsigned long flags;
+	spin_lock_irqsave( &window->lock, flags );
+
+	if( windowMs == 0 || is_barrier( record ) )
+	{
+		take_pending( window, &ready );
+		record->header->sequence = atomic64_inc_return( window->sequence );
+		list_add_tail( &record->list, &ready );
+	}
+	else
+	{
+		bool partialOverlap = absorb_overwritten( window, record );
+		if( partialOverlap || !append_to_pending( window, record ) )
+		{
+			pending_extent_insert( record, &window->extents );
+			list_add_tail( &record->list, &window->records );
+			window->nrPending++;
+		}
+
+		// The window opens with its first record
+		if( window->nrPending == 1 )
+		{
+			queue_delayed_work( system_wq, &window->release, msecs_to_jiffies( windowMs ) );
+		}
+
+		if( window->nrPending >= ABSORB_MAX_PENDING || change_record_under_pressure() )
+		{
+			take_pending( window, &ready );
+		}
+	}
+
+	spin_unlock_irqrestore( &window->lock, flags );
+
+	queue_records( window, &ready );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function releases every pending record of the window.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void absorption_flush( struct absorption_window* window )
+{
+	LIST_HEAD( ready );
+	unsigned long flags;
+
+	spin_lock_irqsave( &window->lock, flags );
+	take_pending( window, &ready );
+	spin_unlock_irqrestore( &window->lock, flags );
+
+	queue_records( window, &ready );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void absorption_release_fn( struct work_struct* work )
+{
+	absorption_flush( container_of( to_delayed_work( work ), struct absorption_window, release ) );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the absorption window of a device. Dropped records are left to
+// 'overflow'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct absorption_window* absorption_create( uint32_t deviceId, atomic64_t* sequence, struct overflow_tracker* overflow, struct device_stats* stats )
+{
+	struct absorption_window* window = kzalloc( sizeof( *window ), GFP_KERNEL );
+	if( window == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for absorption window." );
+		return NULL;
+	}
+
+	spin_lock_init( &window->lock );
+	window->extents = RB_ROOT_CACHED;
+	INIT_LIST_HEAD( &window->records );
+	window->nrPending = 0;
+	window->deviceId = deviceId;
+	window->sequence = sequence;
+	window->overflow = overflow;
+	window->stats = stats;
+	INIT_DELAYED_WORK( &window->release, absorption_release_fn );
+
+	return window;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function queues what is left in the window and frees it. No one may add to the window
+// any more.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void absorption_destroy( struct absorption_window* window )
+{
+	if( window == NULL )
+	{
+		return;
+	}
+
+	cancel_delayed_work_sync( &window->release );
+	absorption_flush( window );
+	kfree( window );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
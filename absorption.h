@@ -0,0 +1,59 @@
+#ifndef SZS_TRACKER_ABSORPTION_H
+#define SZS_TRACKER_ABSORPTION_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <change_record.h>
+#include <overflow.h>
+#include <stats.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Captured records of a device may wait in an absorption window for up to 'absorb_window_ms'
+// before they are queued for the capture workers. Within the window, a record that covers the
+// whole range of pending ones replaces them, and a record that starts where a pending one ends
+// is appended to it; adjacent zero ranges become one. A block rewritten many times within the
+// window thus goes out once, with its last content.
+//
+// Pending records are kept in capture order in 'records' and by range in the interval tree
+// 'extents'. They get their sequence number when the window releases them, so absorbed
+// records leave no gap in the sequence. A barrier (flush, preflush or FUA write) releases the
+// window before it goes out itself.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct absorption_window
+{
+	spinlock_t lock;
+	struct rb_root_cached extents;
+	struct list_head records;
+	unsigned int nrPending;
+	uint32_t deviceId;
+	atomic64_t *sequence;             // Sequence counter of the device
+	struct overflow_tracker *overflow;
+	struct device_stats *stats;
+	struct delayed_work release;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct absorption_window* absorption_create( uint32_t deviceId, atomic64_t* sequence, struct overflow_tracker* overflow, struct device_stats* stats );
+void absorption_destroy( struct absorption_window* window );
+void absorption_add( struct absorption_window* window, struct change_record* record );
+void absorption_flush( struct absorption_window* window );
+
+#endif // SZS_TRACKER_ABSORPTION_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,219 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Benchmark sink. It accepts the tracker connections on the loopback interface, reads and
+// discards everything. On SIGUSR1 it appends a snapshot of what it received so far as one
+// JSON line, on SIGINT or SIGTERM it appends a last one and exits:
+//
+//   bench_receiver [-p port] [-o snapshots.jsonl]
+//
+// Counters are cumulative and 'time' is CLOCK_MONOTONIC, so the throughput of a run is the
+// difference between the snapshots taken before and after it.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+#define MAX_CONNECTIONS 65
+#define READ_BUFFER_SIZE ( 1024 * 1024 )
+
+static volatile sig_atomic_t stopRequested = 0;
+static volatile sig_atomic_t snapshotRequested = 0;
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void on_signal( int signal )
+{
+	if( signal == SIGUSR1 )
+	{
+		snapshotRequested = 1;
+		return;
+	}
+
+	stopRequested = 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static double now_seconds( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_snapshot( const char* output, uint64_t bytes, uint64_t connections )
+{
+	FILE* out = output ? fopen( output, "a" ) : stdout;
+	if( out == NULL )
+	{
+		fprintf( stderr, "bench_receiver: cannot write %s: %s\n", output, strerror( errno ) );
+		return -1;
+	}
+
+	fprintf( out, "{\"bytes\": %llu, \"connections\": %llu, \"time\": %.6f}\n",
+		 ( unsigned long long )bytes, ( unsigned long long )connections, now_seconds() );
+
+	if( out != stdout )
+	{
+		fclose( out );
+	}
+	else
+	{
+		fflush( out );
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int listen_on( unsigned short port )
+{
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( fd < 0 )
+	{
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+	struct sockaddr_in address;
+	memset( &address, 0, sizeof( address ) );
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	address.sin_port = htons( port );
+
+	if( bind( fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 || listen( fd, MAX_CONNECTIONS ) < 0 )
+	{
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	unsigned short port = 1234;
+	const char* output = NULL;
+
+	int option;
+	while( ( option = getopt( argc, argv, "p:o:" ) ) != -1 )
+	{
+		switch( option )
+		{
+			case 'p':
+				port = ( unsigned short )atoi( optarg );
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				fprintf( stderr, "usage: bench_receiver [-p port] [-o snapshots.jsonl]\n" );
+				return 2;
+		}
+	}
+
+	struct sigaction action;
+	memset( &action, 0, sizeof( action ) );
+	action.sa_handler = on_signal;
+	sigaction( SIGINT, &action, NULL );
+	sigaction( SIGTERM, &action, NULL );
+	sigaction( SIGUSR1, &action, NULL );
+
+	int listenFd = listen_on( port );
+	if( listenFd < 0 )
+	{
+		fprintf( stderr, "bench_receiver: cannot listen on port %u: %s\n", port, strerror( errno ) );
+		return 1;
+	}
+
+	char* buffer = malloc( READ_BUFFER_SIZE );
+	struct pollfd fds[MAX_CONNECTIONS];
+	unsigned int nrFds = 1;
+	fds[0].fd = listenFd;
+	fds[0].events = POLLIN;
+
+	uint64_t totalBytes = 0;
+	uint64_t totalConnections = 0;
+
+	while( !stopRequested )
+	{
+		if( snapshotRequested )
+		{
+			snapshotRequested = 0;
+			write_snapshot( output, totalBytes, totalConnections );
+		}
+
+		if( poll( fds, nrFds, 200 ) < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+
+			break;
+		}
+
+		if( ( fds[0].revents & POLLIN ) && nrFds < MAX_CONNECTIONS )
+		{
+			int fd = accept( listenFd, NULL, NULL );
+			if( fd >= 0 )
+			{
+				fds[nrFds].fd = fd;
+				fds[nrFds].events = POLLIN;
+				fds[nrFds].revents = 0;
+				nrFds++;
+				totalConnections++;
+			}
+		}
+
+		unsigned int index = 1;
+		while( index < nrFds )
+		{
+			if( !( fds[index].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+			{
+				index++;
+				continue;
+			}
+
+			ssize_t received = recv( fds[index].fd, buffer, READ_BUFFER_SIZE, 0 );
+			if( received <= 0 )
+			{
+				close( fds[index].fd );
+				fds[index] = fds[nrFds - 1];
+				nrFds--;
+				continue;
+			}
+
+			totalBytes += received;
+			index++;
+		}
+	}
+
+	free( buffer );
+	return write_snapshot( output, totalBytes, totalConnections ) ? 1 : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,171 @@
+#!/bin/bash
+###################################################################
+#                                                                 #
+#                  Copyright 2023 RackWare, Inc.                  #
+#                                                                 #
+#  This is an unpublished work, is confidential and proprietary   #
+#  to RackWare as a trade secret and is not to be used or         #
+#  disclosed except and to the extent expressly permitted in an   #
+#  applicable RackWare license agreement.                         #
+#                                                                 #
+###################################################################
+# Overhead benchmark. Runs every fio profile in profiles/ against a scratch device, first
+# untracked, then tracked in each mode of BENCH_MODES, and writes one JSON document with IOPS,
+# completion latency percentiles and receiver throughput per run.
+#
+# Everything stays on the machine: the device is null_blk (or a loop device on tmpfs when
+# null_blk is not available) and the receiver listens on the loopback interface.
+#
+# Settings, from the environment:
+#   BENCH_BACKEND   null_blk or loop                      (default: null_blk, loop as fallback)
+#   BENCH_SIZE_MB   size of the scratch device             (default: 4096)
+#   BENCH_RUNTIME   seconds per fio run                    (default: 30)
+#   BENCH_MODES     tracking modes to measure              (default: "sync async")
+#                   sync, async, cbt or completion
+#   BENCH_PROFILES  profile names, without .fio            (default: all of profiles/)
+#   BENCH_OUTPUT    result file                            (default: results/bench-<date>.json)
+set -euo pipefail
+
+BENCH_DIR="$( cd "$( dirname "$0" )" && pwd )"
+MODULE="$BENCH_DIR/../szs_tracker.ko"
+CTL="$BENCH_DIR/szs_ctl"
+RECEIVER="$BENCH_DIR/bench_receiver"
+
+BENCH_BACKEND="${BENCH_BACKEND:-null_blk}"
+BENCH_SIZE_MB="${BENCH_SIZE_MB:-4096}"
+export BENCH_RUNTIME="${BENCH_RUNTIME:-30}"
+BENCH_MODES="${BENCH_MODES:-sync async}"
+BENCH_PROFILES="${BENCH_PROFILES:-$( cd "$BENCH_DIR/profiles" && ls *.fio | sed 's/\.fio$//' )}"
+BENCH_OUTPUT="${BENCH_OUTPUT:-$BENCH_DIR/results/bench-$( date +%Y%m%d-%H%M%S ).json}"
+
+WORK_DIR="$( mktemp -d /tmp/szs_bench.XXXXXX )"
+SNAPSHOTS="$WORK_DIR/receiver.jsonl"
+RECEIVER_PID=""
+LOOP_DEVICE=""
+NULL_BLK_LOADED=0
+MODULE_LOADED=0
+
+log()
+{
+	echo "bench: $*" >&2
+}
+
+cleanup()
+{
+	set +e
+	if [ -n "${BENCH_DEVICE:-}" ] && [ "$MODULE_LOADED" = 1 ]; then
+		"$CTL" remove "$BENCH_DEVICE" 2>/dev/null
+	fi
+	if [ "$MODULE_LOADED" = 1 ]; then
+		rmmod szs_tracker
+	fi
+	if [ -n "$RECEIVER_PID" ]; then
+		kill -TERM "$RECEIVER_PID" 2>/dev/null
+		wait "$RECEIVER_PID" 2>/dev/null
+	fi
+	if [ -n "$LOOP_DEVICE" ]; then
+		losetup -d "$LOOP_DEVICE"
+	fi
+	if [ "$NULL_BLK_LOADED" = 1 ]; then
+		rmmod null_blk
+	fi
+	rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# Prints the number of snapshot lines the receiver has written so far
+snapshot_count()
+{
+	if [ -f "$SNAPSHOTS" ]; then wc -l < "$SNAPSHOTS"; else echo 0; fi
+}
+
+# Asks the receiver for a snapshot and waits until it is written
+receiver_snapshot()
+{
+	local before
+	before="$( snapshot_count )"
+	kill -USR1 "$RECEIVER_PID"
+	while [ "$( snapshot_count )" -le "$before" ]; do
+		sleep 0.05
+	done
+	tail -n 1 "$SNAPSHOTS"
+}
+
+# Waits until the capture workers have sent everything that was queued
+wait_for_drain()
+{
+	local tries=0
+	while [ "$( cat /sys/kernel/szs_tracker/queue_depth )" != 0 ] && [ "$tries" -lt 600 ]; do
+		sleep 0.1
+		tries=$(( tries + 1 ))
+	done
+}
+
+setup_device()
+{
+	if [ "$BENCH_BACKEND" = null_blk ] && modprobe null_blk nr_devices=1 queue_mode=2 \
+		memory_backed=1 gb=$(( ( BENCH_SIZE_MB + 1023 ) / 1024 )) 2>/dev/null; then
+		NULL_BLK_LOADED=1
+		BENCH_DEVICE=/dev/nullb0
+		return
+	fi
+
+	log "null_blk not available, using a loop device on tmpfs"
+	BENCH_BACKEND=loop
+	truncate -s "${BENCH_SIZE_MB}M" /dev/shm/szs_bench.img
+	LOOP_DEVICE="$( losetup --find --show --direct-io=on /dev/shm/szs_bench.img )"
+	rm -f /dev/shm/szs_bench.img
+	BENCH_DEVICE="$LOOP_DEVICE"
+}
+
+# run_fio <profile> <tracking> : runs one profile and records the fio and receiver results
+run_fio()
+{
+	local profile="$1" tracking="$2"
+	local result="$WORK_DIR/$profile.$tracking"
+
+	log "$profile, tracking $tracking"
+	if [ "$tracking" != off ]; then
+		"$CTL" add "$BENCH_DEVICE"
+		"$CTL" mode "$BENCH_DEVICE" "$tracking"
+	fi
+
+	receiver_snapshot > "$result.before"
+	BENCH_DEVICE="$BENCH_DEVICE" fio --output-format=json --output="$result.fio.json" "$BENCH_DIR/profiles/$profile.fio"
+	wait_for_drain
+	receiver_snapshot > "$result.after"
+
+	if [ "$tracking" != off ]; then
+		"$CTL" remove "$BENCH_DEVICE"
+	fi
+}
+
+[ "$( id -u )" = 0 ] || { log "must run as root"; exit 1; }
+for tool in fio python3 "$CTL" "$RECEIVER"; do
+	command -v "$tool" > /dev/null || { log "$tool not found, run make first"; exit 1; }
+done
+[ -f "$MODULE" ] || { log "$MODULE not found, build the module first"; exit 1; }
+if lsmod | grep -q '^szs_tracker '; then
+	log "szs_tracker is already loaded, unload it first"
+	exit 1
+fi
+
+mkdir -p "$( dirname "$BENCH_OUTPUT" )"
+
+"$RECEIVER" -o "$SNAPSHOTS" &
+RECEIVER_PID=$!
+
+setup_device
+insmod "$MODULE"
+MODULE_LOADED=1
+
+for profile in $BENCH_PROFILES; do
+	for tracking in off $BENCH_MODES; do
+		run_fio "$profile" "$tracking"
+	done
+done
+
+python3 "$BENCH_DIR/summarize.py" --backend "$BENCH_BACKEND" --device "$BENCH_DEVICE" \
+	--kernel "$( uname -r )" "$WORK_DIR" > "$BENCH_OUTPUT"
+log "results written to $BENCH_OUTPUT"
+cat "$BENCH_OUTPUT"
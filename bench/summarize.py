@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+###################################################################
+#                                                                 #
+#                  Copyright 2023 RackWare, Inc.                  #
+#                                                                 #
+#  This is an unpublished work, is confidential and proprietary   #
+#  to RackWare as a trade secret and is not to be used or         #
+#  disclosed except and to the extent expressly permitted in an   #
+#  applicable RackWare license agreement.                         #
+#                                                                 #
+###################################################################
+# Folds the per-run files left by run_bench.sh into one JSON document:
+#   <profile>.<tracking>.fio.json    fio output
+#   <profile>.<tracking>.before      receiver snapshot taken before the run
+#   <profile>.<tracking>.after       receiver snapshot taken after the run
+# Tracked runs also get their overhead relative to the untracked run of the same profile.
+import argparse
+import glob
+import json
+import os
+import sys
+
+PERCENTILES = { "p50_us": "50.000000", "p99_us": "99.000000", "p99_9_us": "99.900000" }
+
+
+def direction_summary( stats ):
+    percentiles = stats.get( "clat_ns", {} ).get( "percentile", {} )
+    summary = { "iops": round( stats["iops"], 1 ) }
+    for name, key in PERCENTILES.items():
+        summary[name] = round( percentiles.get( key, 0 ) / 1000.0, 2 )
+    return summary
+
+
+def run_summary( prefix ):
+    with open( prefix + ".fio.json" ) as f:
+        job = json.load( f )["jobs"][0]
+    with open( prefix + ".before" ) as f:
+        before = json.loads( f.read() )
+    with open( prefix + ".after" ) as f:
+        after = json.loads( f.read() )
+
+    summary = { "iops": round( job["read"]["iops"] + job["write"]["iops"], 1 ) }
+    for direction in ( "write", "read" ):
+        if job[direction]["total_ios"]:
+            summary[direction] = direction_summary( job[direction] )
+
+    seconds = after["time"] - before["time"]
+    received = after["bytes"] - before["bytes"]
+    summary["receiver"] = {
+        "bytes": received,
+        "seconds": round( seconds, 3 ),
+        "throughput_mb_s": round( received / seconds / 1e6, 2 ) if seconds > 0 else 0.0,
+    }
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument( "--backend", required=True )
+    parser.add_argument( "--device", required=True )
+    parser.add_argument( "--kernel", required=True )
+    parser.add_argument( "workdir" )
+    args = parser.parse_args()
+
+    profiles = {}
+    for path in sorted( glob.glob( os.path.join( args.workdir, "*.fio.json" ) ) ):
+        prefix = path[: -len( ".fio.json" )]
+        profile, tracking = os.path.basename( prefix ).rsplit( ".", 1 )
+        profiles.setdefault( profile, {} )[tracking] = run_summary( prefix )
+
+    for runs in profiles.values():
+        baseline = runs.get( "off" )
+        if baseline is None or baseline["iops"] == 0:
+            continue
+        for tracking, run in runs.items():
+            if tracking != "off":
+                run["iops_overhead_pct"] = round( 100.0 * ( 1 - run["iops"] / baseline["iops"] ), 2 )
+                if "write" in run and "write" in baseline:
+                    run["write_p99_added_us"] = round( run["write"]["p99_us"] - baseline["write"]["p99_us"], 2 )
+
+    json.dump( { "backend": args.backend, "device": args.device, "kernel": args.kernel, "profiles": profiles },
+               sys.stdout, indent=2, sort_keys=True )
+    sys.stdout.write( "\n" )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,356 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Minimal control tool used by the benchmark scripts to drive the tracker ioctls.
+//
+//   szs_ctl add <device>
+//   szs_ctl remove <device>
+//   szs_ctl mode <device> sync|async|cbt|completion
+//   szs_ctl reset-latency
+//   szs_ctl config [name=value]...
+//   szs_ctl batch add|remove [-a] [-m mode] <device|major:minor>...
+//
+// Without arguments, 'config' prints the runtime configuration. Names are those of the module
+// parameters: target_ip, target_port, socket_pool_min, socket_pool_max, batch_size,
+// batch_flush_delay_us, capture_queue_depth and capture_workers.
+//
+// 'batch' handles all the devices in one ioctl and reports each one that failed. With -a, a
+// batch add is undone as a whole when any device fails.
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <ioctl_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int usage( void )
+{
+	fprintf( stderr, "usage: szs_ctl add|remove <device>\n"
+			 "       szs_ctl mode <device> sync|async|cbt|completion\n"
+			 "       szs_ctl reset-latency\n"
+			 "       szs_ctl config [name=value]...\n"
+			 "       szs_ctl batch add|remove [-a] [-m mode] <device|major:minor>...\n" );
+	return 2;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets one 'name=value' setting in a configuration request. The endpoint and the
+// pool bounds are applied in pairs, the other value of the pair is kept as it is.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int parse_setting( const char* setting, struct tracker_config_request* config )
+{
+	const char* value = strchr( setting, '=' );
+	if( value == NULL )
+	{
+		return -1;
+	}
+
+	size_t nameLength = value - setting;
+	value++;
+
+	static const struct
+	{
+		const char* name;
+		uint32_t field;
+		size_t offset;
+	} settings[] =
+	{
+		{ "target_port",          TRACKER_CONFIG_ENDPOINT,    offsetof( struct tracker_config_request, targetPort ) },
+		{ "socket_pool_min",      TRACKER_CONFIG_SOCKET_POOL, offsetof( struct tracker_config_request, socketPoolMin ) },
+		{ "socket_pool_max",      TRACKER_CONFIG_SOCKET_POOL, offsetof( struct tracker_config_request, socketPoolMax ) },
+		{ "batch_size",           TRACKER_CONFIG_BATCH_SIZE,  offsetof( struct tracker_config_request, batchSize ) },
+		{ "batch_flush_delay_us", TRACKER_CONFIG_FLUSH_DELAY, offsetof( struct tracker_config_request, batchFlushDelayUs ) },
+		{ "capture_queue_depth",  TRACKER_CONFIG_QUEUE_DEPTH, offsetof( struct tracker_config_request, captureQueueDepth ) },
+		{ "capture_workers",      TRACKER_CONFIG_WORKERS,     offsetof( struct tracker_config_request, captureWorkers ) },
+	};
+
+	if( nameLength == strlen( "target_ip" ) && strncmp( setting, "target_ip", nameLength ) == 0 )
+	{
+		if( strlen( value ) >= sizeof( config->targetIp ) )
+		{
+			return -1;
+		}
+
+		strcpy( config->targetIp, value );
+		config->fields |= TRACKER_CONFIG_ENDPOINT;
+		return 0;
+	}
+
+	size_t index = 0;
+	while( index < sizeof( settings ) / sizeof( settings[0] ) )
+	{
+		if( nameLength == strlen( settings[index].name ) && strncmp( setting, settings[index].name, nameLength ) == 0 )
+		{
+			char* end = NULL;
+			unsigned long number = strtoul( value, &end, 0 );
+			if( *value == '\0' || *end != '\0' || number > UINT32_MAX )
+			{
+				return -1;
+			}
+
+			*( uint32_t* )( ( char* )config + settings[index].offset ) = number;
+			config->fields |= settings[index].field;
+			return 0;
+		}
+
+		index++;
+	}
+
+	return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function prints the runtime configuration, or changes the given settings.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int configure( int fd, int argc, char** argv )
+{
+	struct tracker_config_request config;
+	memset( &config, 0, sizeof( config ) );
+	int ret = ioctl( fd, TRACKER_GET_CONFIG, &config );
+	if( ret < 0 || argc == 0 )
+	{
+		if( ret == 0 )
+		{
+			printf( "target_ip=%s\ntarget_port=%u\nsocket_pool_min=%u\nsocket_pool_max=%u\nbatch_size=%u\n"
+				"batch_flush_delay_us=%u\ncapture_queue_depth=%u\ncapture_workers=%u\n",
+				config.targetIp, config.targetPort, config.socketPoolMin, config.socketPoolMax, config.batchSize,
+				config.batchFlushDelayUs, config.captureQueueDepth, config.captureWorkers );
+		}
+
+		return ret;
+	}
+
+	config.fields = 0;
+	int index = 0;
+	while( index < argc )
+	{
+		if( parse_setting( argv[index], &config ) )
+		{
+			fprintf( stderr, "szs_ctl: invalid setting %s\n", argv[index] );
+			errno = EINVAL;
+			return -1;
+		}
+
+		index++;
+	}
+
+	return ioctl( fd, TRACKER_SET_CONFIG, &config );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int parse_mode( const char* name, uint32_t* mode )
+{
+	if( strcmp( name, "sync" ) == 0 )
+	{
+		*mode = TRACKING_MODE_SYNC;
+	}
+	else if( strcmp( name, "async" ) == 0 )
+	{
+		*mode = TRACKING_MODE_ASYNC;
+	}
+	else if( strcmp( name, "cbt" ) == 0 )
+	{
+		*mode = TRACKING_MODE_CBT;
+	}
+	else if( strcmp( name, "completion" ) == 0 )
+	{
+		*mode = TRACKING_MODE_COMPLETION;
+	}
+	else
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function fills a batch entry from a device path or a 'major:minor' pair.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int parse_batch_device( const char* device, struct block_device_batch_entry* entry )
+{
+	unsigned int major = 0, minor = 0;
+	char extra = 0;
+	if( device[0] != '/' && sscanf( device, "%u:%u%c", &major, &minor, &extra ) == 2 )
+	{
+		entry->major = major;
+		entry->minor = minor;
+		return 0;
+	}
+
+	if( strlen( device ) >= sizeof( entry->blockDevicePath ) )
+	{
+		return -1;
+	}
+
+	strcpy( entry->blockDevicePath, device );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function adds or removes several devices with one BLOCK_DEVICE_BATCH request.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int batch( int fd, int argc, char** argv )
+{
+	struct block_device_batch_request request;
+	memset( &request, 0, sizeof( request ) );
+	if( argc < 2 || ( strcmp( argv[0], "add" ) != 0 && strcmp( argv[0], "remove" ) != 0 ) )
+	{
+		return -2;
+	}
+
+	request.operation = argv[0][0] == 'a' ? BLOCK_DEVICE_BATCH_ADD : BLOCK_DEVICE_BATCH_REMOVE;
+	uint32_t mode = TRACKING_MODE_SYNC;
+	int index = 1;
+	while( index < argc && argv[index][0] == '-' )
+	{
+		if( strcmp( argv[index], "-a" ) == 0 )
+		{
+			request.flags |= BLOCK_DEVICE_BATCH_ATOMIC;
+		}
+		else if( strcmp( argv[index], "-m" ) == 0 && index + 1 < argc && parse_mode( argv[index + 1], &mode ) == 0 )
+		{
+			index++;
+		}
+		else
+		{
+			return -2;
+		}
+
+		index++;
+	}
+
+	request.nrEntries = argc - index;
+	if( request.nrEntries == 0 || request.nrEntries > BLOCK_DEVICE_BATCH_MAX_ENTRIES )
+	{
+		return -2;
+	}
+
+	struct block_device_batch_entry* entries = calloc( request.nrEntries, sizeof( *entries ) );
+	if( entries == NULL )
+	{
+		return -1;
+	}
+
+	uint32_t entry = 0;
+	while( entry < request.nrEntries )
+	{
+		entries[entry].mode = mode;
+		if( parse_batch_device( argv[index + entry], &entries[entry] ) )
+		{
+			fprintf( stderr, "szs_ctl: invalid device %s\n", argv[index + entry] );
+			free( entries );
+			errno = EINVAL;
+			return -1;
+		}
+
+		entry++;
+	}
+
+	request.entries = ( uintptr_t )entries;
+	int ret = ioctl( fd, BLOCK_DEVICE_BATCH, &request );
+	int savedErrno = errno;
+
+	// Results stay 0 when the request is rejected before any device is handled
+	entry = 0;
+	while( entry < request.nrEntries )
+	{
+		if( entries[entry].result != 0 )
+		{
+			fprintf( stderr, "szs_ctl: %s: %s\n", argv[index + entry], strerror( -entries[entry].result ) );
+		}
+
+		entry++;
+	}
+
+	printf( "%u of %u devices done\n", request.nrSucceeded, request.nrEntries );
+
+	free( entries );
+	errno = savedErrno;
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	if( argc < 2 )
+	{
+		return usage();
+	}
+
+	int fd = open( "/dev/" SZS_TRACKER_CONTROL_DEVICE_NAME, O_RDWR );
+	if( fd < 0 )
+	{
+		fprintf( stderr, "szs_ctl: cannot open /dev/%s: %s\n", SZS_TRACKER_CONTROL_DEVICE_NAME, strerror( errno ) );
+		return 1;
+	}
+
+	int ret = 0;
+	char path[BLOCK_DEVICE_PATH_LEN] = { 0 };
+	if( ( strcmp( argv[1], "add" ) == 0 || strcmp( argv[1], "remove" ) == 0 ) && argc == 3 )
+	{
+		strncpy( path, argv[2], sizeof( path ) - 1 );
+		ret = ioctl( fd, argv[1][0] == 'a' ? BLOCK_DEVICE_ADD : BLOCK_DEVICE_REMOVE, path );
+	}
+	else if( strcmp( argv[1], "mode" ) == 0 && argc == 4 )
+	{
+		struct block_device_mode_request request;
+		memset( &request, 0, sizeof( request ) );
+		strncpy( request.blockDevicePath, argv[2], sizeof( request.blockDevicePath ) - 1 );
+		if( parse_mode( argv[3], &request.mode ) )
+		{
+			close( fd );
+			return usage();
+		}
+
+		ret = ioctl( fd, BLOCK_DEVICE_SET_MODE, &request );
+	}
+	else if( strcmp( argv[1], "reset-latency" ) == 0 && argc == 2 )
+	{
+		ret = ioctl( fd, LATENCY_HISTOGRAMS_RESET );
+	}
+	else if( strcmp( argv[1], "config" ) == 0 )
+	{
+		ret = configure( fd, argc - 2, argv + 2 );
+	}
+	else if( strcmp( argv[1], "batch" ) == 0 )
+	{
+		ret = batch( fd, argc - 2, argv + 2 );
+		if( ret == -2 )
+		{
+			close( fd );
+			return usage();
+		}
+	}
+	else
+	{
+		close( fd );
+		return usage();
+	}
+
+	if( ret < 0 )
+	{
+		fprintf( stderr, "szs_ctl: %s failed: %s\n", argv[1], strerror( errno ) );
+	}
+
+	close( fd );
+	return ret < 0 ? 1 : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,524 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <capture_queue.h>
+#include <linux/module.h>
+#include <linux/hash.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+
+#include <logging.h>
+#include <constants.h>
+#include <transport.h>
+#include <compression.h>
+#include <szs_tracker_module.h>
+#include <szs_tracker_trace.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int captureWorkers = 0;
+module_param_named( capture_workers, captureWorkers, uint, 0444 );
+MODULE_PARM_DESC( capture_workers, "Number of capture worker threads (0 = one per online CPU)" );
+
+static unsigned int captureQueueDepth = CAPTURE_QUEUE_DEFAULT_DEPTH;
+module_param_named( capture_queue_depth, captureQueueDepth, uint, 0644 );
+MODULE_PARM_DESC( capture_queue_depth, "Maximum number of pending change records per queue" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// There is one bounded queue per possible CPU. A record is queued by its device and range of
+// CAPTURE_QUEUE_RANGE_SECTORS sectors rather than by the CPU that captured it, so overwrites of
+// a block go through one queue and one worker in capture order, even when the writer migrates
+// between CPUs. Records spread over several connections still need their sequence numbers to
+// be put back in order. The consumer is the worker the queue is assigned to.
+// The hook statistics are only updated by the local CPU with preemption disabled.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct capture_queue
+{
+	spinlock_t lock;
+	struct list_head records;
+	unsigned int depth;
+	uint64_t enqueued;
+	uint64_t dropped;
+	uint64_t hookCalls;
+	uint64_t hookTotalNs;
+	uint64_t hookMaxNs;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// 'pending' only tells the worker that there may be records to drain: any record a worker
+// finds on its queues is sent, whichever worker was woken for it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct capture_worker
+{
+	struct task_struct *thread;
+	wait_queue_head_t waitQueue;
+	atomic_t pending;
+	unsigned int id;
+	unsigned int nrWorkers;       // Size of the set, queue N is served by worker N % nrWorkers
+	uint64_t sent;
+	struct send_batch batch;
+	struct compress_workspace compression;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The workers are replaced as a whole when their number changes. Producers find the current
+// set under RCU; a retired set keeps running until everything queued before the switch has
+// been sent.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct capture_worker_set
+{
+	unsigned int nrWorkers;
+	struct capture_worker workers[];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static DEFINE_PER_CPU( struct capture_queue, captureQueues );
+static struct capture_worker_set __rcu *workerSet = NULL;
+static DEFINE_MUTEX( workerSetMutex );     // Serializes worker set changes
+static bool queuesInitialized = false;     // The queues exist, set by capture_queue_init
+static uint64_t retiredSent = 0;           // Records sent by retired workers
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function moves all records queued on the queues served by the given worker to a private
+// list and adds them to the worker's send batch one by one.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void capture_worker_drain( struct capture_worker* worker )
+{
+	atomic_set( &worker->pending, 0 );
+
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		if( cpu % worker->nrWorkers != worker->id )
+		{
+			continue;
+		}
+
+		struct capture_queue* queue = per_cpu_ptr( &captureQueues, cpu );
+		LIST_HEAD( records );
+
+		spin_lock_irq( &queue->lock );
+		list_splice_init( &queue->records, &records );
+		queue->depth = 0;
+		spin_unlock_irq( &queue->lock );
+
+		struct change_record *record = NULL, *temp = NULL;
+		list_for_each_entry_safe( record, temp, &records, list )
+		{
+			list_del( &record->list );
+
+			compress_change_record( record, &worker->compression );
+			if( send_batch_add( &worker->batch, record ) )
+			{
+				stats_add( record->stats, STATS_RECORDS_DROPPED, 1 );
+				trace_szs_record_dropped( record->header->deviceId, record->header->sector, record->header->length, DROP_SEND_FAILED );
+				mark_device_overflow( record->header->deviceId, record->header->sector, record->header->length );
+			}
+
+			free_change_record( record );
+			worker->sent++;
+
+			cond_resched();
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Worker thread main loop. While a batch is open, the worker sleeps no longer than the batch
+// deadline and flushes the batch when it expires. On stop, the worker keeps draining until its
+// queues are empty so that no captured change is lost on module unload.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int capture_worker_fn( void* data )
+{
+	struct capture_worker* worker = data;
+
+	while( true )
+	{
+		if( send_batch_is_open( &worker->batch ) )
+		{
+			ktime_t timeout = ktime_sub( worker->batch.deadline, ktime_get() );
+			if( ktime_to_ns( timeout ) <= 0 )
+			{
+				send_batch_flush( &worker->batch );
+				continue;
+			}
+
+			wait_event_interruptible_hrtimeout( worker->waitQueue,
+							    atomic_read( &worker->pending ) > 0 || kthread_should_stop(),
+							    timeout );
+		}
+		else
+		{
+			wait_event_interruptible( worker->waitQueue,
+						  atomic_read( &worker->pending ) > 0 || kthread_should_stop() );
+		}
+
+		if( atomic_read( &worker->pending ) == 0 && kthread_should_stop() )
+		{
+			break;
+		}
+
+		capture_worker_drain( worker );
+	}
+
+	send_batch_flush( &worker->batch );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function stops the workers of a set and frees it. Each worker drains its queues before
+// it exits, so nothing queued before the set was retired is left behind, unless a worker
+// failed to start.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void stop_worker_set( struct capture_worker_set* set )
+{
+	unsigned int index = 0;
+	while( index < set->nrWorkers )
+	{
+		struct capture_worker* worker = &set->workers[index];
+		if( worker->thread != NULL )
+		{
+			// The producers that counted records for this worker are gone, drain once more
+			atomic_inc( &worker->pending );
+			kthread_stop( worker->thread );
+		}
+
+		compress_workspace_cleanup( &worker->compression );
+		retiredSent += worker->sent;
+		index++;
+	}
+
+	kfree( set );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function starts a set of 'count' capture workers.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct capture_worker_set* start_worker_set( unsigned int count )
+{
+	struct capture_worker_set* set = kzalloc( struct_size( set, workers, count ), GFP_KERNEL );
+	if( set == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for capture workers." );
+		return NULL;
+	}
+
+	set->nrWorkers = count;
+
+	unsigned int index = 0;
+	while( index < count )
+	{
+		struct capture_worker* worker = &set->workers[index];
+		init_waitqueue_head( &worker->waitQueue );
+		atomic_set( &worker->pending, 0 );
+		worker->id = index;
+		worker->nrWorkers = count;
+		worker->batch.affinity = index;
+
+		int ret = compress_workspace_init( &worker->compression );
+		if( ret )
+		{
+			stop_worker_set( set );
+			return NULL;
+		}
+
+		worker->thread = kthread_run( capture_worker_fn, worker, "szs_capture/%u", index );
+		if( IS_ERR( worker->thread ) )
+		{
+			ret = PTR_ERR( worker->thread );
+			worker->thread = NULL;
+			LOG_ERROR( ret, "Failed to start capture worker %u.", index );
+			stop_worker_set( set );
+			return NULL;
+		}
+
+		index++;
+	}
+
+	return set;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline unsigned int effective_worker_count( unsigned int count )
+{
+	return clamp_t( unsigned int, count ? count : num_online_cpus(), 1, CAPTURE_QUEUE_MAX_WORKERS );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function initializes the capture queues and starts the capture workers.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int capture_queue_init( void )
+{
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		struct capture_queue* queue = per_cpu_ptr( &captureQueues, cpu );
+		spin_lock_init( &queue->lock );
+		INIT_LIST_HEAD( &queue->records );
+		queue->depth = 0;
+	}
+
+	queuesInitialized = true;
+
+	struct capture_worker_set* set = start_worker_set( effective_worker_count( captureWorkers ) );
+	if( set == NULL )
+	{
+		capture_queue_cleanup();
+		return -ENOMEM;
+	}
+
+	rcu_assign_pointer( workerSet, set );
+
+	LOG_INFO( "Capture queue started with %u workers.", set->nrWorkers );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function replaces the capture workers with a set of 'count' workers (0 = one per
+// online CPU). Producers move to the new set at once; the previous workers send what was
+// queued before the switch and exit. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int capture_queue_set_workers( unsigned int count )
+{
+	unsigned int nrWorkers = effective_worker_count( count );
+
+	mutex_lock( &workerSetMutex );
+	struct capture_worker_set* oldSet = rcu_dereference_protected( workerSet, lockdep_is_held( &workerSetMutex ) );
+	if( oldSet == NULL )
+	{
+		mutex_unlock( &workerSetMutex );
+		return -ENODEV;
+	}
+
+	if( oldSet->nrWorkers != nrWorkers )
+	{
+		struct capture_worker_set* newSet = start_worker_set( nrWorkers );
+		if( newSet == NULL )
+		{
+			mutex_unlock( &workerSetMutex );
+			return -ENOMEM;
+		}
+
+		rcu_assign_pointer( workerSet, newSet );
+
+		// No producer queues records for the previous workers any more
+		synchronize_rcu();
+		stop_worker_set( oldSet );
+
+		LOG_INFO( "Capture queue now runs %u workers.", nrWorkers );
+	}
+
+	captureWorkers = count;
+	mutex_unlock( &workerSetMutex );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the number of running capture workers.
+/////////////////////////////////////////////////////////////////////////////////////////////
+unsigned int capture_queue_worker_count( void )
+{
+	rcu_read_lock();
+	struct capture_worker_set* set = rcu_dereference( workerSet );
+	unsigned int count = set != NULL ? set->nrWorkers : 0;
+	rcu_read_unlock();
+
+	return count;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void capture_queue_set_depth( unsigned int depth )
+{
+	WRITE_ONCE( captureQueueDepth, depth );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+unsigned int capture_queue_get_depth( void )
+{
+	return READ_ONCE( captureQueueDepth );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function stops the capture workers. It must be called after the submission hook has
+// been removed; pending records are sent before the workers exit. It does nothing if
+// capture_queue_init has not run, as when the module initialization fails before it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void capture_queue_cleanup( void )
+{
+	mutex_lock( &workerSetMutex );
+	struct capture_worker_set* set = rcu_dereference_protected( workerSet, lockdep_is_held( &workerSetMutex ) );
+	RCU_INIT_POINTER( workerSet, NULL );
+	mutex_unlock( &workerSetMutex );
+
+	if( set != NULL )
+	{
+		synchronize_rcu();
+		stop_worker_set( set );
+	}
+
+	if( !queuesInitialized )
+	{
+		return;
+	}
+
+	// Workers that failed to start leave their records behind
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		struct capture_queue* queue = per_cpu_ptr( &captureQueues, cpu );
+		struct change_record *record = NULL, *temp = NULL;
+		list_for_each_entry_safe( record, temp, &queue->records, list )
+		{
+			list_del( &record->list );
+			free_change_record( record );
+		}
+
+		queue->depth = 0;
+	}
+
+	queuesInitialized = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function picks the queue of a record from its device and range.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int select_queue( struct change_record* record )
+{
+	uint64_t range = record->header->sector / CAPTURE_QUEUE_RANGE_SECTORS;
+	unsigned int cpu = hash_64( range ^ ( ( uint64_t )record->header->deviceId << 48 ), 32 ) % nr_cpu_ids;
+	while( !cpu_possible( cpu ) )
+	{
+		cpu = ( cpu + 1 ) % nr_cpu_ids;
+	}
+
+	return cpu;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function queues a change record on the queue of its range and wakes up its worker. It
+// never sleeps; when the queue is full, -ENOSPC is returned and the record stays with the
+// caller.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int capture_queue_enqueue( struct change_record* record )
+{
+	rcu_read_lock();
+	struct capture_worker_set* set = rcu_dereference( workerSet );
+	if( set == NULL )
+	{
+		rcu_read_unlock();
+		return -ENODEV;
+	}
+
+	unsigned long flags;
+	unsigned int cpu = select_queue( record );
+	struct capture_queue* queue = per_cpu_ptr( &captureQueues, cpu );
+	struct capture_worker* worker = &set->workers[cpu % set->nrWorkers];
+
+	spin_lock_irqsave( &queue->lock, flags );
+	if( queue->depth >= READ_ONCE( captureQueueDepth ) )
+	{
+		queue->dropped++;
+		spin_unlock_irqrestore( &queue->lock, flags );
+		rcu_read_unlock();
+
+		return -ENOSPC;
+	}
+
+	list_add_tail( &record->list, &queue->records );
+	queue->depth++;
+	queue->enqueued++;
+	trace_szs_record_enqueued( record->header, queue->depth );
+	spin_unlock_irqrestore( &queue->lock, flags );
+
+	atomic_inc( &worker->pending );
+	if( wq_has_sleeper( &worker->waitQueue ) )
+	{
+		wake_up( &worker->waitQueue );
+	}
+
+	rcu_read_unlock();
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function accounts the time spent by the submission hook on a tracked bio.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void capture_queue_account_hook( u64 elapsedNs )
+{
+	struct capture_queue* queue = get_cpu_ptr( &captureQueues );
+
+	queue->hookCalls++;
+	queue->hookTotalNs += elapsedNs;
+	if( elapsedNs > queue->hookMaxNs )
+	{
+		queue->hookMaxNs = elapsedNs;
+	}
+
+	put_cpu_ptr( &captureQueues );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function aggregates the per-CPU queue statistics. The values are read without locking
+// and are only meant for monitoring.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void capture_queue_get_stats( struct capture_queue_stats* stats )
+{
+	memset( stats, 0, sizeof( *stats ) );
+
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		struct capture_queue* queue = per_cpu_ptr( &captureQueues, cpu );
+		stats->enqueued    += READ_ONCE( queue->enqueued );
+		stats->dropped     += READ_ONCE( queue->dropped );
+		stats->depth       += READ_ONCE( queue->depth );
+		stats->hookCalls   += READ_ONCE( queue->hookCalls );
+		stats->hookTotalNs += READ_ONCE( queue->hookTotalNs );
+		stats->hookMaxNs    = max_t( uint64_t, stats->hookMaxNs, READ_ONCE( queue->hookMaxNs ) );
+	}
+
+	stats->sent = READ_ONCE( retiredSent );
+
+	rcu_read_lock();
+	struct capture_worker_set* set = rcu_dereference( workerSet );
+	unsigned int index = 0;
+	while( set != NULL && index < set->nrWorkers )
+	{
+		stats->sent += READ_ONCE( set->workers[index].sent );
+		index++;
+	}
+
+	rcu_read_unlock();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the number of records waiting in all queues, read without locking.
+/////////////////////////////////////////////////////////////////////////////////////////////
+unsigned int capture_queue_backlog( void )
+{
+	unsigned int backlog = 0;
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		backlog += READ_ONCE( per_cpu_ptr( &captureQueues, cpu )->depth );
+	}
+
+	return backlog;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
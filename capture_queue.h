@@ -0,0 +1,35 @@
+#ifndef SZS_TRACKER_CAPTURE_QUEUE_H
+#define SZS_TRACKER_CAPTURE_QUEUE_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/types.h>
+#include <change_record.h>
+#include <ioctl_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int capture_queue_init( void );
+void capture_queue_cleanup( void );
+int capture_queue_enqueue( struct change_record* record );
+void capture_queue_account_hook( u64 elapsedNs );
+void capture_queue_get_stats( struct capture_queue_stats* stats );
+unsigned int capture_queue_backlog( void );
+int capture_queue_set_workers( unsigned int count );
+unsigned int capture_queue_worker_count( void );
+void capture_queue_set_depth( unsigned int depth );
+unsigned int capture_queue_get_depth( void );
+
+#endif // SZS_TRACKER_CAPTURE_QUEUE_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,209 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <cbt_bitmap.h>
+#include <linux/bitmap.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include <logging.h>
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+size_t cbt_bitmap_size( struct cbt_bitmap* cbt )
+{
+	return BITS_TO_LONGS( cbt->nrBits ) * sizeof( unsigned long );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function allocates a bitmap covering 'capacity' sectors with one bit per 'granularity'
+// bytes. The granularity must be a power of two between CBT_MIN_GRANULARITY and
+// CBT_MAX_GRANULARITY.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct cbt_bitmap* cbt_bitmap_create( sector_t capacity, unsigned int granularity )
+{
+	if( !is_power_of_2( granularity ) || granularity < CBT_MIN_GRANULARITY || granularity > CBT_MAX_GRANULARITY )
+	{
+		LOG_ERROR( -EINVAL, "Invalid CBT granularity %u.", granularity );
+		return NULL;
+	}
+
+	struct cbt_bitmap* cbt = kzalloc( sizeof( *cbt ), GFP_KERNEL );
+	if( cbt == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for CBT bitmap." );
+		return NULL;
+	}
+
+	cbt->granularity = granularity;
+	cbt->chunkShift  = ilog2( granularity ) - ilog2( BIO_SECTOR_SIZE );
+	cbt->nrBits      = max_t( uint64_t, 1, DIV_ROUND_UP_ULL( ( uint64_t )capacity, 1ULL << cbt->chunkShift ) );
+	mutex_init( &cbt->fetchMutex );
+
+	unsigned long* active = kvzalloc( cbt_bitmap_size( cbt ), GFP_KERNEL );
+	cbt->spare = kvzalloc( cbt_bitmap_size( cbt ), GFP_KERNEL );
+	if( active == NULL || cbt->spare == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate %zu bytes for CBT bitmap.", cbt_bitmap_size( cbt ) );
+		kvfree( active );
+		kvfree( cbt->spare );
+		kfree( cbt );
+		return NULL;
+	}
+
+	RCU_INIT_POINTER( cbt->active, active );
+	return cbt;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function frees the bitmap. The caller must make sure that no writer can still see it,
+// i.e. a grace period has elapsed since it was unpublished.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void cbt_bitmap_destroy( struct cbt_bitmap* cbt )
+{
+	if( cbt == NULL )
+	{
+		return;
+	}
+
+	kvfree( rcu_dereference_protected( cbt->active, true ) );
+	kvfree( cbt->spare );
+	kfree( cbt );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function computes the chunks covering 'size' bytes starting at 'sector'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void cbt_bitmap_chunks( struct cbt_bitmap* cbt, sector_t sector, uint64_t size, uint64_t* firstChunk, uint64_t* lastChunk )
+{
+	*firstChunk = ( uint64_t )sector >> cbt->chunkShift;
+	*lastChunk  = ( ( uint64_t )sector + DIV_ROUND_UP_ULL( size, BIO_SECTOR_SIZE ) - 1 ) >> cbt->chunkShift;
+	*lastChunk  = min_t( uint64_t, *lastChunk, cbt->nrBits - 1 );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function marks the chunks covering 'size' bytes starting at 'sector' as dirty. It is
+// called from the submission path, so it only does a few bit operations. Bits that are already
+// set are tested first to avoid bouncing the cache line on hot blocks.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void cbt_bitmap_mark( struct cbt_bitmap* cbt, sector_t sector, uint64_t size )
+{
+	if( size == 0 )
+	{
+		return;
+	}
+
+	uint64_t firstChunk, lastChunk;
+	cbt_bitmap_chunks( cbt, sector, size, &firstChunk, &lastChunk );
+
+	rcu_read_lock();
+	unsigned long* bitmap = rcu_dereference( cbt->active );
+
+	uint64_t chunk = firstChunk;
+	while( chunk <= lastChunk )
+	{
+		if( !test_bit( chunk, bitmap ) )
+		{
+			set_bit( chunk, bitmap );
+		}
+
+		chunk++;
+	}
+
+	rcu_read_unlock();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies the dirty bitmap to user space and resets it in one atomic step.
+// Bit N of the returned buffer (little-endian bit order, bit 0 is the lowest bit of byte 0)
+// stands for bytes [N * granularity, (N + 1) * granularity) of the device. If the copy fails,
+// the dirty bits are merged back so that no change is lost.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int cbt_bitmap_fetch_and_reset( struct cbt_bitmap* cbt, void __user *buffer, uint64_t bufferSize )
+{
+	size_t bytes = cbt_bitmap_size( cbt );
+	if( bufferSize < bytes )
+	{
+		return -ENOSPC;
+	}
+
+	unsigned long* dirty = cbt_bitmap_swap( cbt );
+
+	int ret = 0;
+	if( copy_to_user( buffer, dirty, bytes ) )
+	{
+		ret = -EFAULT;
+
+		unsigned long* fresh = rcu_dereference_protected( cbt->active, lockdep_is_held( &cbt->fetchMutex ) );
+		unsigned long bit;
+		for_each_set_bit( bit, dirty, cbt->nrBits )
+		{
+			set_bit( bit, fresh );
+		}
+	}
+
+	cbt_bitmap_release( cbt, dirty );
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function makes the spare bitmap active and returns the previously active one, with no
+// writer left on it. The caller owns the returned bitmap until it hands it back with
+// cbt_bitmap_release; further swaps wait until then.
+/////////////////////////////////////////////////////////////////////////////////////////////
+unsigned long* cbt_bitmap_swap( struct cbt_bitmap* cbt )
+{
+	mutex_lock( &cbt->fetchMutex );
+
+	unsigned long* dirty = rcu_dereference_protected( cbt->active, lockdep_is_held( &cbt->fetchMutex ) );
+	rcu_assign_pointer( cbt->active, cbt->spare );
+
+	// Wait for writers that may still be setting bits in the old bitmap
+	synchronize_rcu();
+
+	return dirty;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function clears a bitmap returned by cbt_bitmap_swap and makes it the spare again.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void cbt_bitmap_release( struct cbt_bitmap* cbt, unsigned long* dirty )
+{
+	memset( dirty, 0, cbt_bitmap_size( cbt ) );
+	cbt->spare = dirty;
+
+	mutex_unlock( &cbt->fetchMutex );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function tells whether any chunk covering 'size' bytes starting at 'sector' is set in
+// the given bitmap, which must have the geometry of 'cbt'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+bool cbt_bitmap_range_in( struct cbt_bitmap* cbt, const unsigned long* bitmap, sector_t sector, uint64_t size )
+{
+	if( size == 0 )
+	{
+		return false;
+	}
+
+	uint64_t firstChunk, lastChunk;
+	cbt_bitmap_chunks( cbt, sector, size, &firstChunk, &lastChunk );
+
+	return find_next_bit( bitmap, lastChunk + 1, firstChunk ) <= lastChunk;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,48 @@
+#ifndef SZS_TRACKER_CBT_BITMAP_H
+#define SZS_TRACKER_CBT_BITMAP_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/types.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Changed block tracking bitmap. Bit N is set when any sector of chunk N was written since the
+// last fetch. Writers only touch the active bitmap under rcu_read_lock; a fetch swaps the
+// active and the spare bitmap so that it never races with a writer.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct cbt_bitmap
+{
+	unsigned long __rcu *active;
+	unsigned long *spare;
+	uint64_t nrBits;
+	unsigned int granularity;
+	unsigned int chunkShift;    // log2 of the chunk size in sectors
+	struct mutex fetchMutex;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct cbt_bitmap* cbt_bitmap_create( sector_t capacity, unsigned int granularity );
+void cbt_bitmap_destroy( struct cbt_bitmap* cbt );
+size_t cbt_bitmap_size( struct cbt_bitmap* cbt );
+void cbt_bitmap_mark( struct cbt_bitmap* cbt, sector_t sector, uint64_t size );
+int cbt_bitmap_fetch_and_reset( struct cbt_bitmap* cbt, void __user *buffer, uint64_t bufferSize );
+unsigned long* cbt_bitmap_swap( struct cbt_bitmap* cbt );
+void cbt_bitmap_release( struct cbt_bitmap* cbt, unsigned long* dirty );
+bool cbt_bitmap_range_in( struct cbt_bitmap* cbt, const unsigned long* bitmap, sector_t sector, uint64_t size );
+
+#endif // SZS_TRACKER_CBT_BITMAP_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
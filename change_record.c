@@ -0,0 +1,626 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <change_record.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/crc32c.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include <kernel_compat.h>
+#include <logging.h>
+#include <constants.h>
+#include <latency.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool wireCrc = false;
+module_param_named( wire_crc, wireCrc, bool, 0644 );
+MODULE_PARM_DESC( wire_crc, "Protect record payloads with a CRC32C" );
+
+static bool zeroDetection = true;
+module_param_named( zero_detection, zeroDetection, bool, 0644 );
+MODULE_PARM_DESC( zero_detection, "Send writes of all-zero data as zero ranges without payload" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Captured payloads are accounted against a global budget, so that a slow or absent receiver
+// cannot make the module hoard memory. Once the budget is exhausted, captures fail and the
+// changes are tracked as dirty ranges instead.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int captureBudgetMb = CAPTURE_DEFAULT_BUDGET_MB;
+module_param_named( capture_budget_mb, captureBudgetMb, uint, 0644 );
+MODULE_PARM_DESC( capture_budget_mb, "Memory in MiB that captured changes waiting to be sent may use" );
+
+static atomic_long_t capturedBytes = ATOMIC_LONG_INIT( 0 );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline long capture_budget( void )
+{
+	return ( long )READ_ONCE( captureBudgetMb ) << 20;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool charge_capture_budget( struct change_record* record, size_t bytes )
+{
+	if( atomic_long_add_return( bytes, &capturedBytes ) > capture_budget() )
+	{
+		atomic_long_sub( bytes, &capturedBytes );
+		return false;
+	}
+
+	record->chargedBytes = bytes;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function tells whether captured data uses more than half of the budget; background
+// work such as resynchronization backs off until it does not.
+/////////////////////////////////////////////////////////////////////////////////////////////
+bool change_record_under_pressure( void )
+{
+	return atomic_long_read( &capturedBytes ) > capture_budget() / 2;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets the record type and flags that describe the operation of a BIO. Discards
+// and write-zeroes only carry their range, an empty flush is a barrier record.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void populate_change_record_op( struct bio* bio, struct szs_record_header* header )
+{
+	header->opType = SZS_OP_WRITE;
+	switch( bio_op( bio ) )
+	{
+		case REQ_OP_DISCARD:
+		case REQ_OP_SECURE_ERASE:
+			header->flags |= SZS_RECORD_FLAG_DISCARD;
+			break;
+		case REQ_OP_WRITE_ZEROES:
+			header->flags |= SZS_RECORD_FLAG_ZERO;
+			break;
+		default:
+			if( !bio_has_data( bio ) )
+			{
+				header->opType = SZS_OP_FLUSH;
+				return;
+			}
+			break;
+	}
+
+	if( bio->bi_opf & REQ_PREFLUSH )
+	{
+		header->flags |= SZS_RECORD_FLAG_PREFLUSH;
+	}
+
+	if( bio->bi_opf & REQ_FUA )
+	{
+		header->flags |= SZS_RECORD_FLAG_FUA;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function populates a record header with information extracted from a BIO.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void populate_change_record_header( struct bio* bio, uint32_t deviceId, uint64_t sequence, struct szs_record_header* header )
+{
+	memset( header, 0, sizeof( *header ) );
+	header->version       = SZS_WIRE_VERSION;
+	header->deviceId      = deviceId;
+	header->sequence      = sequence;
+	header->sector        = bio->bi_iter.bi_sector;
+	header->length        = bio_sectors( bio )* BIO_SECTOR_SIZE;
+	header->payloadLength = bio_has_data( bio ) ? header->length : 0;
+	header->timestampNs   = ktime_get_real_ns();
+	populate_change_record_op( bio, header );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Headers are carved from per-CPU page fragment caches. Fragments are rounded up to a power
+// of two so that a header never straddles a page boundary.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#define HEADER_FRAG_SIZE roundup_pow_of_two( sizeof( struct szs_record_header ) )
+
+static DEFINE_PER_CPU( struct page_frag_cache, headerFragCache );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The hook may run in process and interrupt context on the same CPU, so the cache is only
+// touched with interrupts disabled; a refill therefore must not sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct szs_record_header* alloc_header( void )
+{
+	unsigned long flags;
+	local_irq_save( flags );
+	void* header = page_frag_alloc( this_cpu_ptr( &headerFragCache ), HEADER_FRAG_SIZE, GFP_NOWAIT | __GFP_NOWARN );
+	local_irq_restore( flags );
+
+	return header;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function allocates a change record with room for 'nrPayloadVecs' payload vectors and
+// points vecs[0] at its header.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct change_record* alloc_change_record( unsigned int nrPayloadVecs, gfp_t gfpMask )
+{
+	struct change_record* record = kzalloc( struct_size( record, vecs, nrPayloadVecs + 1 ), gfpMask );
+	if( record == NULL )
+	{
+		return NULL;
+	}
+
+	record->header = alloc_header();
+	if( record->header == NULL )
+	{
+		kfree( record );
+		return NULL;
+	}
+
+	INIT_LIST_HEAD( &record->list );
+	record->vecs[0].bv_page   = virt_to_page( record->header );
+	record->vecs[0].bv_offset = offset_in_page( record->header );
+	record->vecs[0].bv_len    = sizeof( *record->header );
+
+	return record;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function releases the payload, the header and the change record itself. Pages may
+// still be referenced by the socket after a zero-copy send, so only our references are
+// dropped.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void free_change_record( struct change_record* record )
+{
+	if( record == NULL )
+	{
+		return;
+	}
+
+	if( record->ownsPages )
+	{
+		struct bio_vec* payload = change_record_payload( record );
+		unsigned int index = 0;
+		while( index < record->nrVecs )
+		{
+			put_page( payload[index].bv_page );
+			index++;
+		}
+	}
+
+	if( record->bio != NULL )
+	{
+		bio_put( record->bio );
+	}
+
+	if( record->chargedBytes )
+	{
+		atomic_long_sub( record->chargedBytes, &capturedBytes );
+	}
+
+	device_stats_put( record->stats );
+
+	page_frag_free( record->header );
+	kfree( record );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function turns a record whose payload is all zeroes into a zero range without payload,
+// and lets go of the pages. memchr_inv compares a word at a time and stops at the first byte
+// that is not zero, so checking ordinary data costs next to nothing.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void compact_zero_payload( struct change_record* record )
+{
+	if( !READ_ONCE( zeroDetection ) || record->nrVecs == 0 || record->header->payloadLength != record->header->length )
+	{
+		return;
+	}
+
+	struct bio_vec* payload = change_record_payload( record );
+	unsigned int index = 0;
+	while( index < record->nrVecs )
+	{
+		char* src = kmap_atomic( payload[index].bv_page );
+		bool zero = memchr_inv( src + payload[index].bv_offset, 0, payload[index].bv_len ) == NULL;
+		kunmap_atomic( src );
+
+		if( !zero )
+		{
+			return;
+		}
+
+		index++;
+	}
+
+	if( record->ownsPages )
+	{
+		index = 0;
+		while( index < record->nrVecs )
+		{
+			put_page( payload[index].bv_page );
+			index++;
+		}
+	}
+
+	if( record->bio != NULL )
+	{
+		bio_put( record->bio );
+		record->bio = NULL;
+	}
+
+	if( record->chargedBytes )
+	{
+		atomic_long_sub( record->chargedBytes, &capturedBytes );
+		record->chargedBytes = 0;
+	}
+
+	record->nrVecs = 0;
+	record->header->payloadLength = 0;
+	record->header->flags |= SZS_RECORD_FLAG_ZERO;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function charges 'length' bytes against the capture budget and allocates the payload
+// pages of a record for them. On failure the caller frees the record.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int alloc_payload_pages( struct change_record* record, unsigned int nrPages, unsigned int length, gfp_t gfpMask )
+{
+	if( !charge_capture_budget( record, ( size_t )nrPages * PAGE_SIZE ) )
+	{
+		return -ENOBUFS;
+	}
+
+	record->ownsPages = true;
+
+	struct bio_vec* payload = change_record_payload( record );
+	unsigned int remaining = length;
+	while( record->nrVecs < nrPages )
+	{
+		struct page* page = alloc_page( gfpMask );
+		if( page == NULL )
+		{
+			return -ENOMEM;
+		}
+
+		payload[record->nrVecs].bv_page   = page;
+		payload[record->nrVecs].bv_offset = 0;
+		payload[record->nrVecs].bv_len    = min_t( unsigned int, remaining, PAGE_SIZE );
+		remaining -= payload[record->nrVecs].bv_len;
+		record->nrVecs++;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies the data of a write BIO into a newly allocated change record.
+// The payload pages are allocated from lowmem, so they can be addressed directly while the
+// source page is mapped. The record of a data-less BIO is only a header.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_record* capture_change_record( struct bio* bio, uint32_t deviceId, uint64_t sequence, gfp_t gfpMask )
+{
+	unsigned int dataSize = bio_has_data( bio ) ? bio->bi_iter.bi_size : 0;
+	unsigned int nrPages = DIV_ROUND_UP( dataSize, PAGE_SIZE );
+
+	struct change_record* record = alloc_change_record( nrPages, gfpMask );
+	if( record == NULL )
+	{
+		return NULL;
+	}
+
+	u64 stageStart = latency_start();
+	populate_change_record_header( bio, deviceId, sequence, record->header );
+	latency_end( STAGE_HEADER, stageStart );
+
+	if( dataSize == 0 )
+	{
+		return record;
+	}
+
+	if( alloc_payload_pages( record, nrPages, dataSize, gfpMask ) )
+	{
+		free_change_record( record );
+		return NULL;
+	}
+
+	struct bio_vec* payload = change_record_payload( record );
+
+	struct bio_vec bvec;
+	struct bvec_iter bvecItr;
+	unsigned int copied = 0;
+	stageStart = latency_start();
+
+	bio_for_each_segment( bvec, bio, bvecItr )
+	{
+		char* src = kmap_atomic( bvec.bv_page );
+		unsigned int segmentCopied = 0;
+
+		// A source segment may straddle two destination pages
+		while( segmentCopied < bvec.bv_len )
+		{
+			unsigned int dstIndex  = copied / PAGE_SIZE;
+			unsigned int dstOffset = copied % PAGE_SIZE;
+			unsigned int chunk     = min_t( unsigned int, bvec.bv_len - segmentCopied, PAGE_SIZE - dstOffset );
+
+			memcpy( page_address( payload[dstIndex].bv_page ) + dstOffset,
+				src + bvec.bv_offset + segmentCopied, chunk );
+
+			segmentCopied += chunk;
+			copied += chunk;
+		}
+
+		kunmap_atomic( src );
+	}
+
+	// The data just copied is still in the cache
+	compact_zero_payload( record );
+
+	latency_end( STAGE_COPY, stageStart );
+	return record;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function builds a change record whose payload vectors point at the pages of a BIO,
+// without copying them. It is only valid while the bio has not been submitted, which is the
+// case for the synchronous path. The record of a data-less BIO is only a header.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_record* map_change_record( struct bio* bio, uint32_t deviceId, uint64_t sequence, gfp_t gfpMask )
+{
+	struct change_record* record = alloc_change_record( bio_has_data( bio ) ? bio_segments( bio ) : 0, gfpMask );
+	if( record == NULL )
+	{
+		return NULL;
+	}
+
+	u64 stageStart = latency_start();
+	populate_change_record_header( bio, deviceId, sequence, record->header );
+	latency_end( STAGE_HEADER, stageStart );
+
+	if( !bio_has_data( bio ) )
+	{
+		return record;
+	}
+
+	struct bio_vec bvec;
+	struct bvec_iter bvecItr;
+	struct bio_vec* payload = change_record_payload( record );
+
+	bio_for_each_segment( bvec, bio, bvecItr )
+	{
+		payload[record->nrVecs] = bvec;
+		record->nrVecs++;
+	}
+
+	bio_get( bio );
+	record->bio = bio;
+	compact_zero_payload( record );
+
+	return record;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reads payload pages of a record, from 'index' on, starting at 'sector'. The
+// device may accept fewer pages in one bio than asked for; the pages it refuses are left for
+// the next call. It returns the number of bytes read, or a negative error code.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int read_payload_pages( struct block_device* blockDevice, struct change_record* record, unsigned int index, sector_t sector )
+{
+	unsigned int nrPages = record->nrVecs - index;
+
+	#ifdef HAS_BIO_ALLOC_BDEV
+	struct bio* bio = bio_alloc( blockDevice, nrPages, REQ_OP_READ, GFP_KERNEL );
+	#else
+	struct bio* bio = bio_alloc( GFP_KERNEL, nrPages );
+	bio_set_dev( bio, blockDevice );
+	bio->bi_opf = REQ_OP_READ;
+	#endif
+
+	bio->bi_iter.bi_sector = sector;
+
+	struct bio_vec* payload = change_record_payload( record );
+	unsigned int size = 0;
+	while( index < record->nrVecs &&
+	       bio_add_page( bio, payload[index].bv_page, payload[index].bv_len, 0 ) == payload[index].bv_len )
+	{
+		size += payload[index].bv_len;
+		index++;
+	}
+
+	int ret = size > 0 ? submit_bio_wait( bio ) : -EIO;
+	bio_put( bio );
+
+	return ret ? ret : size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reads 'length' bytes at 'sector' from a block device into a new change record,
+// as if they had just been written. It is used to resend ranges whose changes could not be
+// captured. It sleeps until the read completes.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_record* read_change_record( struct block_device* blockDevice, uint32_t deviceId, uint64_t sequence, sector_t sector, unsigned int length )
+{
+	unsigned int nrPages = DIV_ROUND_UP( length, PAGE_SIZE );
+	struct change_record* record = alloc_change_record( nrPages, GFP_KERNEL );
+	if( record == NULL )
+	{
+		return NULL;
+	}
+
+	struct szs_record_header* header = record->header;
+	memset( header, 0, sizeof( *header ) );
+	header->version       = SZS_WIRE_VERSION;
+	header->opType        = SZS_OP_WRITE;
+	header->deviceId      = deviceId;
+	header->sequence      = sequence;
+	header->sector        = sector;
+	header->length        = length;
+	header->payloadLength = length;
+	header->timestampNs   = ktime_get_real_ns();
+
+	if( alloc_payload_pages( record, nrPages, length, GFP_KERNEL ) )
+	{
+		free_change_record( record );
+		return NULL;
+	}
+
+	// Pages are whole, so every bio but the last ends on a page boundary
+	int ret = 0;
+	unsigned int readBytes = 0;
+	while( readBytes < length )
+	{
+		ret = read_payload_pages( blockDevice, record, readBytes / PAGE_SIZE, sector + readBytes / BIO_SECTOR_SIZE );
+		if( ret < 0 )
+		{
+			break;
+		}
+
+		readBytes += ret;
+		ret = 0;
+	}
+
+	if( ret )
+	{
+		LOG_ERROR( ret, "Failed to read %u bytes at sector %llu for resync.", length, ( unsigned long long )sector );
+		free_change_record( record );
+		return NULL;
+	}
+
+	compact_zero_payload( record );
+
+	return record;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function keeps the first 'nrVecs' payload pages of a captured record and releases the
+// others, along with the part of the capture budget they were charged for.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void trim_change_record_payload( struct change_record* record, unsigned int nrVecs )
+{
+	struct bio_vec* payload = change_record_payload( record );
+	unsigned int index = nrVecs;
+	while( index < record->nrVecs )
+	{
+		put_page( payload[index].bv_page );
+		index++;
+	}
+
+	size_t released = min_t( size_t, ( size_t )( record->nrVecs - nrVecs ) * PAGE_SIZE, record->chargedBytes );
+	if( released )
+	{
+		atomic_long_sub( released, &capturedBytes );
+		record->chargedBytes -= released;
+	}
+
+	record->nrVecs = nrVecs;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function replaces the payload of a captured record with 'size' bytes of 'data', which
+// must fit in a page. The first payload page is reused, the others are released.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void replace_change_record_payload( struct change_record* record, const void* data, unsigned int size )
+{
+	struct bio_vec* payload = change_record_payload( record );
+	memcpy( page_address( payload[0].bv_page ), data, size );
+	payload[0].bv_len = size;
+
+	trim_change_record_payload( record, 1 );
+	record->header->payloadLength = size;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function appends the payload of 'second' to 'first', two captured records of adjacent
+// ranges, and returns the merged record. The payload of 'first' must fill whole pages. Both
+// records are consumed. On allocation failure NULL is returned and both are left untouched.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_record* merge_change_records( struct change_record* first, struct change_record* second, gfp_t gfpMask )
+{
+	struct change_record* merged = alloc_change_record( first->nrVecs + second->nrVecs, gfpMask );
+	if( merged == NULL )
+	{
+		return NULL;
+	}
+
+	*merged->header = *first->header;
+	merged->header->length        += second->header->length;
+	merged->header->payloadLength += second->header->payloadLength;
+	merged->header->timestampNs    = second->header->timestampNs;
+
+	struct bio_vec* payload = change_record_payload( merged );
+	memcpy( payload, change_record_payload( first ), first->nrVecs * sizeof( *payload ) );
+	memcpy( payload + first->nrVecs, change_record_payload( second ), second->nrVecs * sizeof( *payload ) );
+	merged->nrVecs       = first->nrVecs + second->nrVecs;
+	merged->ownsPages    = true;
+	merged->compress     = first->compress || second->compress;
+	merged->chargedBytes = first->chargedBytes + second->chargedBytes;
+	merged->stats        = first->stats;
+
+	// The pages, the budget charge and the counters reference now belong to the merged record
+	first->nrVecs = 0;
+	first->chargedBytes = 0;
+	first->stats = NULL;
+	second->nrVecs = 0;
+	second->chargedBytes = 0;
+	free_change_record( first );
+	free_change_record( second );
+
+	return merged;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function finalizes the header of a record right before it is sent, once the payload
+// will no longer change: it adds the payload checksum when 'wire_crc' is set.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void seal_change_record( struct change_record* record )
+{
+	if( !READ_ONCE( wireCrc ) || ( record->header->flags & SZS_RECORD_FLAG_CRC32C ) )
+	{
+		return;
+	}
+
+	struct bio_vec* payload = change_record_payload( record );
+	u32 crc = ~0;
+	unsigned int index = 0;
+	while( index < record->nrVecs )
+	{
+		char* src = kmap_atomic( payload[index].bv_page );
+		crc = crc32c( crc, src + payload[index].bv_offset, payload[index].bv_len );
+		kunmap_atomic( src );
+		index++;
+	}
+
+	record->header->crc32c = ~crc;
+	record->header->flags |= SZS_RECORD_FLAG_CRC32C;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the pages cached for header allocation. It must be called once no
+// change record is left.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void change_record_cleanup( void )
+{
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		struct page_frag_cache* cache = per_cpu_ptr( &headerFragCache, cpu );
+		if( cache->va != NULL )
+		{
+			__page_frag_cache_drain( virt_to_head_page( cache->va ), cache->pagecnt_bias );
+			cache->va = NULL;
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
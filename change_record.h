@@ -0,0 +1,97 @@
+#ifndef SZS_TRACKER_CHANGE_RECORD_H
+#define SZS_TRACKER_CHANGE_RECORD_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/list.h>
+#include <linux/rbtree.h>
+#include <linux/time.h>
+#include <constants.h>
+#include <wire_format.h>
+#include <stats.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// A change record describes everything that goes on the wire for one bio, as one array of
+// bio_vecs: vecs[0] is the record header, the payload vectors follow. This lets the transport send
+// a record with a single sendmsg.
+//
+// A captured record owns a private copy of the data, packed in whole pages (only the last
+// payload vector may be shorter than PAGE_SIZE), so it can outlive the bio. A mapped record
+// borrows the pages of a bio that has not been submitted yet and holds a bio reference.
+//
+// The header lives in a page fragment rather than in the slab, so that it can be spliced
+// into a socket together with the payload pages.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_record
+{
+	struct list_head list;
+	struct szs_record_header *header;
+	struct bio *bio;              // Set for mapped records only
+	bool ownsPages;
+	bool compress;                // Compress the payload before sending, captured records only
+	size_t chargedBytes;          // Bytes accounted against the capture budget
+	struct device_stats *stats;   // Counters of the device, referenced, may be NULL
+	struct rb_node extentNode;    // Absorption window of the device, captured records only
+	sector_t extentSubtreeLast;
+	unsigned int nrVecs;          // Number of payload vectors, the header is not counted
+	struct bio_vec vecs[];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline struct bio_vec* change_record_payload( struct change_record* record )
+{
+	return &record->vecs[1];
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline size_t change_record_wire_length( struct change_record* record )
+{
+	return record->vecs[0].bv_len + record->header->payloadLength;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function tells whether a write BIO goes on the wire. Data writes, discards, write-zeroes
+// and flushes do; zone management and other data-less operations do not.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool bio_has_change( struct bio* bio )
+{
+	switch( bio_op( bio ) )
+	{
+		case REQ_OP_DISCARD:
+		case REQ_OP_SECURE_ERASE:
+		case REQ_OP_WRITE_ZEROES:
+			return true;
+		default:
+			return bio_has_data( bio ) || ( bio->bi_opf & REQ_PREFLUSH );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void populate_change_record_header( struct bio* bio, uint32_t deviceId, uint64_t sequence, struct szs_record_header* header );
+struct change_record* capture_change_record( struct bio* bio, uint32_t deviceId, uint64_t sequence, gfp_t gfpMask );
+struct change_record* map_change_record( struct bio* bio, uint32_t deviceId, uint64_t sequence, gfp_t gfpMask );
+struct change_record* read_change_record( struct block_device* blockDevice, uint32_t deviceId, uint64_t sequence, sector_t sector, unsigned int length );
+void trim_change_record_payload( struct change_record* record, unsigned int nrVecs );
+void replace_change_record_payload( struct change_record* record, const void* data, unsigned int size );
+struct change_record* merge_change_records( struct change_record* first, struct change_record* second, gfp_t gfpMask );
+void seal_change_record( struct change_record* record );
+bool change_record_under_pressure( void );
+void free_change_record( struct change_record* record );
+void change_record_cleanup( void );
+
+#endif // SZS_TRACKER_CHANGE_RECORD_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
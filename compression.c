@@ -0,0 +1,156 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <compression.h>
+#include <linux/kernel.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include <logging.h>
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The LZ4 compressor is only available when the kernel is built with it; without it the
+// compression stage does nothing and enabling it on a device fails.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#if IS_ENABLED( CONFIG_LZ4_COMPRESS )
+#define HAS_LZ4_COMPRESS
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+bool compression_supported( void )
+{
+	#ifdef HAS_LZ4_COMPRESS
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int compress_workspace_init( struct compress_workspace* workspace )
+{
+	memset( workspace, 0, sizeof( *workspace ) );
+
+	#ifdef HAS_LZ4_COMPRESS
+	workspace->wrkmem = vmalloc( LZ4_MEM_COMPRESS );
+	if( workspace->wrkmem == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate compression workspace." );
+		return -ENOMEM;
+	}
+	#endif
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void compress_workspace_cleanup( struct compress_workspace* workspace )
+{
+	vfree( workspace->wrkmem );
+	kvfree( workspace->buffer );
+	memset( workspace, 0, sizeof( *workspace ) );
+}
+
+#ifdef HAS_LZ4_COMPRESS
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function makes sure the output buffer can hold the worst case for 'size' input bytes.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool reserve_compress_buffer( struct compress_workspace* workspace, size_t size )
+{
+	size_t bound = LZ4_compressBound( size );
+	if( bound <= workspace->bufferSize )
+	{
+		return true;
+	}
+
+	kvfree( workspace->buffer );
+	workspace->buffer = kvmalloc( bound, GFP_KERNEL );
+	workspace->bufferSize = workspace->buffer ? bound : 0;
+
+	return workspace->buffer != NULL;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function compresses the payload of a captured change record in place. The payload
+// pages are mapped into one contiguous range, compressed into the workspace buffer, and the
+// result is copied back over the first pages; the pages no longer needed are released.
+// The record is left untouched when it was not marked for compression, does not own its
+// pages, or does not get smaller. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void compress_change_record( struct change_record* record, struct compress_workspace* workspace )
+{
+	#ifdef HAS_LZ4_COMPRESS
+	if( !record->compress || !record->ownsPages || record->nrVecs == 0 )
+	{
+		return;
+	}
+
+	size_t size = record->header->payloadLength;
+	if( size > INT_MAX || !reserve_compress_buffer( workspace, size ) )
+	{
+		return;
+	}
+
+	struct bio_vec* payload = change_record_payload( record );
+	struct page** pages = kmalloc_array( record->nrVecs, sizeof( *pages ), GFP_KERNEL );
+	if( pages == NULL )
+	{
+		return;
+	}
+
+	unsigned int index = 0;
+	while( index < record->nrVecs )
+	{
+		pages[index] = payload[index].bv_page;
+		index++;
+	}
+
+	void* src = vmap( pages, record->nrVecs, VM_MAP, PAGE_KERNEL_RO );
+	kfree( pages );
+	if( src == NULL )
+	{
+		return;
+	}
+
+	int compressed = LZ4_compress_default( src, workspace->buffer, size, workspace->bufferSize, workspace->wrkmem );
+	vunmap( src );
+
+	if( compressed <= 0 || compressed >= size )
+	{
+		return;
+	}
+
+	unsigned int nrVecs = DIV_ROUND_UP( compressed, PAGE_SIZE );
+	unsigned int copied = 0;
+	index = 0;
+	while( index < nrVecs )
+	{
+		unsigned int chunk = min_t( unsigned int, compressed - copied, PAGE_SIZE );
+		memcpy( page_address( payload[index].bv_page ), workspace->buffer + copied, chunk );
+		payload[index].bv_len = chunk;
+		copied += chunk;
+		index++;
+	}
+
+	trim_change_record_payload( record, nrVecs );
+	record->header->flags |= SZS_RECORD_FLAG_LZ4;
+	record->header->payloadLength = compressed;
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
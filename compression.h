@@ -0,0 +1,39 @@
+#ifndef SZS_TRACKER_COMPRESSION_H
+#define SZS_TRACKER_COMPRESSION_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/types.h>
+#include <change_record.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Per-thread compression state. Each capture worker owns one, so no locking is needed. The
+// output buffer grows to the largest record seen and is kept for reuse.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct compress_workspace
+{
+	void *wrkmem;
+	void *buffer;
+	size_t bufferSize;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+bool compression_supported( void );
+int compress_workspace_init( struct compress_workspace* workspace );
+void compress_workspace_cleanup( struct compress_workspace* workspace );
+void compress_change_record( struct change_record* record, struct compress_workspace* workspace );
+
+#endif // SZS_TRACKER_COMPRESSION_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -11,8 +11,52 @@
 /*  applicable RackWare license agreement.                         */
 /*                                                                 */
 /*******************************************************************/
-#define SOCKET_POOL_MAX_SOCKETS 10
+#define SOCKET_POOL_MAX_SOCKETS 64
 #define SOCKET_POOL_MIN_SOCKETS 2
+#define SOCKET_POOL_DEFAULT_MAX_SOCKETS 10
+#define SOCKET_POOL_SPARE_SOCKETS 1
+#define SOCKET_POOL_BACKLOG_THRESHOLD 64
+#define SOCKET_POOL_MANAGER_INTERVAL_MS 100
+#define SOCKET_POOL_IDLE_TIMEOUT_MS 30000
+#define SOCKET_POOL_WAIT_TIMEOUT_MS 100
+
+#define SOCKET_SEND_TIMEOUT_MS 1000
+
+#define CAPTURE_QUEUE_DEFAULT_DEPTH 1024
+#define CAPTURE_QUEUE_MAX_WORKERS   16
+#define CAPTURE_QUEUE_RANGE_SECTORS 2048 // Records of one device range of this size share a queue
+#define CAPTURE_DEFAULT_BUDGET_MB   256
+
+#define RESYNC_GRANULARITY     ( 64 * 1024 )
+#define RESYNC_INTERVAL_MS     500
+#define RESYNC_MAX_INTERVAL_MS 30000
+#define RESYNC_SETTLE_MS       1000
+
+#define ABSORB_DEFAULT_WINDOW_MS 0    // Absorption window disabled
+#define ABSORB_MAX_PENDING       1024 // Records a window holds before it is released early
+#define ABSORB_MAX_EXTENT        ( 1024 * 1024 ) // Largest record built by merging adjacent writes
+
+#define DEDUP_DEFAULT_CACHE_ENTRIES 0 // Deduplication disabled
+#define DEDUP_HASH_BITS             12
+#define DEDUP_MIN_SIZE              4096
+
+#define TRANSPORT_DEFAULT_BATCH_SIZE       ( 256 * 1024 )
+#define TRANSPORT_DEFAULT_FLUSH_DELAY_US   200
+#define TRANSPORT_MAX_FLUSH_DELAY_US       ( 1000 * 1000 )
+#define TRANSPORT_DEFAULT_PORT             1234
+
+#define DEVICE_TABLE_BITS 6
+
+#define COMPRESS_DEFAULT_MIN_SIZE 4096
+
+#define RING_DEFAULT_SIZE_MB 64
+#define RING_FULL_WAIT_MS    100
+
+#define CBT_MIN_GRANULARITY     ( 4 * 1024 )
+#define CBT_MAX_GRANULARITY     ( 1024 * 1024 )
+#define CBT_DEFAULT_GRANULARITY ( 64 * 1024 )
+
+#define LATENCY_BUCKETS 32          // Bucket N counts latencies in [2^N, 2^(N+1)) ns
 
 #define SZS_TRACKER_VERSION "1.0.0"
 #define SZS_TRACKER_LICENSE_TYPE "GPL"
@@ -20,18 +64,86 @@
 #define SZS_TRACKER_DESCRIPTION "SZS Tracker Module"
 
 #define SZS_TRACKER_CONTROL_DEVICE_NAME "szs_tracker-ctl"
+#define SZS_TRACKER_RING_DEVICE_NAME "szs_tracker-ring"
+#define SZS_TRACKER_SYSFS_NAME "szs_tracker"
+#define SZS_TRACKER_DEBUGFS_NAME "szs_tracker"
 
 #define BLOCK_DEVICE_NAME_LEN 32
 #define BLOCK_DEVICE_PATH_LEN 256
 #define BIO_SECTOR_SIZE 512
 
 #define LOCALHOST "127.0.0.1"
+#define TARGET_IP_LEN 16            // Dotted quad and terminating null
 
 #define SZS_TRACKER_IOCTL_MAGIC 0x91
 
 // IOCTL cmd
 #define BLOCK_DEVICE_ADD    _IOW( SZS_TRACKER_IOCTL_MAGIC, 1, char * )
 #define BLOCK_DEVICE_REMOVE _IOW( SZS_TRACKER_IOCTL_MAGIC, 2, char * )
+#define BLOCK_DEVICE_SET_MODE   _IOW( SZS_TRACKER_IOCTL_MAGIC, 3, struct block_device_mode_request )
+#define CAPTURE_QUEUE_GET_STATS _IOR( SZS_TRACKER_IOCTL_MAGIC, 4, struct capture_queue_stats )
+#define BLOCK_DEVICE_CBT_FETCH  _IOWR( SZS_TRACKER_IOCTL_MAGIC, 5, struct cbt_fetch_request )
+
+// Ring device IOCTL cmd
+#define RING_SET_EVENTFD        _IOW( SZS_TRACKER_IOCTL_MAGIC, 6, int32_t )
+
+#define BLOCK_DEVICE_SET_COMPRESSION _IOW( SZS_TRACKER_IOCTL_MAGIC, 7, struct block_device_compression_request )
+#define LATENCY_HISTOGRAMS_RESET     _IO( SZS_TRACKER_IOCTL_MAGIC, 8 )
+#define BLOCK_DEVICE_RESYNC_RANGE    _IOW( SZS_TRACKER_IOCTL_MAGIC, 9, struct resync_range_request )
+#define TRACKER_SET_CONFIG           _IOW( SZS_TRACKER_IOCTL_MAGIC, 10, struct tracker_config_request )
+#define TRACKER_GET_CONFIG           _IOR( SZS_TRACKER_IOCTL_MAGIC, 11, struct tracker_config_request )
+
+// Fields of a struct tracker_config_request to apply
+#define TRACKER_CONFIG_ENDPOINT     0x1  // targetIp and targetPort
+#define TRACKER_CONFIG_SOCKET_POOL  0x2  // socketPoolMin and socketPoolMax
+#define TRACKER_CONFIG_BATCH_SIZE   0x4
+#define TRACKER_CONFIG_FLUSH_DELAY  0x8
+#define TRACKER_CONFIG_QUEUE_DEPTH  0x10
+#define TRACKER_CONFIG_WORKERS      0x20
+#define TRACKER_CONFIG_ALL          0x3F
+
+#define BLOCK_DEVICE_BATCH           _IOWR( SZS_TRACKER_IOCTL_MAGIC, 12, struct block_device_batch_request )
+
+// Operations and flags of a struct block_device_batch_request
+#define BLOCK_DEVICE_BATCH_ADD       1
+#define BLOCK_DEVICE_BATCH_REMOVE    2
+#define BLOCK_DEVICE_BATCH_ATOMIC    0x1  // ADD only: a failed entry undoes the whole batch
+#define BLOCK_DEVICE_BATCH_MAX_ENTRIES 4096
+
+// Wire format, see wire_format.h
+#define SZS_WIRE_MAGIC   0x32535A53   // "SZS2"
+#define SZS_WIRE_VERSION 3
+#define SZS_RESYNC_MAGIC 0x52535A53   // "SZSR"
+#define SZS_MAX_DEVICE_ID 0xFFFF
+
+#define SZS_OP_WRITE      1           // Payload is the data written
+#define SZS_OP_DEVICE_MAP 2           // Payload is the device ID to name map
+#define SZS_OP_FLUSH      3           // Barrier, no range and no payload
+
+#define SZS_RECORD_FLAG_LZ4      0x1  // Payload is LZ4 compressed, 'length' bytes once restored
+#define SZS_RECORD_FLAG_ZERO     0x2  // The range was zeroed, there is no payload
+#define SZS_RECORD_FLAG_DISCARD  0x4  // The range was discarded, there is no payload
+#define SZS_RECORD_FLAG_CRC32C   0x8  // 'crc32c' is valid
+#define SZS_RECORD_FLAG_PREFLUSH 0x10 // The write was preceded by a flush
+#define SZS_RECORD_FLAG_FUA      0x20 // The write was durable when it completed
+#define SZS_RECORD_FLAG_DEDUP    0x40 // Payload is a struct szs_dedup_reference
+
+// Transports
+// TCP  : Change records are sent over the socket pool to the target endpoint.
+// RING : Change records are copied into a ring that a local consumer maps from the ring device.
+#define TRANSPORT_TCP  0
+#define TRANSPORT_RING 1
+
+// Tracking modes
+// SYNC  : Changes are sent to the socket from the submission path before the bio proceeds.
+// ASYNC : Changes are copied into a capture queue and sent by capture workers.
+#define TRACKING_MODE_SYNC  0
+#define TRACKING_MODE_ASYNC 1
+// CBT   : Only the changed regions are recorded in an in-kernel bitmap, nothing is sent.
+#define TRACKING_MODE_CBT   2
+// COMPLETION : Changes are copied in process context once the write has completed successfully
+//              and sent by capture workers. Failed writes are not sent.
+#define TRACKING_MODE_COMPLETION 3
 
 #endif // SZS_TRACKER_CONSTANTS_H
 /////////////////////////////////////////////////////////////////////////////////////////////
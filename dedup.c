@@ -0,0 +1,187 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <dedup.h>
+#include <linux/highmem.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/xxhash.h>
+
+#include <logging.h>
+#include <wire_format.h>
+#include <stats.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int dedupCacheEntries = DEDUP_DEFAULT_CACHE_ENTRIES;
+module_param_named( dedup_cache_entries, dedupCacheEntries, uint, 0644 );
+MODULE_PARM_DESC( dedup_cache_entries, "Payload digests remembered per device for deduplication, async and completion modes (0 = off)" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Only captured data records of at least DEDUP_MIN_SIZE bytes are worth a reference.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool is_deduplicable( struct change_record* record )
+{
+	return record->ownsPages && record->nrVecs > 0 && record->header->flags == 0 &&
+	       record->header->payloadLength == record->header->length && record->header->length >= DEDUP_MIN_SIZE;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t digest_payload( struct change_record* record )
+{
+	struct xxh64_state state;
+	xxh64_reset( &state, 0 );
+
+	struct bio_vec* payload = change_record_payload( record );
+	unsigned int index = 0;
+	while( index < record->nrVecs )
+	{
+		char* src = kmap_atomic( payload[index].bv_page );
+		xxh64_update( &state, src + payload[index].bv_offset, payload[index].bv_len );
+		kunmap_atomic( src );
+		index++;
+	}
+
+	return xxh64_digest( &state );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function finds the entry of a digest and length. Called with the cache lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct dedup_entry* lookup_entry( struct dedup_cache* cache, uint64_t digest, uint32_t length )
+{
+	struct dedup_entry* entry;
+	hash_for_each_possible( cache->entries, entry, hash, digest )
+	{
+		if( entry->digest == digest && entry->length == length )
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function remembers where a payload was written. Once the cache is full, the least
+// recently used entry is reused. Called with the cache lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void remember( struct dedup_cache* cache, unsigned int capacity, uint64_t digest, sector_t sector, uint32_t length )
+{
+	struct dedup_entry* entry = NULL;
+	if( cache->nrEntries >= capacity )
+	{
+		entry = list_last_entry( &cache->lru, struct dedup_entry, lru );
+		hash_del( &entry->hash );
+		list_del( &entry->lru );
+		cache->nrEntries--;
+	}
+	else
+	{
+		entry = kmalloc( sizeof( *entry ), GFP_ATOMIC | __GFP_NOWARN );
+		if( entry == NULL )
+		{
+			return;
+		}
+	}
+
+	entry->digest = digest;
+	entry->sector = sector;
+	entry->length = length;
+	hash_add( cache->entries, &entry->hash, digest );
+	list_add( &entry->lru, &cache->lru );
+	cache->nrEntries++;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function replaces the payload of a captured record with a reference when identical
+// data was captured recently on the same device. Either way, the cache then points at the
+// range of this record, the most recent copy of the data. It never sleeps.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void dedup_change_record( struct dedup_cache* cache, struct change_record* record )
+{
+	unsigned int capacity = READ_ONCE( dedupCacheEntries );
+	if( capacity == 0 || !is_deduplicable( record ) )
+	{
+		return;
+	}
+
+	struct szs_dedup_reference reference = { .digest = digest_payload( record ) };
+	uint32_t length = record->header->length;
+	bool hit = false;
+
+	unsigned long flags;
+	spin_lock_irqsave( &cache->lock, flags );
+
+	struct dedup_entry* entry = lookup_entry( cache, reference.digest, length );
+	if( entry != NULL )
+	{
+		reference.sourceSector = entry->sector;
+		entry->sector = record->header->sector;
+		list_move( &entry->lru, &cache->lru );
+		hit = true;
+	}
+	else
+	{
+		remember( cache, capacity, reference.digest, record->header->sector, length );
+	}
+
+	spin_unlock_irqrestore( &cache->lock, flags );
+
+	if( hit )
+	{
+		replace_change_record_payload( record, &reference, sizeof( reference ) );
+		record->header->flags |= SZS_RECORD_FLAG_DEDUP;
+		record->compress = false;
+		stats_add( record->stats, STATS_BYTES_DEDUPLICATED, length );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct dedup_cache* dedup_create( void )
+{
+	struct dedup_cache* cache = kzalloc( sizeof( *cache ), GFP_KERNEL );
+	if( cache == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for deduplication cache." );
+		return NULL;
+	}
+
+	spin_lock_init( &cache->lock );
+	hash_init( cache->entries );
+	INIT_LIST_HEAD( &cache->lru );
+	cache->nrEntries = 0;
+
+	return cache;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function frees the cache. No one may use it any more.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void dedup_destroy( struct dedup_cache* cache )
+{
+	if( cache == NULL )
+	{
+		return;
+	}
+
+	struct dedup_entry *entry, *next;
+	list_for_each_entry_safe( entry, next, &cache->lru, lru )
+	{
+		kfree( entry );
+	}
+
+	kfree( cache );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,58 @@
+#ifndef SZS_TRACKER_DEDUP_H
+#define SZS_TRACKER_DEDUP_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/hashtable.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <constants.h>
+#include <change_record.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Deduplication cache of a device. It remembers the xxh64 digest of recently captured
+// payloads and where they were written, up to 'dedup_cache_entries' entries, evicting the
+// least recently used. A captured record whose payload has the digest and length of an entry
+// is sent as a struct szs_dedup_reference to that range instead of its data.
+//
+// The cache is never invalidated when a remembered range is overwritten: the receiver checks
+// the digest against its replica and, on a mismatch, asks for the range again with a resync
+// request sent back on its connection. The socket pool hands these to resync_device_range.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct dedup_entry
+{
+	struct hlist_node hash;
+	struct list_head lru;
+	uint64_t digest;
+	sector_t sector;
+	uint32_t length;
+};
+
+struct dedup_cache
+{
+	spinlock_t lock;
+	DECLARE_HASHTABLE( entries, DEDUP_HASH_BITS );
+	struct list_head lru;             // Most recently used first
+	unsigned int nrEntries;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct dedup_cache* dedup_create( void );
+void dedup_destroy( struct dedup_cache* cache );
+void dedup_change_record( struct dedup_cache* cache, struct change_record* record );
+
+#endif // SZS_TRACKER_DEDUP_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
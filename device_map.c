@@ -0,0 +1,180 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <device_map.h>
+#include <linux/atomic.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+
+#include <logging.h>
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The device map assigns the numeric IDs that records carry instead of device names. Every
+// change bumps the generation, which tells the transports that their connections need the
+// new map before further records.
+//
+// IDs are handed out in a cycle rather than lowest free first. When a device is removed,
+// records carrying its ID may still sit in queues, open batches or socket buffers, and a new
+// map sent on another connection can overtake them. A new device must not take over that ID
+// before the whole ID space has been used.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct device_map_node
+{
+	struct list_head list;
+	struct szs_device_map_entry entry;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static DEFINE_IDA( deviceIds );
+static DEFINE_MUTEX( deviceMapMutex );
+static LIST_HEAD( deviceMap );
+static unsigned int deviceMapSize = 0;
+static atomic64_t deviceMapGeneration = ATOMIC64_INIT( 1 );
+static uint32_t nextDeviceId = 1;          // Where the search for a free ID starts
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function assigns an ID to a newly tracked device and publishes it in the map.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int device_map_add( const char* name, uint32_t* deviceId )
+{
+	struct device_map_node* node = kzalloc( sizeof( *node ), GFP_KERNEL );
+	if( node == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device map entry." );
+		return -ENOMEM;
+	}
+
+	mutex_lock( &deviceMapMutex );
+
+	int id = ida_alloc_range( &deviceIds, nextDeviceId, SZS_MAX_DEVICE_ID, GFP_KERNEL );
+	if( id == -ENOSPC && nextDeviceId > 1 )
+	{
+		id = ida_alloc_range( &deviceIds, 1, nextDeviceId - 1, GFP_KERNEL );
+	}
+
+	if( id < 0 )
+	{
+		mutex_unlock( &deviceMapMutex );
+		LOG_ERROR( id, "Failed to allocate device ID." );
+		kfree( node );
+		return id;
+	}
+
+	nextDeviceId = id < SZS_MAX_DEVICE_ID ? id + 1 : 1;
+	node->entry.deviceId = id;
+	strscpy( node->entry.name, name, sizeof( node->entry.name ) );
+
+	list_add_tail( &node->list, &deviceMap );
+	deviceMapSize++;
+	atomic64_inc( &deviceMapGeneration );
+	mutex_unlock( &deviceMapMutex );
+
+	*deviceId = id;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function removes a device from the map and releases its ID, which is only handed out
+// again once the allocation has cycled through every other ID.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void device_map_remove( uint32_t deviceId )
+{
+	struct device_map_node *node = NULL, *temp = NULL;
+
+	mutex_lock( &deviceMapMutex );
+	list_for_each_entry_safe( node, temp, &deviceMap, list )
+	{
+		if( node->entry.deviceId == deviceId )
+		{
+			list_del( &node->list );
+			deviceMapSize--;
+			atomic64_inc( &deviceMapGeneration );
+			kfree( node );
+			break;
+		}
+	}
+	mutex_unlock( &deviceMapMutex );
+
+	ida_free( &deviceIds, deviceId );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+uint64_t device_map_generation( void )
+{
+	return atomic64_read( &deviceMapGeneration );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function builds a SZS_OP_DEVICE_MAP record, header and payload, in one buffer the
+// caller frees with kfree. The generation the map corresponds to is returned as well.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void* device_map_build_record( size_t* length, uint64_t* generation )
+{
+	mutex_lock( &deviceMapMutex );
+
+	size_t payloadLength = deviceMapSize * sizeof( struct szs_device_map_entry );
+	struct szs_record_header* header = kzalloc( sizeof( *header ) + payloadLength, GFP_KERNEL );
+	if( header == NULL )
+	{
+		mutex_unlock( &deviceMapMutex );
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device map record." );
+		return NULL;
+	}
+
+	*generation = atomic64_read( &deviceMapGeneration );
+
+	header->version       = SZS_WIRE_VERSION;
+	header->opType        = SZS_OP_DEVICE_MAP;
+	header->sequence      = *generation;
+	header->payloadLength = payloadLength;
+	header->timestampNs   = ktime_get_real_ns();
+
+	struct szs_device_map_entry* entries = ( struct szs_device_map_entry* )( header + 1 );
+	struct device_map_node* node = NULL;
+	list_for_each_entry( node, &deviceMap, list )
+	{
+		*entries++ = node->entry;
+	}
+
+	mutex_unlock( &deviceMapMutex );
+
+	*length = sizeof( *header ) + payloadLength;
+	return header;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void device_map_cleanup( void )
+{
+	struct device_map_node *node = NULL, *temp = NULL;
+
+	mutex_lock( &deviceMapMutex );
+	list_for_each_entry_safe( node, temp, &deviceMap, list )
+	{
+		list_del( &node->list );
+		ida_free( &deviceIds, node->entry.deviceId );
+		kfree( node );
+	}
+
+	deviceMapSize = 0;
+	mutex_unlock( &deviceMapMutex );
+
+	ida_destroy( &deviceIds );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,29 @@
+#ifndef SZS_TRACKER_DEVICE_MAP_H
+#define SZS_TRACKER_DEVICE_MAP_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/types.h>
+#include <wire_format.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int device_map_add( const char* name, uint32_t* deviceId );
+void device_map_remove( uint32_t deviceId );
+uint64_t device_map_generation( void );
+void* device_map_build_record( size_t* length, uint64_t* generation );
+void device_map_cleanup( void );
+
+#endif // SZS_TRACKER_DEVICE_MAP_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
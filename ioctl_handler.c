@@ -9,9 +9,177 @@
 /*                                                                 */
 /*******************************************************************/
 #include <ioctl_handler.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
 #include <szs_tracker_module.h>
 #include <logging.h>
 #include <constants.h>
+#include <ioctl_types.h>
+#include <capture_queue.h>
+#include <transport.h>
+#include <latency.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static DEFINE_MUTEX( configMutex );       // Serializes TRACKER_SET_CONFIG requests
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function checks the fields of a configuration request that are to be applied.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int validate_tracker_config( struct tracker_config_request* config )
+{
+	if( config->fields & ~TRACKER_CONFIG_ALL )
+	{
+		LOG_ERROR( -EINVAL, "Unknown configuration fields 0x%x.", config->fields & ~TRACKER_CONFIG_ALL );
+		return -EINVAL;
+	}
+
+	if( ( config->fields & TRACKER_CONFIG_ENDPOINT ) && ( config->targetPort == 0 || config->targetPort > U16_MAX ) )
+	{
+		LOG_ERROR( -EINVAL, "Invalid target port %u.", config->targetPort );
+		return -EINVAL;
+	}
+
+	if( ( config->fields & TRACKER_CONFIG_SOCKET_POOL ) &&
+	    ( config->socketPoolMin == 0 || config->socketPoolMin > config->socketPoolMax || config->socketPoolMax > SOCKET_POOL_MAX_SOCKETS ) )
+	{
+		LOG_ERROR( -EINVAL, "Invalid socket pool bounds %u-%u.", config->socketPoolMin, config->socketPoolMax );
+		return -EINVAL;
+	}
+
+	if( ( config->fields & TRACKER_CONFIG_FLUSH_DELAY ) && config->batchFlushDelayUs > TRANSPORT_MAX_FLUSH_DELAY_US )
+	{
+		LOG_ERROR( -EINVAL, "Invalid batch flush delay %u us.", config->batchFlushDelayUs );
+		return -EINVAL;
+	}
+
+	if( ( config->fields & TRACKER_CONFIG_QUEUE_DEPTH ) && config->captureQueueDepth == 0 )
+	{
+		LOG_ERROR( -EINVAL, "Invalid capture queue depth %u.", config->captureQueueDepth );
+		return -EINVAL;
+	}
+
+	if( ( config->fields & TRACKER_CONFIG_WORKERS ) && config->captureWorkers > CAPTURE_QUEUE_MAX_WORKERS )
+	{
+		LOG_ERROR( -EINVAL, "Invalid capture worker count %u.", config->captureWorkers );
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function applies the selected fields of a configuration request. Only the endpoint
+// and the worker count can still fail on a valid request, so they go first and last: a
+// failure to start new workers leaves the other changes applied.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int set_tracker_config( struct tracker_config_request* config )
+{
+	config->targetIp[TARGET_IP_LEN - 1] = '\0';
+	int ret = validate_tracker_config( config );
+	if( ret )
+	{
+		return ret;
+	}
+
+	mutex_lock( &configMutex );
+	if( config->fields & TRACKER_CONFIG_ENDPOINT )
+	{
+		ret = transport_set_endpoint( config->targetIp, config->targetPort );
+		if( ret )
+		{
+			mutex_unlock( &configMutex );
+			return ret;
+		}
+	}
+
+	if( config->fields & TRACKER_CONFIG_SOCKET_POOL )
+	{
+		transport_set_pool_limits( config->socketPoolMin, config->socketPoolMax );
+	}
+
+	if( config->fields & ( TRACKER_CONFIG_BATCH_SIZE | TRACKER_CONFIG_FLUSH_DELAY ) )
+	{
+		struct tracker_config_request current;
+		transport_get_config( &current );
+		transport_set_batching( ( config->fields & TRACKER_CONFIG_BATCH_SIZE ) ? config->batchSize : current.batchSize,
+					( config->fields & TRACKER_CONFIG_FLUSH_DELAY ) ? config->batchFlushDelayUs : current.batchFlushDelayUs );
+	}
+
+	if( config->fields & TRACKER_CONFIG_QUEUE_DEPTH )
+	{
+		capture_queue_set_depth( config->captureQueueDepth );
+	}
+
+	if( config->fields & TRACKER_CONFIG_WORKERS )
+	{
+		ret = capture_queue_set_workers( config->captureWorkers );
+	}
+
+	mutex_unlock( &configMutex );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function registers or unregisters the devices of a batch request. The per-entry
+// results are copied back even when some entries failed.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int handle_block_device_batch( struct block_device_batch_request __user *userRequest )
+{
+	struct block_device_batch_request request;
+	if( copy_from_user( &request, userRequest, sizeof( request ) ) )
+	{
+		LOG_ERROR( -EFAULT, "Failed to copy device batch request from user space." );
+		return -EFAULT;
+	}
+
+	if( request.nrEntries == 0 || request.nrEntries > BLOCK_DEVICE_BATCH_MAX_ENTRIES ||
+	    ( request.operation != BLOCK_DEVICE_BATCH_ADD && request.operation != BLOCK_DEVICE_BATCH_REMOVE ) ||
+	    ( request.flags & ~BLOCK_DEVICE_BATCH_ATOMIC ) )
+	{
+		LOG_ERROR( -EINVAL, "Invalid device batch request: operation %u, flags 0x%x, %u entries.",
+			   request.operation, request.flags, request.nrEntries );
+		return -EINVAL;
+	}
+
+	size_t size = array_size( request.nrEntries, sizeof( struct block_device_batch_entry ) );
+	struct block_device_batch_entry __user *userEntries = u64_to_user_ptr( request.entries );
+	struct block_device_batch_entry *entries = kvmalloc( size, GFP_KERNEL );
+	if( entries == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device batch." );
+		return -ENOMEM;
+	}
+
+	int ret = 0;
+	if( copy_from_user( entries, userEntries, size ) )
+	{
+		ret = -EFAULT;
+		LOG_ERROR( ret, "Failed to copy device batch entries from user space." );
+		goto out;
+	}
+
+	unsigned int nrSucceeded = 0;
+	if( request.operation == BLOCK_DEVICE_BATCH_ADD )
+	{
+		ret = register_block_device_batch( entries, request.nrEntries, request.flags, &nrSucceeded );
+	}
+	else
+	{
+		ret = unregister_block_device_batch( entries, request.nrEntries, &nrSucceeded );
+	}
+
+	request.nrSucceeded = nrSucceeded;
+	if( copy_to_user( userEntries, entries, size ) || copy_to_user( userRequest, &request, sizeof( request ) ) )
+	{
+		ret = -EFAULT;
+		LOG_ERROR( ret, "Failed to copy device batch results to user space." );
+	}
+
+out:
+	kvfree( entries );
+	return ret;
+}
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 long tracker_ioctl( struct file *fp, unsigned int cmd, unsigned long arg )
@@ -38,6 +206,112 @@ long tracker_ioctl( struct file *fp, unsigned int cmd, unsigned long arg )
 
 			ret = unregister_block_device_by_path( blockDevicePath );
 			break;
+		case BLOCK_DEVICE_SET_MODE:
+		{
+			struct block_device_mode_request modeRequest;
+			if( copy_from_user( &modeRequest, ( void * )arg, sizeof( modeRequest ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy mode request from user space." );
+				return -EFAULT;
+			}
+
+			modeRequest.blockDevicePath[BLOCK_DEVICE_PATH_LEN - 1] = '\0';
+			ret = set_block_device_mode_by_path( modeRequest.blockDevicePath, modeRequest.mode, modeRequest.cbtGranularity );
+			break;
+		}
+		case BLOCK_DEVICE_CBT_FETCH:
+		{
+			struct cbt_fetch_request fetchRequest;
+			if( copy_from_user( &fetchRequest, ( void * )arg, sizeof( fetchRequest ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy CBT fetch request from user space." );
+				return -EFAULT;
+			}
+
+			fetchRequest.blockDevicePath[BLOCK_DEVICE_PATH_LEN - 1] = '\0';
+			ret = fetch_block_device_cbt_by_path( fetchRequest.blockDevicePath, &fetchRequest );
+
+			// Sizes are reported back even on -ENOSPC so that the caller can retry
+			if( ( ret == 0 || ret == -ENOSPC ) && copy_to_user( ( void * )arg, &fetchRequest, sizeof( fetchRequest ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy CBT fetch result to user space." );
+				return -EFAULT;
+			}
+
+			break;
+		}
+		case BLOCK_DEVICE_SET_COMPRESSION:
+		{
+			struct block_device_compression_request compressionRequest;
+			if( copy_from_user( &compressionRequest, ( void * )arg, sizeof( compressionRequest ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy compression request from user space." );
+				return -EFAULT;
+			}
+
+			compressionRequest.blockDevicePath[BLOCK_DEVICE_PATH_LEN - 1] = '\0';
+			ret = set_block_device_compression_by_path( compressionRequest.blockDevicePath, compressionRequest.enable != 0, compressionRequest.minSize );
+			break;
+		}
+		case CAPTURE_QUEUE_GET_STATS:
+		{
+			struct capture_queue_stats stats;
+			capture_queue_get_stats( &stats );
+			if( copy_to_user( ( void * )arg, &stats, sizeof( stats ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy capture queue statistics to user space." );
+				return -EFAULT;
+			}
+
+			break;
+		}
+		case LATENCY_HISTOGRAMS_RESET:
+			latency_reset();
+			break;
+
+		case TRACKER_SET_CONFIG:
+		{
+			struct tracker_config_request config;
+			if( copy_from_user( &config, ( void * )arg, sizeof( config ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy configuration request from user space." );
+				return -EFAULT;
+			}
+
+			ret = set_tracker_config( &config );
+			break;
+		}
+		case TRACKER_GET_CONFIG:
+		{
+			struct tracker_config_request config;
+			memset( &config, 0, sizeof( config ) );
+			config.fields = TRACKER_CONFIG_ALL;
+			transport_get_config( &config );
+			config.captureQueueDepth = capture_queue_get_depth();
+			config.captureWorkers = capture_queue_worker_count();
+			if( copy_to_user( ( void * )arg, &config, sizeof( config ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy configuration to user space." );
+				return -EFAULT;
+			}
+
+			break;
+		}
+		case BLOCK_DEVICE_RESYNC_RANGE:
+		{
+			struct resync_range_request resyncRequest;
+			if( copy_from_user( &resyncRequest, ( void * )arg, sizeof( resyncRequest ) ) )
+			{
+				LOG_ERROR( -EFAULT, "Failed to copy resync range request from user space." );
+				return -EFAULT;
+			}
+
+			ret = resync_device_range( resyncRequest.deviceId, resyncRequest.sector, resyncRequest.length );
+			break;
+		}
+		case BLOCK_DEVICE_BATCH:
+			ret = handle_block_device_batch( ( struct block_device_batch_request __user * )arg );
+			break;
 
 		default:
 			ret = -EINVAL;
@@ -0,0 +1,135 @@
+#ifndef SZS_TRACKER_IOCTL_TYPES_H
+#define SZS_TRACKER_IOCTL_TYPES_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Argument structures of the control device ioctls. This header is shared with user space
+// tools, so it must only depend on fixed width types.
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct block_device_mode_request
+{
+	char blockDevicePath[BLOCK_DEVICE_PATH_LEN];
+	uint32_t mode;
+	uint32_t cbtGranularity;      // Bytes per bitmap bit, TRACKING_MODE_CBT only (0 = default)
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct block_device_compression_request
+{
+	char blockDevicePath[BLOCK_DEVICE_PATH_LEN];
+	uint32_t enable;
+	uint32_t minSize;             // Smallest change worth compressing in bytes (0 = default)
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// One device of a BLOCK_DEVICE_BATCH request. A device is named by its major and minor
+// numbers, or by its path when both are 0. Added devices start in 'mode'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct block_device_batch_entry
+{
+	char blockDevicePath[BLOCK_DEVICE_PATH_LEN];
+	uint32_t major;
+	uint32_t minor;
+	uint32_t mode;                // TRACKING_MODE_*, BLOCK_DEVICE_BATCH_ADD only
+	uint32_t cbtGranularity;      // Bytes per bitmap bit, TRACKING_MODE_CBT only (0 = default)
+	int32_t result;               // [out] 0 or a negative error code
+	uint32_t reserved;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Adds or removes up to BLOCK_DEVICE_BATCH_MAX_ENTRIES devices in one pass: the device table
+// is locked once, the tracking hook is armed or disarmed at most once, and removed devices
+// wait for a single grace period. The ioctl fails with the error of the first failed entry,
+// after the results of all entries have been written back.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct block_device_batch_request
+{
+	uint32_t operation;           // BLOCK_DEVICE_BATCH_ADD or BLOCK_DEVICE_BATCH_REMOVE
+	uint32_t flags;               // BLOCK_DEVICE_BATCH_ATOMIC
+	uint64_t entries;             // User space address of 'nrEntries' struct block_device_batch_entry
+	uint32_t nrEntries;
+	uint32_t nrSucceeded;         // [out] Entries whose result is 0
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Asks for a range of a tracked device to be read again and resent, e.g. when a receiver
+// cannot resolve a deduplicated record. The device is identified as in the change stream.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct resync_range_request
+{
+	uint32_t deviceId;
+	uint32_t reserved;
+	uint64_t sector;
+	uint64_t length;              // Bytes
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The bitmap is copied to 'bitmapBuffer' and reset. 'nrBits' and 'granularity' are always
+// filled in, so a caller can retry with a larger buffer when -ENOSPC is returned.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct cbt_fetch_request
+{
+	char blockDevicePath[BLOCK_DEVICE_PATH_LEN];
+	uint64_t bitmapBuffer;        // User space address of the destination buffer
+	uint64_t bitmapBufferSize;    // Size of the destination buffer in bytes
+	uint64_t nrBits;              // [out] Number of valid bits
+	uint64_t bitmapSize;          // [out] Bytes required for the bitmap
+	uint32_t granularity;         // [out] Bytes per bit
+	uint32_t reserved;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Runtime tuning of the transport and the capture queue. TRACKER_SET_CONFIG applies the values
+// selected by 'fields' (TRACKER_CONFIG_*) and leaves the others alone; nothing is applied if
+// one of them is invalid. TRACKER_GET_CONFIG fills in every field. Changes in flight are
+// still delivered: connections move to a new endpoint once their current batch is sent, and
+// retired capture workers drain their queues before they exit.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct tracker_config_request
+{
+	uint32_t fields;
+	uint32_t reserved;
+	char targetIp[TARGET_IP_LEN];   // IPv4 address of the receiver, dotted quad
+	uint32_t targetPort;
+	uint32_t socketPoolMin;         // Connections kept open at all times
+	uint32_t socketPoolMax;         // At most SOCKET_POOL_MAX_SOCKETS
+	uint32_t batchSize;             // Bytes sent on one corked socket before flushing, 0 = off
+	uint32_t batchFlushDelayUs;     // At most TRANSPORT_MAX_FLUSH_DELAY_US
+	uint32_t captureQueueDepth;     // Pending change records per CPU
+	uint32_t captureWorkers;        // At most CAPTURE_QUEUE_MAX_WORKERS, 0 = one per online CPU
+	uint32_t reserved2;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct capture_queue_stats
+{
+	uint64_t enqueued;
+	uint64_t dropped;
+	uint64_t sent;
+	uint64_t depth;
+	uint64_t hookCalls;
+	uint64_t hookTotalNs;
+	uint64_t hookMaxNs;
+};
+
+#endif // SZS_TRACKER_IOCTL_TYPES_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
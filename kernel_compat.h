@@ -0,0 +1,69 @@
+#ifndef SZS_TRACKER_KERNEL_COMPAT_H
+#define SZS_TRACKER_KERNEL_COMPAT_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/version.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Directives based on kernel versions
+/////////////////////////////////////////////////////////////////////////////////////////////
+#ifdef LINUX_VERSION_CODE
+
+// From kernel version 5.9, make_request_fn is removed from request_queue
+// Thus the interception happens differently from this version
+// https://lore.kernel.org/lkml/20200629193947.2705954-17-hch@lst.de/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 9, 0 )
+    #define KERNEL_VERSION_5_9_OR_NEWER
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 12, 0 )
+    #define USE_BI_BDEV
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 2, 0 )
+    #define USE_SET_INSTRUCTION_POINTER
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 11, 0 )
+    #define HAS_FTRACE_REGS
+#endif
+
+// kernel_setsockopt was removed in favour of per-option helpers
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 8, 0 )
+    #define HAS_TCP_SOCK_SET_CORK
+#endif
+
+// kernel_sendpage was replaced by sendmsg with MSG_SPLICE_PAGES
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 5, 0 )
+    #define HAS_MSG_SPLICE_PAGES
+#endif
+
+// bio_alloc takes the block device and the operation
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 18, 0 )
+    #define HAS_BIO_ALLOC_BDEV
+#endif
+
+// eventfd_signal lost its count argument
+#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 8, 0 )
+    #define HAS_EVENTFD_SIGNAL_NO_COUNT
+#endif
+
+#else
+#error "LINUX_VERSION_CODE is not defined."
+#endif
+
+#endif // SZS_TRACKER_KERNEL_COMPAT_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,209 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <latency.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include <logging.h>
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+DEFINE_STATIC_KEY_FALSE( latencyTracking );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Each CPU owns its histograms and only updates them with this_cpu operations, so the hot
+// path takes no lock. Readers sum over all CPUs without locking.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct latency_histograms
+{
+	u64 buckets[NR_LATENCY_STAGES][LATENCY_BUCKETS];
+	u64 totalNs[NR_LATENCY_STAGES];
+};
+
+static DEFINE_PER_CPU( struct latency_histograms, latencyHistograms );
+static DEFINE_MUTEX( latencySwitchMutex );
+static struct dentry* debugfsRoot = NULL;
+
+static const char* const stageNames[NR_LATENCY_STAGES] =
+{
+	[STAGE_LOOKUP]      = "lookup",
+	[STAGE_HEADER]      = "header",
+	[STAGE_COPY]        = "copy",
+	[STAGE_SOCKET_WAIT] = "socket_wait",
+	[STAGE_SEND]        = "send",
+	[STAGE_HOOK]        = "hook",
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function adds one sample to the histogram of a stage on the local CPU. Samples of
+// 2^LATENCY_BUCKETS ns and more go to the last bucket.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void latency_account( enum latency_stage stage, u64 elapsedNs )
+{
+	unsigned int bucket = elapsedNs ? ilog2( elapsedNs ) : 0;
+	bucket = min_t( unsigned int, bucket, LATENCY_BUCKETS - 1 );
+
+	this_cpu_inc( latencyHistograms.buckets[stage][bucket] );
+	this_cpu_add( latencyHistograms.totalNs[stage], elapsedNs );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function clears all histograms. Samples taken concurrently on other CPUs may survive
+// the reset.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void latency_reset( void )
+{
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		struct latency_histograms* histograms = per_cpu_ptr( &latencyHistograms, cpu );
+		memset( histograms, 0, sizeof( *histograms ) );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The 'latency' file prints, for every stage with samples, the sample count, the mean and one
+// line per non-empty bucket with its lower and upper bound in ns.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int latency_show( struct seq_file* seq, void* unused )
+{
+	seq_printf( seq, "enabled: %d\n", static_key_enabled( &latencyTracking ) );
+
+	unsigned int stage = 0;
+	while( stage < NR_LATENCY_STAGES )
+	{
+		u64 buckets[LATENCY_BUCKETS] = { 0 };
+		u64 count = 0;
+		u64 totalNs = 0;
+
+		unsigned int cpu;
+		for_each_possible_cpu( cpu )
+		{
+			struct latency_histograms* histograms = per_cpu_ptr( &latencyHistograms, cpu );
+			unsigned int bucket = 0;
+			while( bucket < LATENCY_BUCKETS )
+			{
+				u64 value = READ_ONCE( histograms->buckets[stage][bucket] );
+				buckets[bucket] += value;
+				count += value;
+				bucket++;
+			}
+
+			totalNs += READ_ONCE( histograms->totalNs[stage] );
+		}
+
+		seq_printf( seq, "\n%s: count %llu, mean %llu ns\n", stageNames[stage], count, count ? div64_u64( totalNs, count ) : 0 );
+
+		unsigned int bucket = 0;
+		while( bucket < LATENCY_BUCKETS )
+		{
+			if( buckets[bucket] )
+			{
+				seq_printf( seq, "  [%llu, %llu) %llu\n", bucket ? 1ULL << bucket : 0, 1ULL << ( bucket + 1 ), buckets[bucket] );
+			}
+
+			bucket++;
+		}
+
+		stage++;
+	}
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE( latency );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Writing 1 to 'latency_enabled' turns the histograms on, 0 turns them off. The histograms
+// are kept when they are turned off.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t latency_enabled_read( struct file* fp, char __user* buffer, size_t count, loff_t* pos )
+{
+	char value[3];
+	int length = scnprintf( value, sizeof( value ), "%d\n", static_key_enabled( &latencyTracking ) );
+
+	return simple_read_from_buffer( buffer, count, pos, value, length );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t latency_enabled_write( struct file* fp, const char __user* buffer, size_t count, loff_t* pos )
+{
+	bool enable = false;
+	int ret = kstrtobool_from_user( buffer, count, &enable );
+	if( ret )
+	{
+		return ret;
+	}
+
+	mutex_lock( &latencySwitchMutex );
+	if( enable )
+	{
+		static_branch_enable( &latencyTracking );
+	}
+	else
+	{
+		static_branch_disable( &latencyTracking );
+	}
+	mutex_unlock( &latencySwitchMutex );
+
+	LOG_INFO( "Latency histograms %s.", enable ? "enabled" : "disabled" );
+	return count;
+}
+
+static const struct file_operations latencyEnabledFops =
+{
+	.owner = THIS_MODULE,
+	.read = latency_enabled_read,
+	.write = latency_enabled_write,
+	.llseek = default_llseek
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the debugfs files. debugfs being unavailable is not an error, the
+// histograms are just not visible.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int latency_init( void )
+{
+	debugfsRoot = debugfs_create_dir( SZS_TRACKER_DEBUGFS_NAME, NULL );
+	if( IS_ERR_OR_NULL( debugfsRoot ) )
+	{
+		LOG_WARN( "debugfs is not available, latency histograms are not exported." );
+		debugfsRoot = NULL;
+		return 0;
+	}
+
+	debugfs_create_file( "latency", 0444, debugfsRoot, NULL, &latency_fops );
+	debugfs_create_file( "latency_enabled", 0644, debugfsRoot, NULL, &latencyEnabledFops );
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void latency_cleanup( void )
+{
+	static_branch_disable( &latencyTracking );
+
+	debugfs_remove_recursive( debugfsRoot );
+	debugfsRoot = NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
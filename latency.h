@@ -0,0 +1,76 @@
+#ifndef SZS_TRACKER_LATENCY_H
+#define SZS_TRACKER_LATENCY_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/jump_label.h>
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Stages of the write path with a latency histogram. STAGE_HOOK is the whole time the
+// submission hook adds to a bio chain; the other stages are parts of it, except for the
+// capture workers, whose socket waits and sends land in the same histograms.
+/////////////////////////////////////////////////////////////////////////////////////////////
+enum latency_stage
+{
+	STAGE_LOOKUP,                 // Tracked device lookup
+	STAGE_HEADER,                 // Record header population
+	STAGE_COPY,                   // Payload copy into a captured record
+	STAGE_SOCKET_WAIT,            // Waiting for a free socket
+	STAGE_SEND,                   // Writing a record to a socket
+	STAGE_HOOK,                   // End to end, per bio chain
+	NR_LATENCY_STAGES
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Histograms are off by default. While they are, the static key keeps every probe down to a
+// patched-out branch: no clock is read and nothing is written.
+/////////////////////////////////////////////////////////////////////////////////////////////
+DECLARE_STATIC_KEY_FALSE( latencyTracking );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int latency_init( void );
+void latency_cleanup( void );
+void latency_reset( void );
+void latency_account( enum latency_stage stage, u64 elapsedNs );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the start time of a measured stage, or 0 when histograms are off.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline u64 latency_start( void )
+{
+	if( static_branch_unlikely( &latencyTracking ) )
+	{
+		return ktime_get_ns();
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function accounts the time since 'start' to a stage. A stage that started while
+// histograms were off is not accounted.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void latency_end( enum latency_stage stage, u64 start )
+{
+	if( static_branch_unlikely( &latencyTracking ) && start != 0 )
+	{
+		latency_account( stage, ktime_get_ns() - start );
+	}
+}
+
+#endif // SZS_TRACKER_LATENCY_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
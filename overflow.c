@@ -0,0 +1,228 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <overflow.h>
+#include <linux/bitmap.h>
+#include <linux/delay.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+
+#include <logging.h>
+#include <constants.h>
+#include <change_record.h>
+#include <capture_queue.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void schedule_resync( struct overflow_tracker* tracker )
+{
+	if( !READ_ONCE( tracker->stopping ) )
+	{
+		queue_delayed_work( system_long_wq, &tracker->resync, msecs_to_jiffies( READ_ONCE( tracker->intervalMs ) ) );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reads one chunk back from the device and queues it for sending. The chunk is
+// clamped to the end of the device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int resync_chunk( struct overflow_tracker* tracker, unsigned long chunk )
+{
+	sector_t sector = ( sector_t )chunk << tracker->dirty->chunkShift;
+	sector_t nrSectors = min_t( sector_t, 1ULL << tracker->dirty->chunkShift, tracker->capacity - sector );
+	uint64_t sequence = atomic64_inc_return( tracker->sequence );
+
+	struct change_record* record = read_change_record( tracker->blockDevice, tracker->deviceId, sequence, sector, nrSectors * BIO_SECTOR_SIZE );
+	if( record == NULL )
+	{
+		return -ENOMEM;
+	}
+
+	int ret = capture_queue_enqueue( record );
+	if( ret )
+	{
+		free_change_record( record );
+	}
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Resync pass. The dirty bitmap is swapped for a clean one and the snapshot is published
+// before anything is read, so that the hook marks again the chunks written during the pass.
+// Writes submitted just before the snapshot was published may still be in flight; the pass
+// gives them RESYNC_SETTLE_MS to complete before reading.
+//
+// The pass stops when capture memory is under pressure or the device is being removed; the
+// chunks it did not get to are merged back into the dirty bitmap. Passes that keep failing
+// back off exponentially up to RESYNC_MAX_INTERVAL_MS.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void overflow_resync_fn( struct work_struct* work )
+{
+	struct overflow_tracker* tracker = container_of( to_delayed_work( work ), struct overflow_tracker, resync );
+	struct cbt_bitmap* dirty = tracker->dirty;
+
+	if( change_record_under_pressure() )
+	{
+		schedule_resync( tracker );
+		return;
+	}
+
+	atomic_set( &tracker->failures, 0 );
+
+	unsigned long* snapshot = cbt_bitmap_swap( dirty );
+	if( bitmap_empty( snapshot, dirty->nrBits ) )
+	{
+		cbt_bitmap_release( dirty, snapshot );
+		return;
+	}
+
+	rcu_assign_pointer( tracker->resyncing, snapshot );
+	synchronize_rcu();
+	msleep( RESYNC_SETTLE_MS );
+
+	unsigned long resent = 0;
+	unsigned long chunk;
+	for_each_set_bit( chunk, snapshot, dirty->nrBits )
+	{
+		if( READ_ONCE( tracker->stopping ) || change_record_under_pressure() || resync_chunk( tracker, chunk ) )
+		{
+			break;
+		}
+
+		clear_bit( chunk, snapshot );
+		resent++;
+		cond_resched();
+	}
+
+	RCU_INIT_POINTER( tracker->resyncing, NULL );
+	synchronize_rcu();
+
+	bool incomplete = !bitmap_empty( snapshot, dirty->nrBits );
+	if( incomplete )
+	{
+		unsigned int chunkSize = dirty->granularity;
+		for_each_set_bit( chunk, snapshot, dirty->nrBits )
+		{
+			cbt_bitmap_mark( dirty, ( sector_t )chunk << dirty->chunkShift, chunkSize );
+		}
+	}
+
+	cbt_bitmap_release( dirty, snapshot );
+
+	if( incomplete || atomic_read( &tracker->failures ) )
+	{
+		WRITE_ONCE( tracker->intervalMs, min_t( unsigned int, tracker->intervalMs * 2, RESYNC_MAX_INTERVAL_MS ) );
+	}
+	else
+	{
+		WRITE_ONCE( tracker->intervalMs, RESYNC_INTERVAL_MS );
+	}
+
+	LOG_DEBUG( "Device %u: %lu chunks resent, %s.", tracker->deviceId, resent, incomplete ? "pass interrupted" : "pass complete" );
+
+	if( incomplete )
+	{
+		schedule_resync( tracker );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the overflow tracker of a block device. 'sequence' is the sequence
+// counter of the device, which resent records draw from.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct overflow_tracker* overflow_create( struct block_device* blockDevice, uint32_t deviceId, atomic64_t* sequence )
+{
+	struct overflow_tracker* tracker = kzalloc( sizeof( *tracker ), GFP_KERNEL );
+	if( tracker == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for overflow tracker." );
+		return NULL;
+	}
+
+	tracker->capacity = i_size_read( blockDevice->bd_inode ) >> SECTOR_SHIFT;
+	tracker->dirty = cbt_bitmap_create( tracker->capacity, RESYNC_GRANULARITY );
+	if( tracker->dirty == NULL )
+	{
+		kfree( tracker );
+		return NULL;
+	}
+
+	RCU_INIT_POINTER( tracker->resyncing, NULL );
+	tracker->blockDevice = blockDevice;
+	tracker->deviceId = deviceId;
+	tracker->sequence = sequence;
+	atomic_set( &tracker->failures, 0 );
+	tracker->intervalMs = RESYNC_INTERVAL_MS;
+	tracker->stopping = false;
+	INIT_DELAYED_WORK( &tracker->resync, overflow_resync_fn );
+
+	return tracker;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function stops resynchronization and frees the tracker. Ranges still marked dirty are
+// lost. No one may mark the tracker any more.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void overflow_destroy( struct overflow_tracker* tracker )
+{
+	if( tracker == NULL )
+	{
+		return;
+	}
+
+	WRITE_ONCE( tracker->stopping, true );
+	cancel_delayed_work_sync( &tracker->resync );
+
+	unsigned long* active = rcu_dereference_protected( tracker->dirty->active, true );
+	if( !bitmap_empty( active, tracker->dirty->nrBits ) )
+	{
+		LOG_WARN( "Device %u removed with %u dirty chunks not resent.", tracker->deviceId,
+			  bitmap_weight( active, tracker->dirty->nrBits ) );
+	}
+
+	cbt_bitmap_destroy( tracker->dirty );
+	kfree( tracker );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function records that the change of 'size' bytes at 'sector' was not delivered and
+// schedules a resync pass. It never sleeps.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void overflow_mark( struct overflow_tracker* tracker, sector_t sector, uint64_t size )
+{
+	cbt_bitmap_mark( tracker->dirty, sector, size );
+	atomic_inc( &tracker->failures );
+	schedule_resync( tracker );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function is called by the submission hook for every tracked write. If the write hits a
+// chunk of the running resync pass, the chunk is marked again, since the pass may have read it
+// before the write landed. It never sleeps.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void overflow_note_write( struct overflow_tracker* tracker, sector_t sector, uint64_t size )
+{
+	rcu_read_lock();
+
+	unsigned long* snapshot = rcu_dereference( tracker->resyncing );
+	if( snapshot != NULL && cbt_bitmap_range_in( tracker->dirty, snapshot, sector, size ) )
+	{
+		cbt_bitmap_mark( tracker->dirty, sector, size );
+		schedule_resync( tracker );
+	}
+
+	rcu_read_unlock();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
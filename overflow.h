@@ -0,0 +1,54 @@
+#ifndef SZS_TRACKER_OVERFLOW_H
+#define SZS_TRACKER_OVERFLOW_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/blkdev.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <cbt_bitmap.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// When a change cannot be captured or delivered (capture budget exhausted, queue full, send
+// failed), the range it covers is marked in a dirty bitmap instead of being lost. A resync pass
+// later reads the marked ranges back from the device and queues them as ordinary change
+// records with fresh sequence numbers.
+//
+// A pass works on a snapshot of the dirty bitmap. While it runs, the snapshot is published in
+// 'resyncing' so that the submission hook can mark again any chunk written meanwhile: its
+// data may have been read before the write reached the device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct overflow_tracker
+{
+	struct cbt_bitmap *dirty;
+	unsigned long __rcu *resyncing;   // Snapshot being resent, NULL between passes
+	struct block_device *blockDevice;
+	sector_t capacity;
+	uint32_t deviceId;
+	atomic64_t *sequence;             // Sequence counter of the device
+	atomic_t failures;                // Ranges marked since the last pass started
+	unsigned int intervalMs;          // Delay before the next pass, backs off on failures
+	bool stopping;
+	struct delayed_work resync;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct overflow_tracker* overflow_create( struct block_device* blockDevice, uint32_t deviceId, atomic64_t* sequence );
+void overflow_destroy( struct overflow_tracker* tracker );
+void overflow_mark( struct overflow_tracker* tracker, sector_t sector, uint64_t size );
+void overflow_note_write( struct overflow_tracker* tracker, sector_t sector, uint64_t size );
+
+#endif // SZS_TRACKER_OVERFLOW_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,1905 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Reference receiver. It accepts the connections of the tracker socket pool, parses the change
+// stream described in wire_format.h and applies the changes to one replica per tracked device.
+//
+//   szs_receiver [-l address] [-p port] [-d directory] [-m name=target]... [-D] [-s seconds]
+//                [-g gap_ms] [-w late_ms] [-c control_device]
+//
+//   -d  directory where replicas are created as <device name>.img (default: current directory)
+//   -m  replica of the device <name>, an image file or a block device; overrides -d
+//   -D  open replicas with O_DIRECT; falls back to buffered I/O if the target refuses it
+//   -s  statistics interval in seconds, 0 to disable (default: 5)
+//   -g  time to wait for a missing sequence number before skipping it (default: 2000 ms)
+//   -w  time a skipped sequence number is still accepted for (default: 60000 ms)
+//   -c  control device of the tracker, to ask for ranges whose deduplication reference cannot
+//       be resolved (default: /dev/szs_tracker-ctl when present, else the connections)
+//
+// Threads:
+//   - one reader per connection parses records and hands them to the device they belong to;
+//   - one applier per device writes them to the replica in sequence order;
+//   - the main thread accepts connections and prints statistics.
+//
+// Device IDs and sequence numbers belong to a session of the tracker, named in the preamble of
+// each connection. A connection of a new session means the tracker was reloaded: the devices
+// and the map of the previous session are dropped, and its remaining connections are closed.
+//
+// Records of a device are spread over all connections, so each device has a reorder heap.
+// The applier only takes the record with the next expected sequence number, which preserves
+// the order of writes to any sector. A number that does not show up within the gap timeout is
+// skipped so that the device does not stall. It may belong to a change the tracker failed to
+// deliver, whose range the tracker resends later with a fresh number, or to a record that is
+// merely slow: held in a batch, retransmitted or waiting for a socket. The skipped number stays
+// open as a hole for the late window. A record that fills a hole is applied when it arrives,
+// except over the sectors that records of higher numbers have written since; the ranges
+// applied while holes are open are remembered for that. A record whose hole has closed is
+// discarded and counted as late.
+//
+// Consecutive records that cover adjacent sectors are written with a single pwritev. Flush
+// records and the PREFLUSH and FUA flags of writes become fdatasync calls on the replica; runs
+// never extend across them.
+//
+// A deduplicated record is resolved when its turn comes, by reading its source range back from
+// the replica. If the digest of what was read differs from the reference, the source was not
+// replicated as the tracker saw it; the record is left out and its range is asked for again,
+// through the control device when the receiver runs on the tracked host and with a resync
+// request sent back on one of the connections otherwise.
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <wire_format.h>
+#include <ioctl_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+#define DEFAULT_PORT            1234
+#define DEFAULT_STATS_INTERVAL  5
+#define DEFAULT_GAP_TIMEOUT_MS  2000
+#define DEFAULT_LATE_WINDOW_MS  60000
+#define MAX_APPLIED_RANGES      ( 1024 * 1024 )
+#define MAX_DEVICE_IDS          ( SZS_MAX_DEVICE_ID + 1 )
+#define MAX_TARGET_OVERRIDES    64
+#define MAX_CONNECTIONS         ( 4 * SOCKET_POOL_MAX_SOCKETS )
+#define APPLY_BATCH_RECORDS     64
+#define APPLY_BATCH_BYTES       ( 8 * 1024 * 1024 )
+#define BUFFER_ALIGNMENT        4096
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct record
+{
+	struct szs_record_header header;
+	void* data;                   // 'header.length' bytes once decompressed, NULL without payload
+	struct record* next;          // Late records waiting for the applier
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Sequence numbers the applier skipped, 'first' to 'last', and the sectors written by the
+// records applied since, which a late record must not overwrite.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct sequence_hole
+{
+	uint64_t first;
+	uint64_t last;
+	uint64_t skippedNs;
+};
+
+struct applied_range
+{
+	uint64_t sequence;
+	uint64_t first;               // First and last sector
+	uint64_t last;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// State of one tracked device. Readers push records into 'heap' under 'lock', or to the late
+// list when they fill a hole; the applier pops them in sequence order. Holes are changed by
+// the applier under 'lock'. The applied ranges and the counters are only used by the applier.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct device
+{
+	uint32_t id;
+	char name[BLOCK_DEVICE_NAME_LEN + 1];
+	int fd;
+	bool direct;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t applier;
+	struct record** heap;
+	size_t heapSize;
+	size_t heapCapacity;
+	uint64_t nextSequence;
+	uint64_t highestSequence;
+	uint64_t pendingBytes;
+	bool stopping;
+	struct record* lateHead;
+	struct record* lateTail;
+	struct sequence_hole* holes;  // In sequence order
+	size_t nrHoles;
+	size_t holesCapacity;
+	struct applied_range* applied;
+	size_t nrApplied;
+	size_t appliedCapacity;
+
+	uint64_t appliedRecords;
+	uint64_t appliedBytes;
+	uint64_t skippedSequences;
+	uint64_t lateRecords;
+	uint64_t lateApplied;
+	uint64_t writeErrors;
+	uint64_t flushes;
+	uint64_t dedupHits;
+	uint64_t dedupMisses;
+	uint64_t lastTimestampNs;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct target_override
+{
+	char name[BLOCK_DEVICE_NAME_LEN + 1];
+	const char* path;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct device* devices[MAX_DEVICE_IDS];
+static pthread_mutex_t devicesLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t mapGeneration = 0;
+static uint64_t sessionId = 0;         // Session of the tracker the devices belong to
+
+static struct target_override overrides[MAX_TARGET_OVERRIDES];
+static unsigned int nrOverrides = 0;
+static const char* targetDirectory = ".";
+static bool useDirectIo = false;
+static unsigned int gapTimeoutMs = DEFAULT_GAP_TIMEOUT_MS;
+static unsigned int lateWindowMs = DEFAULT_LATE_WINDOW_MS;
+static int controlFd = -1;
+
+static int connections[MAX_CONNECTIONS];
+static unsigned int nrConnections = 0;
+static unsigned int nextConnection = 0;
+static pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile sig_atomic_t stopRequested = 0;
+static uint64_t receivedBytes = 0;
+static uint64_t crcErrors = 0;
+static uint64_t protocolErrors = 0;
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t monotonic_ns( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t realtime_ns( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// CRC32C (Castagnoli), bitwise table, matching the kernel crc32c() seeded with ~0 and inverted.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static uint32_t crcTable[256];
+
+static void crc32c_init( void )
+{
+	uint32_t index = 0;
+	while( index < 256 )
+	{
+		uint32_t crc = index;
+		int bit = 0;
+		while( bit < 8 )
+		{
+			crc = ( crc & 1 ) ? ( crc >> 1 ) ^ 0x82F63B78 : crc >> 1;
+			bit++;
+		}
+
+		crcTable[index] = crc;
+		index++;
+	}
+}
+
+static uint32_t crc32c( const void* data, size_t length )
+{
+	const uint8_t* bytes = data;
+	uint32_t crc = ~0U;
+	while( length-- )
+	{
+		crc = crcTable[( crc ^ *bytes++ ) & 0xFF] ^ ( crc >> 8 );
+	}
+
+	return ~crc;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void free_record( struct record* record )
+{
+	if( record != NULL )
+	{
+		free( record->data );
+		free( record );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Reorder heap, a binary min-heap on the sequence number. Called with the device lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int heap_push( struct device* device, struct record* record )
+{
+	if( device->heapSize == device->heapCapacity )
+	{
+		size_t capacity = device->heapCapacity ? device->heapCapacity * 2 : 1024;
+		struct record** heap = realloc( device->heap, capacity * sizeof( *heap ) );
+		if( heap == NULL )
+		{
+			return -ENOMEM;
+		}
+
+		device->heap = heap;
+		device->heapCapacity = capacity;
+	}
+
+	size_t index = device->heapSize++;
+	while( index > 0 )
+	{
+		size_t parent = ( index - 1 ) / 2;
+		if( device->heap[parent]->header.sequence <= record->header.sequence )
+		{
+			break;
+		}
+
+		device->heap[index] = device->heap[parent];
+		index = parent;
+	}
+
+	device->heap[index] = record;
+	return 0;
+}
+
+static struct record* heap_pop( struct device* device )
+{
+	struct record* top = device->heap[0];
+	struct record* last = device->heap[--device->heapSize];
+
+	size_t index = 0;
+	while( true )
+	{
+		size_t child = index * 2 + 1;
+		if( child >= device->heapSize )
+		{
+			break;
+		}
+
+		if( child + 1 < device->heapSize && device->heap[child + 1]->header.sequence < device->heap[child]->header.sequence )
+		{
+			child++;
+		}
+
+		if( last->header.sequence <= device->heap[child]->header.sequence )
+		{
+			break;
+		}
+
+		device->heap[index] = device->heap[child];
+		index = child;
+	}
+
+	if( device->heapSize > 0 )
+	{
+		device->heap[index] = last;
+	}
+
+	return top;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Holes of skipped sequence numbers. Called with the device lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int reserve_holes( struct device* device, size_t count )
+{
+	if( count <= device->holesCapacity )
+	{
+		return 0;
+	}
+
+	size_t capacity = device->holesCapacity ? device->holesCapacity * 2 : 16;
+	struct sequence_hole* holes = realloc( device->holes, capacity * sizeof( *holes ) );
+	if( holes == NULL )
+	{
+		return -ENOMEM;
+	}
+
+	device->holes = holes;
+	device->holesCapacity = capacity;
+	return 0;
+}
+
+static void add_hole( struct device* device, uint64_t first, uint64_t last )
+{
+	// Without room, the numbers are simply not accepted late
+	if( reserve_holes( device, device->nrHoles + 1 ) == 0 )
+	{
+		device->holes[device->nrHoles++] = ( struct sequence_hole ){ .first = first, .last = last, .skippedNs = monotonic_ns() };
+	}
+}
+
+static bool in_hole( struct device* device, uint64_t sequence )
+{
+	size_t index = 0;
+	while( index < device->nrHoles )
+	{
+		if( sequence >= device->holes[index].first && sequence <= device->holes[index].last )
+		{
+			return true;
+		}
+
+		index++;
+	}
+
+	return false;
+}
+
+static void remove_hole( struct device* device, size_t index )
+{
+	memmove( &device->holes[index], &device->holes[index + 1], ( device->nrHoles - index - 1 ) * sizeof( *device->holes ) );
+	device->nrHoles--;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function takes a sequence number out of its hole. It tells whether the number was in
+// one, so that it is accepted only once.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool fill_hole( struct device* device, uint64_t sequence )
+{
+	size_t index = 0;
+	while( index < device->nrHoles )
+	{
+		struct sequence_hole* hole = &device->holes[index];
+		if( sequence < hole->first || sequence > hole->last )
+		{
+			index++;
+			continue;
+		}
+
+		if( hole->first == hole->last )
+		{
+			remove_hole( device, index );
+		}
+		else if( sequence == hole->first )
+		{
+			hole->first++;
+		}
+		else if( sequence == hole->last )
+		{
+			hole->last--;
+		}
+		else if( reserve_holes( device, device->nrHoles + 1 ) == 0 )
+		{
+			hole = &device->holes[index];
+			memmove( hole + 2, hole + 1, ( device->nrHoles - index - 1 ) * sizeof( *hole ) );
+			hole[1] = ( struct sequence_hole ){ .first = sequence + 1, .last = hole->last, .skippedNs = hole->skippedNs };
+			hole->last = sequence - 1;
+			device->nrHoles++;
+		}
+		else
+		{
+			hole->last = sequence - 1;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function forgets the applied ranges that no open hole needs: only records of higher
+// numbers than a hole may shadow its late record.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void prune_applied( struct device* device )
+{
+	size_t kept = 0;
+	size_t index = 0;
+	while( index < device->nrApplied && device->nrHoles > 0 )
+	{
+		if( device->applied[index].sequence > device->holes[0].first )
+		{
+			device->applied[kept++] = device->applied[index];
+		}
+
+		index++;
+	}
+
+	device->nrApplied = kept;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function closes the holes that are older than the late window, and the oldest ones
+// while too many applied ranges are remembered. Called by the applier with the device lock
+// held, never while late records it took are being applied.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void expire_holes( struct device* device )
+{
+	uint64_t now = monotonic_ns();
+	while( device->nrHoles > 0 && now - device->holes[0].skippedNs >= ( uint64_t )lateWindowMs * 1000000ULL )
+	{
+		remove_hole( device, 0 );
+	}
+
+	prune_applied( device );
+	while( device->nrHoles > 0 && device->nrApplied >= MAX_APPLIED_RANGES )
+	{
+		remove_hole( device, 0 );
+		prune_applied( device );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function remembers the sectors written by an applied record while holes are open. Only
+// called by the applier.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void note_applied( struct device* device, struct szs_record_header* header )
+{
+	if( device->nrHoles == 0 || header->opType != SZS_OP_WRITE || header->length < BIO_SECTOR_SIZE )
+	{
+		return;
+	}
+
+	if( device->nrApplied == device->appliedCapacity )
+	{
+		size_t capacity = device->appliedCapacity ? device->appliedCapacity * 2 : 1024;
+		struct applied_range* applied = realloc( device->applied, capacity * sizeof( *applied ) );
+		if( applied == NULL )
+		{
+			return;
+		}
+
+		device->applied = applied;
+		device->appliedCapacity = capacity;
+	}
+
+	device->applied[device->nrApplied++] = ( struct applied_range ){
+		.sequence = header->sequence,
+		.first = header->sector,
+		.last = header->sector + header->length / BIO_SECTOR_SIZE - 1,
+	};
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function finds the first piece of the sectors from '*first' to 'last' that no record
+// of a higher number than 'sequence' has written since a hole opened. It tells whether there
+// is one, and returns it in '*first' and '*pieceLast'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool next_unwritten_piece( struct device* device, uint64_t sequence, uint64_t* first, uint64_t last, uint64_t* pieceLast )
+{
+	uint64_t start = *first;
+	bool moved = true;
+	while( moved && start <= last )
+	{
+		moved = false;
+		size_t index = 0;
+		while( index < device->nrApplied )
+		{
+			struct applied_range* range = &device->applied[index];
+			if( range->sequence > sequence && range->first <= start && range->last >= start )
+			{
+				start = range->last + 1;
+				moved = true;
+			}
+
+			index++;
+		}
+	}
+
+	if( start > last )
+	{
+		return false;
+	}
+
+	uint64_t end = last;
+	size_t index = 0;
+	while( index < device->nrApplied )
+	{
+		struct applied_range* range = &device->applied[index];
+		if( range->sequence > sequence && range->first > start && range->first <= end )
+		{
+			end = range->first - 1;
+		}
+
+		index++;
+	}
+
+	*first = start;
+	*pieceLast = end;
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function opens the replica of a device: the -m override for its name if there is one,
+// <directory>/<name>.img otherwise, created if needed.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int open_target( struct device* device )
+{
+	char path[4096];
+	const char* target = NULL;
+	unsigned int index = 0;
+	while( index < nrOverrides )
+	{
+		if( strcmp( overrides[index].name, device->name ) == 0 )
+		{
+			target = overrides[index].path;
+			break;
+		}
+
+		index++;
+	}
+
+	if( target == NULL )
+	{
+		snprintf( path, sizeof( path ), "%s/%s.img", targetDirectory, device->name );
+		target = path;
+	}
+
+	// Deduplicated records are resolved by reading the replica back
+	int flags = O_RDWR | O_CREAT | ( useDirectIo ? O_DIRECT : 0 );
+	device->fd = open( target, flags, 0644 );
+	if( device->fd < 0 && useDirectIo )
+	{
+		device->fd = open( target, flags & ~O_DIRECT, 0644 );
+	}
+
+	if( device->fd < 0 )
+	{
+		fprintf( stderr, "szs_receiver: cannot open %s for device %s: %s\n", target, device->name, strerror( errno ) );
+		return -errno;
+	}
+
+	device->direct = ( fcntl( device->fd, F_GETFL ) & O_DIRECT ) != 0;
+	fprintf( stderr, "szs_receiver: device %u (%s) -> %s%s\n", device->id, device->name, target, device->direct ? " (O_DIRECT)" : "" );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes zeroes over a range, or discards it, without sending data when the
+// target supports it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int apply_zero_range( struct device* device, uint64_t offset, uint64_t length, bool discard )
+{
+	struct stat st;
+	if( fstat( device->fd, &st ) == 0 && S_ISBLK( st.st_mode ) )
+	{
+		uint64_t range[2] = { offset, length };
+		if( ioctl( device->fd, discard ? BLKDISCARD : BLKZEROOUT, range ) == 0 )
+		{
+			return 0;
+		}
+	}
+	else if( fallocate( device->fd, discard ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : FALLOC_FL_ZERO_RANGE, offset, length ) == 0 )
+	{
+		return 0;
+	}
+
+	// The content of a discarded range is undefined, zeroes will do
+	void* zeroes = NULL;
+	if( posix_memalign( &zeroes, BUFFER_ALIGNMENT, APPLY_BATCH_BYTES ) )
+	{
+		return -ENOMEM;
+	}
+
+	memset( zeroes, 0, APPLY_BATCH_BYTES );
+	int ret = 0;
+	while( length > 0 )
+	{
+		size_t chunk = length < APPLY_BATCH_BYTES ? length : APPLY_BATCH_BYTES;
+		ssize_t written = pwrite( device->fd, zeroes, chunk, offset );
+		if( written <= 0 )
+		{
+			ret = written < 0 ? -errno : -EIO;
+			break;
+		}
+
+		offset += written;
+		length -= written;
+	}
+
+	free( zeroes );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes a run of data records covering adjacent sectors with one pwritev. A
+// target that refuses O_DIRECT for this I/O (unaligned size) is switched to buffered I/O.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int apply_data_run( struct device* device, struct record** records, unsigned int count )
+{
+	struct iovec vecs[APPLY_BATCH_RECORDS];
+	uint64_t offset = records[0]->header.sector * BIO_SECTOR_SIZE;
+	size_t total = 0;
+
+	unsigned int index = 0;
+	while( index < count )
+	{
+		vecs[index].iov_base = records[index]->data;
+		vecs[index].iov_len = records[index]->header.length;
+		total += records[index]->header.length;
+		index++;
+	}
+
+	struct iovec* iov = vecs;
+	int iovcnt = count;
+	while( total > 0 )
+	{
+		ssize_t written = pwritev( device->fd, iov, iovcnt, offset );
+		if( written < 0 && errno == EINVAL && device->direct )
+		{
+			fprintf( stderr, "szs_receiver: device %s: O_DIRECT write refused, using buffered I/O\n", device->name );
+			fcntl( device->fd, F_SETFL, fcntl( device->fd, F_GETFL ) & ~O_DIRECT );
+			device->direct = false;
+			continue;
+		}
+
+		if( written <= 0 )
+		{
+			return written < 0 ? -errno : -EIO;
+		}
+
+		offset += written;
+		total -= written;
+		while( iovcnt > 0 && ( size_t )written >= iov->iov_len )
+		{
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if( iovcnt > 0 )
+		{
+			iov->iov_base = ( char* )iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function makes everything applied so far durable on the replica.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int flush_target( struct device* device )
+{
+	device->flushes++;
+	return fdatasync( device->fd ) ? -errno : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// XXH64 digest with a seed of 0, as the tracker computes it for deduplication references.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl64( uint64_t value, int bits )
+{
+	return ( value << bits ) | ( value >> ( 64 - bits ) );
+}
+
+static inline uint64_t xxh_read64( const uint8_t* position )
+{
+	uint64_t value;
+	memcpy( &value, position, sizeof( value ) );
+	return value;
+}
+
+static inline uint32_t xxh_read32( const uint8_t* position )
+{
+	uint32_t value;
+	memcpy( &value, position, sizeof( value ) );
+	return value;
+}
+
+static inline uint64_t xxh64_round( uint64_t accumulator, uint64_t input )
+{
+	accumulator += input * XXH_PRIME64_2;
+	accumulator = xxh_rotl64( accumulator, 31 );
+	return accumulator * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round( uint64_t accumulator, uint64_t value )
+{
+	accumulator ^= xxh64_round( 0, value );
+	return accumulator * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64( const void* data, size_t length )
+{
+	const uint8_t* position = data;
+	const uint8_t* end = position + length;
+	uint64_t hash;
+
+	if( length >= 32 )
+	{
+		uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = XXH_PRIME64_2;
+		uint64_t v3 = 0;
+		uint64_t v4 = 0 - XXH_PRIME64_1;
+		while( position + 32 <= end )
+		{
+			v1 = xxh64_round( v1, xxh_read64( position ) );
+			v2 = xxh64_round( v2, xxh_read64( position + 8 ) );
+			v3 = xxh64_round( v3, xxh_read64( position + 16 ) );
+			v4 = xxh64_round( v4, xxh_read64( position + 24 ) );
+			position += 32;
+		}
+
+		hash = xxh_rotl64( v1, 1 ) + xxh_rotl64( v2, 7 ) + xxh_rotl64( v3, 12 ) + xxh_rotl64( v4, 18 );
+		hash = xxh64_merge_round( hash, v1 );
+		hash = xxh64_merge_round( hash, v2 );
+		hash = xxh64_merge_round( hash, v3 );
+		hash = xxh64_merge_round( hash, v4 );
+	}
+	else
+	{
+		hash = XXH_PRIME64_5;
+	}
+
+	hash += length;
+
+	while( position + 8 <= end )
+	{
+		hash ^= xxh64_round( 0, xxh_read64( position ) );
+		hash = xxh_rotl64( hash, 27 ) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		position += 8;
+	}
+
+	if( position + 4 <= end )
+	{
+		hash ^= ( uint64_t )xxh_read32( position ) * XXH_PRIME64_1;
+		hash = xxh_rotl64( hash, 23 ) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		position += 4;
+	}
+
+	while( position < end )
+	{
+		hash ^= *position * XXH_PRIME64_5;
+		hash = xxh_rotl64( hash, 11 ) * XXH_PRIME64_1;
+		position++;
+	}
+
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function turns a deduplicated record into a data record by reading its source range
+// from the replica into its buffer, which has room for 'length' bytes. A source beyond the
+// end of an image file reads as zeroes. It returns -ESTALE when the digest does not match.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int resolve_dedup_reference( struct device* device, struct record* record )
+{
+	struct szs_record_header* header = &record->header;
+	if( header->payloadLength < sizeof( struct szs_dedup_reference ) )
+	{
+		return -EBADMSG;
+	}
+
+	struct szs_dedup_reference reference;
+	memcpy( &reference, record->data, sizeof( reference ) );
+
+	char* position = record->data;
+	uint64_t offset = reference.sourceSector * BIO_SECTOR_SIZE;
+	size_t remaining = header->length;
+	while( remaining > 0 )
+	{
+		ssize_t received = pread( device->fd, position, remaining, offset );
+		if( received < 0 && errno == EINVAL && device->direct )
+		{
+			fprintf( stderr, "szs_receiver: device %s: O_DIRECT read refused, using buffered I/O\n", device->name );
+			fcntl( device->fd, F_SETFL, fcntl( device->fd, F_GETFL ) & ~O_DIRECT );
+			device->direct = false;
+			continue;
+		}
+
+		if( received < 0 )
+		{
+			return -errno;
+		}
+
+		if( received == 0 )
+		{
+			memset( position, 0, remaining );
+			break;
+		}
+
+		position += received;
+		offset += received;
+		remaining -= received;
+	}
+
+	if( xxh64( record->data, header->length ) != reference.digest )
+	{
+		return -ESTALE;
+	}
+
+	header->flags &= ~SZS_RECORD_FLAG_DEDUP;
+	header->payloadLength = header->length;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// These functions keep the list of connections resync requests can be sent back on.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool add_connection( int fd )
+{
+	pthread_mutex_lock( &connectionsLock );
+	bool added = nrConnections < MAX_CONNECTIONS;
+	if( added )
+	{
+		connections[nrConnections++] = fd;
+	}
+
+	pthread_mutex_unlock( &connectionsLock );
+	return added;
+}
+
+static void remove_connection( int fd )
+{
+	pthread_mutex_lock( &connectionsLock );
+	unsigned int index = 0;
+	while( index < nrConnections )
+	{
+		if( connections[index] == fd )
+		{
+			connections[index] = connections[--nrConnections];
+			break;
+		}
+
+		index++;
+	}
+
+	pthread_mutex_unlock( &connectionsLock );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sends a resync request on the first connection, in turn, that takes it whole
+// without blocking. A connection that only took part of it is shut down, as the tracker could
+// not make sense of what follows; its reader then closes it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int send_resync_request( struct szs_resync_request* request )
+{
+	int ret = -ENOTCONN;
+
+	pthread_mutex_lock( &connectionsLock );
+	unsigned int tried = 0;
+	while( tried < nrConnections )
+	{
+		int fd = connections[nextConnection++ % nrConnections];
+		ssize_t sent = send( fd, request, sizeof( *request ), MSG_DONTWAIT | MSG_NOSIGNAL );
+		if( sent == sizeof( *request ) )
+		{
+			ret = 0;
+			break;
+		}
+
+		if( sent > 0 )
+		{
+			shutdown( fd, SHUT_RDWR );
+		}
+
+		ret = sent < 0 ? -errno : -EIO;
+		tried++;
+	}
+
+	pthread_mutex_unlock( &connectionsLock );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function asks the tracker to send the range of a record that could not be resolved
+// again. It is resent with a fresh sequence number.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void request_resync( struct device* device, struct szs_record_header* header )
+{
+	int ret = 0;
+	if( controlFd >= 0 )
+	{
+		struct resync_range_request request = {
+			.deviceId = header->deviceId,
+			.sector = header->sector,
+			.length = header->length,
+		};
+
+		ret = ioctl( controlFd, BLOCK_DEVICE_RESYNC_RANGE, &request ) ? -errno : 0;
+	}
+	else
+	{
+		struct szs_resync_request request = {
+			.magic = SZS_RESYNC_MAGIC,
+			.deviceId = header->deviceId,
+			.sector = header->sector,
+			.length = header->length,
+		};
+
+		ret = send_resync_request( &request );
+	}
+
+	if( ret )
+	{
+		fprintf( stderr, "szs_receiver: device %s: cannot ask for the deduplicated record at sector %llu again: %s\n",
+			 device->name, ( unsigned long long )header->sector, strerror( -ret ) );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function leaves out a deduplicated record that could not be resolved: its buffer holds
+// the reference or a partial read, never the data. Its range is asked for again.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void skip_unresolved_record( struct device* device, struct szs_record_header* header, int error )
+{
+	if( error == -ESTALE )
+	{
+		device->dedupMisses++;
+	}
+	else
+	{
+		device->writeErrors++;
+		fprintf( stderr, "szs_receiver: device %s: cannot read the source of the deduplicated record at sector %llu: %s\n",
+			 device->name, ( unsigned long long )header->sector, strerror( -error ) );
+	}
+
+	request_resync( device, header );
+	device->lastTimestampNs = header->timestampNs;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function applies a batch of records popped in sequence order.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void apply_batch( struct device* device, struct record** batch, unsigned int count )
+{
+	unsigned int start = 0;
+	while( start < count )
+	{
+		struct szs_record_header* header = &batch[start]->header;
+		unsigned int end = start + 1;
+		int ret = 0;
+
+		if( header->flags & SZS_RECORD_FLAG_DEDUP )
+		{
+			ret = resolve_dedup_reference( device, batch[start] );
+			if( ret )
+			{
+				skip_unresolved_record( device, header, ret );
+				start = end;
+				continue;
+			}
+
+			device->dedupHits++;
+		}
+
+		if( header->opType == SZS_OP_FLUSH || ( header->flags & SZS_RECORD_FLAG_PREFLUSH ) )
+		{
+			ret = flush_target( device );
+		}
+
+		if( ret || header->opType == SZS_OP_FLUSH )
+		{
+			// Nothing to write
+		}
+		else if( header->flags & ( SZS_RECORD_FLAG_ZERO | SZS_RECORD_FLAG_DISCARD ) )
+		{
+			ret = apply_zero_range( device, header->sector * BIO_SECTOR_SIZE, header->length, header->flags & SZS_RECORD_FLAG_DISCARD );
+		}
+		else
+		{
+			// Extend the run while the next record is data that starts where this one ends,
+			// up to the next barrier or deduplicated record, which is resolved on its own
+			while( end < count && !( batch[end - 1]->header.flags & SZS_RECORD_FLAG_FUA ) )
+			{
+				struct szs_record_header* previous = &batch[end - 1]->header;
+				struct szs_record_header* next = &batch[end]->header;
+				if( batch[end]->data == NULL || ( next->flags & ( SZS_RECORD_FLAG_PREFLUSH | SZS_RECORD_FLAG_DEDUP ) ) ||
+				    next->sector != previous->sector + previous->length / BIO_SECTOR_SIZE )
+				{
+					break;
+				}
+
+				end++;
+			}
+
+			ret = apply_data_run( device, &batch[start], end - start );
+		}
+
+		if( ret == 0 && ( batch[end - 1]->header.flags & SZS_RECORD_FLAG_FUA ) )
+		{
+			ret = flush_target( device );
+		}
+
+		unsigned int index = start;
+		while( index < end )
+		{
+			if( ret )
+			{
+				device->writeErrors++;
+			}
+			else
+			{
+				device->appliedRecords++;
+				device->appliedBytes += batch[index]->header.length;
+				note_applied( device, &batch[index]->header );
+			}
+
+			device->lastTimestampNs = batch[index]->header.timestampNs;
+			index++;
+		}
+
+		if( ret )
+		{
+			fprintf( stderr, "szs_receiver: device %s: write at sector %llu failed: %s\n", device->name,
+				 ( unsigned long long )header->sector, strerror( -ret ) );
+		}
+
+		start = end;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function applies a record that filled a hole, leaving out the sectors written by
+// records of higher numbers since. A barrier only costs a flush, as the records it ordered
+// have been applied already. It returns 1 when the record was left out.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int apply_late_record( struct device* device, struct record* record )
+{
+	struct szs_record_header* header = &record->header;
+	int ret = 0;
+
+	if( header->opType == SZS_OP_FLUSH || ( header->flags & SZS_RECORD_FLAG_PREFLUSH ) )
+	{
+		ret = flush_target( device );
+	}
+
+	if( ret || header->opType == SZS_OP_FLUSH || header->length < BIO_SECTOR_SIZE )
+	{
+		return ret;
+	}
+
+	if( header->flags & SZS_RECORD_FLAG_DEDUP )
+	{
+		ret = resolve_dedup_reference( device, record );
+		if( ret )
+		{
+			skip_unresolved_record( device, header, ret );
+			return 1;
+		}
+
+		device->dedupHits++;
+	}
+
+	uint64_t first = header->sector;
+	uint64_t last = first + header->length / BIO_SECTOR_SIZE - 1;
+	uint64_t pieceFirst = first;
+	uint64_t pieceLast = 0;
+	while( ret == 0 && pieceFirst <= last && next_unwritten_piece( device, header->sequence, &pieceFirst, last, &pieceLast ) )
+	{
+		uint64_t length = ( pieceLast - pieceFirst + 1 ) * BIO_SECTOR_SIZE;
+		if( header->flags & ( SZS_RECORD_FLAG_ZERO | SZS_RECORD_FLAG_DISCARD ) )
+		{
+			ret = apply_zero_range( device, pieceFirst * BIO_SECTOR_SIZE, length, header->flags & SZS_RECORD_FLAG_DISCARD );
+		}
+		else
+		{
+			struct record piece = *record;
+			piece.header.sector = pieceFirst;
+			piece.header.length = length;
+			piece.data = ( char* )record->data + ( pieceFirst - first ) * BIO_SECTOR_SIZE;
+
+			struct record* pieces[1] = { &piece };
+			ret = apply_data_run( device, pieces, 1 );
+		}
+
+		device->appliedBytes += ret ? 0 : length;
+		pieceFirst = pieceLast + 1;
+	}
+
+	if( ret == 0 && ( header->flags & SZS_RECORD_FLAG_FUA ) )
+	{
+		ret = flush_target( device );
+	}
+
+	if( ret == 0 )
+	{
+		note_applied( device, header );
+	}
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function applies the late records taken by the applier and frees them.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void apply_late_records( struct device* device, struct record* records )
+{
+	while( records != NULL )
+	{
+		struct record* next = records->next;
+		int ret = apply_late_record( device, records );
+		if( ret < 0 )
+		{
+			device->writeErrors++;
+			fprintf( stderr, "szs_receiver: device %s: late write at sector %llu failed: %s\n", device->name,
+				 ( unsigned long long )records->header.sector, strerror( -ret ) );
+		}
+		else if( ret == 0 )
+		{
+			device->lateApplied++;
+		}
+
+		free_record( records );
+		records = next;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function takes the late records that still fill a hole, in arrival order, and frees
+// the others. Called with the device lock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct record* take_late_records( struct device* device )
+{
+	struct record* records = device->lateHead;
+	device->lateHead = NULL;
+	device->lateTail = NULL;
+
+	struct record* head = NULL;
+	struct record** tail = &head;
+	while( records != NULL )
+	{
+		struct record* next = records->next;
+		if( fill_hole( device, records->header.sequence ) )
+		{
+			records->next = NULL;
+			*tail = records;
+			tail = &records->next;
+		}
+		else
+		{
+			device->lateRecords++;
+			free_record( records );
+		}
+
+		records = next;
+	}
+
+	return head;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Applier thread of a device. It pops records while their sequence number is the next one
+// expected, and skips a missing number once the oldest pending record has waited for longer
+// than the gap timeout. Late records go first.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void* applier_fn( void* data )
+{
+	struct device* device = data;
+	struct record* batch[APPLY_BATCH_RECORDS];
+	uint64_t blockedSince = 0;
+
+	pthread_mutex_lock( &device->lock );
+	while( !device->stopping || device->heapSize > 0 || device->lateHead != NULL )
+	{
+		expire_holes( device );
+		struct record* late = take_late_records( device );
+
+		unsigned int count = 0;
+		size_t bytes = 0;
+		while( device->heapSize > 0 && count < APPLY_BATCH_RECORDS && bytes < APPLY_BATCH_BYTES )
+		{
+			uint64_t sequence = device->heap[0]->header.sequence;
+			if( sequence != device->nextSequence )
+			{
+				if( blockedSince == 0 )
+				{
+					blockedSince = monotonic_ns();
+				}
+
+				if( !device->stopping && monotonic_ns() - blockedSince < ( uint64_t )gapTimeoutMs * 1000000ULL )
+				{
+					break;
+				}
+
+				device->skippedSequences += sequence - device->nextSequence;
+				add_hole( device, device->nextSequence, sequence - 1 );
+				device->nextSequence = sequence;
+			}
+
+			blockedSince = 0;
+			batch[count] = heap_pop( device );
+			bytes += batch[count]->header.length;
+			device->pendingBytes -= batch[count]->header.length;
+			device->nextSequence++;
+			count++;
+		}
+
+		if( count == 0 && late == NULL )
+		{
+			if( device->stopping && device->heapSize == 0 )
+			{
+				break;
+			}
+
+			struct timespec deadline;
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			deadline.tv_nsec += 100 * 1000000L;
+			if( deadline.tv_nsec >= 1000000000L )
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+
+			pthread_cond_timedwait( &device->wake, &device->lock, &deadline );
+			continue;
+		}
+
+		pthread_mutex_unlock( &device->lock );
+		apply_late_records( device, late );
+		apply_batch( device, batch, count );
+
+		unsigned int index = 0;
+		while( index < count )
+		{
+			free_record( batch[index] );
+			index++;
+		}
+
+		pthread_mutex_lock( &device->lock );
+	}
+	pthread_mutex_unlock( &device->lock );
+
+	fdatasync( device->fd );
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void stop_device( struct device* device )
+{
+	pthread_mutex_lock( &device->lock );
+	device->stopping = true;
+	pthread_cond_signal( &device->wake );
+	pthread_mutex_unlock( &device->lock );
+
+	pthread_join( device->applier, NULL );
+	close( device->fd );
+
+	while( device->lateHead != NULL )
+	{
+		struct record* next = device->lateHead->next;
+		free_record( device->lateHead );
+		device->lateHead = next;
+	}
+
+	free( device->heap );
+	free( device->holes );
+	free( device->applied );
+	free( device );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the state of a device announced in a device map and starts its
+// applier. Called with devicesLock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct device* start_device( uint32_t id, const char* name )
+{
+	struct device* device = calloc( 1, sizeof( *device ) );
+	if( device == NULL )
+	{
+		return NULL;
+	}
+
+	device->id = id;
+	memcpy( device->name, name, BLOCK_DEVICE_NAME_LEN );
+	device->name[BLOCK_DEVICE_NAME_LEN] = '\0';
+	device->nextSequence = 1;
+	pthread_mutex_init( &device->lock, NULL );
+	pthread_cond_init( &device->wake, NULL );
+
+	if( open_target( device ) )
+	{
+		free( device );
+		return NULL;
+	}
+
+	if( pthread_create( &device->applier, NULL, applier_fn, device ) )
+	{
+		close( device->fd );
+		free( device );
+		return NULL;
+	}
+
+	return device;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function stops every device and forgets the device map. Called with devicesLock held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void stop_devices( void )
+{
+	uint32_t id = 0;
+	while( id < MAX_DEVICE_IDS )
+	{
+		if( devices[id] != NULL )
+		{
+			stop_device( devices[id] );
+			devices[id] = NULL;
+		}
+
+		id++;
+	}
+
+	mapGeneration = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function makes the session of a new connection the current one. A session other than
+// the current one means the tracker was reloaded, so the state of the previous session is
+// dropped: its device IDs and sequence numbers start over in the new one.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void begin_session( uint64_t session )
+{
+	pthread_mutex_lock( &devicesLock );
+	if( session != sessionId )
+	{
+		if( mapGeneration != 0 )
+		{
+			fprintf( stderr, "szs_receiver: new tracker session %016llx, devices of the previous one dropped\n",
+				 ( unsigned long long )session );
+		}
+
+		stop_devices();
+		sessionId = session;
+	}
+
+	pthread_mutex_unlock( &devicesLock );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function applies a device map. Maps reach every connection, so only a generation newer
+// than the last one seen is applied. A device that left the map was unregistered: its state
+// is dropped, its sequence numbers restart if it comes back. A map of a previous session is
+// refused with -ESTALE.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int apply_device_map( uint64_t session, uint64_t generation, const struct szs_device_map_entry* entries, size_t count )
+{
+	pthread_mutex_lock( &devicesLock );
+	if( session != sessionId )
+	{
+		pthread_mutex_unlock( &devicesLock );
+		return -ESTALE;
+	}
+
+	if( generation <= mapGeneration )
+	{
+		pthread_mutex_unlock( &devicesLock );
+		return 0;
+	}
+
+	mapGeneration = generation;
+
+	static bool present[MAX_DEVICE_IDS];
+	memset( present, 0, sizeof( present ) );
+
+	size_t index = 0;
+	while( index < count )
+	{
+		uint32_t id = entries[index].deviceId;
+		if( id < MAX_DEVICE_IDS )
+		{
+			present[id] = true;
+
+			struct device* device = devices[id];
+			if( device != NULL && strncmp( device->name, entries[index].name, BLOCK_DEVICE_NAME_LEN ) != 0 )
+			{
+				stop_device( device );
+				devices[id] = NULL;
+			}
+
+			if( devices[id] == NULL )
+			{
+				devices[id] = start_device( id, entries[index].name );
+			}
+		}
+
+		index++;
+	}
+
+	uint32_t id = 0;
+	while( id < MAX_DEVICE_IDS )
+	{
+		if( devices[id] != NULL && !present[id] )
+		{
+			stop_device( devices[id] );
+			devices[id] = NULL;
+		}
+
+		id++;
+	}
+
+	pthread_mutex_unlock( &devicesLock );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands a record to its device. A record whose sequence number was skipped goes
+// to the late list if its hole is still open. Records of unknown devices and other records
+// below the next expected number are discarded. A record of a previous session is refused
+// with -ESTALE.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int dispatch_record( uint64_t session, struct record* record )
+{
+	pthread_mutex_lock( &devicesLock );
+	if( session != sessionId )
+	{
+		pthread_mutex_unlock( &devicesLock );
+		free_record( record );
+		return -ESTALE;
+	}
+
+	struct device* device = record->header.deviceId < MAX_DEVICE_IDS ? devices[record->header.deviceId] : NULL;
+	if( device == NULL )
+	{
+		pthread_mutex_unlock( &devicesLock );
+		__atomic_add_fetch( &protocolErrors, 1, __ATOMIC_RELAXED );
+		free_record( record );
+		return 0;
+	}
+
+	pthread_mutex_lock( &device->lock );
+	pthread_mutex_unlock( &devicesLock );
+
+	if( record->header.sequence < device->nextSequence )
+	{
+		if( !in_hole( device, record->header.sequence ) )
+		{
+			device->lateRecords++;
+			pthread_mutex_unlock( &device->lock );
+			free_record( record );
+			return 0;
+		}
+
+		record->next = NULL;
+		if( device->lateTail != NULL )
+		{
+			device->lateTail->next = record;
+		}
+		else
+		{
+			device->lateHead = record;
+		}
+
+		device->lateTail = record;
+		pthread_cond_signal( &device->wake );
+		pthread_mutex_unlock( &device->lock );
+		return 0;
+	}
+
+	if( heap_push( device, record ) )
+	{
+		pthread_mutex_unlock( &device->lock );
+		fprintf( stderr, "szs_receiver: out of memory, record dropped\n" );
+		free_record( record );
+		return 0;
+	}
+
+	device->pendingBytes += record->header.length;
+	if( record->header.sequence > device->highestSequence )
+	{
+		device->highestSequence = record->header.sequence;
+	}
+
+	if( record->header.sequence == device->nextSequence )
+	{
+		pthread_cond_signal( &device->wake );
+	}
+
+	pthread_mutex_unlock( &device->lock );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int read_exact( int fd, void* buffer, size_t length )
+{
+	char* position = buffer;
+	while( length > 0 )
+	{
+		ssize_t received = recv( fd, position, length, MSG_WAITALL );
+		if( received <= 0 )
+		{
+			return received == 0 ? -EPIPE : -errno;
+		}
+
+		position += received;
+		length -= received;
+		__atomic_add_fetch( &receivedBytes, received, __ATOMIC_RELAXED );
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reads the payload of a record into an aligned buffer of 'length' bytes,
+// decompressing it if needed, and checks its CRC.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int read_payload( int fd, struct record* record )
+{
+	struct szs_record_header* header = &record->header;
+	size_t bufferSize = header->length > header->payloadLength ? header->length : header->payloadLength;
+	void* payload = NULL;
+	if( posix_memalign( &payload, BUFFER_ALIGNMENT, bufferSize ? bufferSize : 1 ) )
+	{
+		return -ENOMEM;
+	}
+
+	int ret = read_exact( fd, payload, header->payloadLength );
+	if( ret )
+	{
+		free( payload );
+		return ret;
+	}
+
+	if( ( header->flags & SZS_RECORD_FLAG_CRC32C ) && crc32c( payload, header->payloadLength ) != header->crc32c )
+	{
+		__atomic_add_fetch( &crcErrors, 1, __ATOMIC_RELAXED );
+		fprintf( stderr, "szs_receiver: CRC mismatch on device %u sequence %llu\n", header->deviceId,
+			 ( unsigned long long )header->sequence );
+		free( payload );
+		return -EBADMSG;
+	}
+
+	if( header->flags & SZS_RECORD_FLAG_LZ4 )
+	{
+		#ifdef HAVE_LZ4
+		void* restored = NULL;
+		if( posix_memalign( &restored, BUFFER_ALIGNMENT, header->length ) )
+		{
+			free( payload );
+			return -ENOMEM;
+		}
+
+		int restoredLength = LZ4_decompress_safe( payload, restored, header->payloadLength, header->length );
+		free( payload );
+		if( restoredLength != ( int )header->length )
+		{
+			free( restored );
+			return -EBADMSG;
+		}
+
+		payload = restored;
+		#else
+		fprintf( stderr, "szs_receiver: compressed record received, rebuild with HAVE_LZ4\n" );
+		free( payload );
+		return -ENOTSUP;
+		#endif
+	}
+
+	record->data = payload;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Reader thread of one connection. Any protocol error closes the connection; the tracker then
+// resends what it could not deliver. So does a new session of the tracker, for the connections
+// of the previous one.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void* reader_fn( void* data )
+{
+	int fd = ( int )( intptr_t )data;
+
+	struct szs_stream_preamble preamble;
+	if( read_exact( fd, &preamble, sizeof( preamble ) ) || preamble.magic != SZS_WIRE_MAGIC ||
+	    preamble.version != SZS_WIRE_VERSION || preamble.headerSize < sizeof( struct szs_record_header ) )
+	{
+		fprintf( stderr, "szs_receiver: bad stream preamble, connection closed\n" );
+		__atomic_add_fetch( &protocolErrors, 1, __ATOMIC_RELAXED );
+		close( fd );
+		return NULL;
+	}
+
+	begin_session( preamble.sessionId );
+	bool registered = add_connection( fd );
+
+	while( !stopRequested )
+	{
+		struct record* record = calloc( 1, sizeof( *record ) );
+		if( record == NULL || read_exact( fd, &record->header, sizeof( record->header ) ) )
+		{
+			free( record );
+			break;
+		}
+
+		// Newer senders may append fields to the header
+		char skip[256];
+		size_t extra = preamble.headerSize - sizeof( record->header );
+		if( extra > sizeof( skip ) || ( extra && read_exact( fd, skip, extra ) ) )
+		{
+			free( record );
+			break;
+		}
+
+		struct szs_record_header* header = &record->header;
+		if( header->payloadLength > 0 && read_payload( fd, record ) )
+		{
+			free( record );
+			break;
+		}
+
+		int ret = 0;
+		if( header->opType == SZS_OP_DEVICE_MAP )
+		{
+			ret = apply_device_map( preamble.sessionId, header->sequence, record->data,
+						header->payloadLength / sizeof( struct szs_device_map_entry ) );
+			free_record( record );
+		}
+		else if( header->opType == SZS_OP_WRITE || header->opType == SZS_OP_FLUSH )
+		{
+			ret = dispatch_record( preamble.sessionId, record );
+		}
+		else
+		{
+			__atomic_add_fetch( &protocolErrors, 1, __ATOMIC_RELAXED );
+			free_record( record );
+		}
+
+		if( ret == -ESTALE )
+		{
+			fprintf( stderr, "szs_receiver: connection of a previous tracker session closed\n" );
+			break;
+		}
+	}
+
+	if( registered )
+	{
+		remove_connection( fd );
+	}
+
+	close( fd );
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function prints one line per device: applied throughput since the last report, lag
+// between capture and apply of the last applied record, and what is waiting in the heap.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void print_statistics( double seconds, uint64_t* lastApplied )
+{
+	fprintf( stderr, "szs_receiver: received %llu bytes, %llu CRC errors, %llu protocol errors\n",
+		 ( unsigned long long )__atomic_load_n( &receivedBytes, __ATOMIC_RELAXED ),
+		 ( unsigned long long )__atomic_load_n( &crcErrors, __ATOMIC_RELAXED ),
+		 ( unsigned long long )__atomic_load_n( &protocolErrors, __ATOMIC_RELAXED ) );
+
+	pthread_mutex_lock( &devicesLock );
+	uint32_t id = 0;
+	while( id < MAX_DEVICE_IDS )
+	{
+		struct device* device = devices[id];
+		if( device == NULL )
+		{
+			lastApplied[id] = 0;
+			id++;
+			continue;
+		}
+
+		pthread_mutex_lock( &device->lock );
+		uint64_t applied = device->appliedBytes;
+		uint64_t lastTimestamp = device->lastTimestampNs;
+		uint64_t now = realtime_ns();
+		fprintf( stderr, "  %s: applied %llu records, %.1f MB/s, lag %.1f ms, seq %llu/%llu, pending %zu records %llu bytes, "
+			 "skipped %llu, late applied %llu, discarded %llu, write errors %llu, flushes %llu, dedup hits %llu, misses %llu\n",
+			 device->name, ( unsigned long long )device->appliedRecords,
+			 seconds > 0 ? ( applied - lastApplied[id] ) / seconds / 1e6 : 0.0,
+			 lastTimestamp && now > lastTimestamp ? ( now - lastTimestamp ) / 1e6 : 0.0,
+			 ( unsigned long long )( device->nextSequence - 1 ), ( unsigned long long )device->highestSequence,
+			 device->heapSize, ( unsigned long long )device->pendingBytes,
+			 ( unsigned long long )device->skippedSequences, ( unsigned long long )device->lateApplied,
+			 ( unsigned long long )device->lateRecords,
+			 ( unsigned long long )device->writeErrors, ( unsigned long long )device->flushes,
+			 ( unsigned long long )device->dedupHits, ( unsigned long long )device->dedupMisses );
+		pthread_mutex_unlock( &device->lock );
+
+		lastApplied[id] = applied;
+		id++;
+	}
+	pthread_mutex_unlock( &devicesLock );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void on_signal( int signum )
+{
+	( void )signum;
+	stopRequested = 1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int usage( void )
+{
+	fprintf( stderr, "usage: szs_receiver [-l address] [-p port] [-d directory] [-m name=target]... [-D] [-s seconds] [-g gap_ms] [-w late_ms] [-c control_device]\n" );
+	return 2;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char** argv )
+{
+	const char* address = "127.0.0.1";
+	const char* controlDevice = NULL;
+	unsigned short port = DEFAULT_PORT;
+	unsigned int statsInterval = DEFAULT_STATS_INTERVAL;
+
+	int option;
+	while( ( option = getopt( argc, argv, "l:p:d:m:Ds:g:w:c:" ) ) != -1 )
+	{
+		switch( option )
+		{
+			case 'l':
+				address = optarg;
+				break;
+			case 'p':
+				port = ( unsigned short )atoi( optarg );
+				break;
+			case 'd':
+				targetDirectory = optarg;
+				break;
+			case 'm':
+			{
+				char* separator = strchr( optarg, '=' );
+				if( separator == NULL || nrOverrides == MAX_TARGET_OVERRIDES || separator - optarg > BLOCK_DEVICE_NAME_LEN )
+				{
+					return usage();
+				}
+
+				memcpy( overrides[nrOverrides].name, optarg, separator - optarg );
+				overrides[nrOverrides].path = separator + 1;
+				nrOverrides++;
+				break;
+			}
+			case 'D':
+				useDirectIo = true;
+				break;
+			case 's':
+				statsInterval = atoi( optarg );
+				break;
+			case 'g':
+				gapTimeoutMs = atoi( optarg );
+				break;
+			case 'w':
+				lateWindowMs = atoi( optarg );
+				break;
+			case 'c':
+				controlDevice = optarg;
+				break;
+			default:
+				return usage();
+		}
+	}
+
+	crc32c_init();
+
+	// Without an explicit control device, resync requests go back on the connections unless
+	// the receiver runs on the tracked host
+	controlFd = open( controlDevice ? controlDevice : "/dev/" SZS_TRACKER_CONTROL_DEVICE_NAME, O_RDWR );
+	if( controlFd < 0 && controlDevice != NULL )
+	{
+		fprintf( stderr, "szs_receiver: cannot open %s: %s\n", controlDevice, strerror( errno ) );
+		return 1;
+	}
+
+	struct sigaction action;
+	memset( &action, 0, sizeof( action ) );
+	action.sa_handler = on_signal;
+	sigaction( SIGINT, &action, NULL );
+	sigaction( SIGTERM, &action, NULL );
+	signal( SIGPIPE, SIG_IGN );
+
+	int listenFd = socket( AF_INET, SOCK_STREAM, 0 );
+	int one = 1;
+	setsockopt( listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+
+	struct sockaddr_in listenAddress;
+	memset( &listenAddress, 0, sizeof( listenAddress ) );
+	listenAddress.sin_family = AF_INET;
+	listenAddress.sin_port = htons( port );
+	if( inet_pton( AF_INET, address, &listenAddress.sin_addr ) != 1 ||
+	    bind( listenFd, ( struct sockaddr* )&listenAddress, sizeof( listenAddress ) ) < 0 ||
+	    listen( listenFd, SOCKET_POOL_MAX_SOCKETS ) < 0 )
+	{
+		fprintf( stderr, "szs_receiver: cannot listen on %s:%u: %s\n", address, port, strerror( errno ) );
+		return 1;
+	}
+
+	fprintf( stderr, "szs_receiver: listening on %s:%u\n", address, port );
+
+	static uint64_t lastApplied[MAX_DEVICE_IDS];
+	uint64_t lastReport = monotonic_ns();
+	while( !stopRequested )
+	{
+		struct timeval timeout = { .tv_sec = 0, .tv_usec = 200000 };
+		fd_set readable;
+		FD_ZERO( &readable );
+		FD_SET( listenFd, &readable );
+
+		if( select( listenFd + 1, &readable, NULL, NULL, &timeout ) > 0 )
+		{
+			int fd = accept( listenFd, NULL, NULL );
+			if( fd >= 0 )
+			{
+				int bufferSize = 4 * 1024 * 1024;
+				setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof( bufferSize ) );
+
+				pthread_t reader;
+				if( pthread_create( &reader, NULL, reader_fn, ( void* )( intptr_t )fd ) == 0 )
+				{
+					pthread_detach( reader );
+				}
+				else
+				{
+					close( fd );
+				}
+			}
+		}
+
+		uint64_t now = monotonic_ns();
+		if( statsInterval && now - lastReport >= ( uint64_t )statsInterval * 1000000000ULL )
+		{
+			print_statistics( ( now - lastReport ) / 1e9, lastApplied );
+			lastReport = now;
+		}
+	}
+
+	// Readers blocked in recv are abandoned; everything already dispatched is applied
+	close( listenFd );
+	pthread_mutex_lock( &devicesLock );
+	stop_devices();
+	pthread_mutex_unlock( &devicesLock );
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
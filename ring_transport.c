@@ -0,0 +1,413 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <ring_transport.h>
+#include <linux/delay.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include <kernel_compat.h>
+#include <logging.h>
+#include <constants.h>
+#include <device_map.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int ringSizeMb = RING_DEFAULT_SIZE_MB;
+module_param_named( ring_size_mb, ringSizeMb, uint, 0444 );
+MODULE_PARM_DESC( ring_size_mb, "Size of the shared change record ring in MiB, rounded up to a power of two" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The ring is allocated once with vmalloc_user, so it is zeroed and can be mapped into the
+// consumer. Producers (capture workers and the synchronous path) are serialized by
+// 'producerMutex', which makes the ring single-producer; the consumer side is lock-free.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct change_ring
+{
+	void *base;
+	size_t mappingSize;
+	struct szs_ring_control *control;
+	char *data;
+	uint64_t dataSize;
+	uint64_t head;                // Producer copy of control->head
+	uint64_t mapGeneration;       // Device map the consumer has been given, 0 = none
+	struct mutex producerMutex;
+	wait_queue_head_t dataWait;
+	struct eventfd_ctx *eventfd;
+	atomic_t consumerAttached;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct change_ring changeRing;
+static bool ringInitialized = false;
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies a change record into the data area at the given offset. Every vector
+// of a record lies within a single page.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void copy_change_record_to_ring( struct change_record* record, char* dst )
+{
+	unsigned int index = 0;
+	while( index <= record->nrVecs )
+	{
+		struct bio_vec* vec = &record->vecs[index];
+		char* src = kmap_atomic( vec->bv_page );
+		memcpy( dst, src + vec->bv_offset, vec->bv_len );
+		kunmap_atomic( src );
+
+		dst += vec->bv_len;
+		index++;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the free space of the ring. The consumer owns 'tail', so a value that
+// makes no sense is treated as a full ring rather than trusted.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static uint64_t ring_free_space( struct change_ring* ring )
+{
+	uint64_t used = ring->head - smp_load_acquire( &ring->control->tail );
+	return used > ring->dataSize ? 0 : ring->dataSize - used;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function wakes up the consumer if it announced that it is about to sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void ring_notify_consumer( struct change_ring* ring )
+{
+	if( wq_has_sleeper( &ring->dataWait ) )
+	{
+		wake_up_interruptible( &ring->dataWait );
+	}
+
+	// Pairs with the barrier the consumer issues after setting 'consumerWaiting'
+	smp_mb();
+	if( READ_ONCE( ring->control->consumerWaiting ) && ring->eventfd != NULL )
+	{
+		#ifdef HAS_EVENTFD_SIGNAL_NO_COUNT
+		eventfd_signal( ring->eventfd );
+		#else
+		eventfd_signal( ring->eventfd, 1 );
+		#endif
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reserves room for an entry carrying 'size' bytes and returns where they go.
+// When the ring is full, the producer waits up to RING_FULL_WAIT_MS for the consumer to make
+// room; after that, or when no consumer is attached, NULL is returned and the drop is counted
+// in the control page. The entry becomes visible with commit_ring_entry. Must be called with
+// the producer mutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static char* reserve_ring_entry( struct change_ring* ring, size_t size, uint64_t* reserved )
+{
+	uint64_t length = ALIGN( sizeof( struct szs_ring_entry ) + size, SZS_RING_ENTRY_ALIGN );
+	uint64_t offset = ring->head & ( ring->dataSize - 1 );
+	uint64_t padding = ( offset + length > ring->dataSize ) ? ring->dataSize - offset : 0;
+
+	unsigned long deadline = jiffies + msecs_to_jiffies( RING_FULL_WAIT_MS );
+	while( ring_free_space( ring ) < padding + length )
+	{
+		if( length > ring->dataSize || !atomic_read( &ring->consumerAttached ) || time_after( jiffies, deadline ) )
+		{
+			ring->control->dropped++;
+			return NULL;
+		}
+
+		ring_notify_consumer( ring );
+		usleep_range( 500, 1000 );
+	}
+
+	if( padding )
+	{
+		struct szs_ring_entry* pad = ( struct szs_ring_entry* )( ring->data + offset );
+		pad->length = padding;
+		pad->flags = SZS_RING_ENTRY_PADDING;
+		offset = 0;
+	}
+
+	struct szs_ring_entry* entry = ( struct szs_ring_entry* )( ring->data + offset );
+	entry->length = length;
+	entry->flags = 0;
+
+	*reserved = padding + length;
+	return ( char* )( entry + 1 );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function publishes the entry reserved last.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void commit_ring_entry( struct change_ring* ring, uint64_t reserved )
+{
+	ring->head += reserved;
+	smp_store_release( &ring->control->head, ring->head );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes the current device map into the ring if the consumer has not seen it
+// yet. Must be called with the producer mutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_device_map_to_ring( struct change_ring* ring )
+{
+	if( ring->mapGeneration == device_map_generation() )
+	{
+		return 0;
+	}
+
+	size_t length = 0;
+	uint64_t generation = 0;
+	void* mapRecord = device_map_build_record( &length, &generation );
+	if( mapRecord == NULL )
+	{
+		return -ENOMEM;
+	}
+
+	uint64_t reserved = 0;
+	char* dst = reserve_ring_entry( ring, length, &reserved );
+	if( dst == NULL )
+	{
+		kfree( mapRecord );
+		return -ENOSPC;
+	}
+
+	memcpy( dst, mapRecord, length );
+	commit_ring_entry( ring, reserved );
+	kfree( mapRecord );
+
+	ring->mapGeneration = generation;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies a change record into the ring and publishes it, preceded by the device
+// map when it changed. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int ring_transport_write( struct change_record* record )
+{
+	struct change_ring* ring = &changeRing;
+
+	mutex_lock( &ring->producerMutex );
+
+	int ret = write_device_map_to_ring( ring );
+	if( ret )
+	{
+		ring->control->dropped++;
+		mutex_unlock( &ring->producerMutex );
+		return ret;
+	}
+
+	uint64_t reserved = 0;
+	char* dst = reserve_ring_entry( ring, change_record_wire_length( record ), &reserved );
+	if( dst == NULL )
+	{
+		mutex_unlock( &ring->producerMutex );
+		return -ENOSPC;
+	}
+
+	copy_change_record_to_ring( record, dst );
+	commit_ring_entry( ring, reserved );
+
+	ring_notify_consumer( ring );
+	mutex_unlock( &ring->producerMutex );
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Only one consumer may have the ring device open at a time.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int ring_open( struct inode* inode, struct file* fp )
+{
+	if( atomic_cmpxchg( &changeRing.consumerAttached, 0, 1 ) != 0 )
+	{
+		return -EBUSY;
+	}
+
+	// A new consumer needs the device map before any record
+	mutex_lock( &changeRing.producerMutex );
+	changeRing.mapGeneration = 0;
+	mutex_unlock( &changeRing.producerMutex );
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int ring_release( struct inode* inode, struct file* fp )
+{
+	mutex_lock( &changeRing.producerMutex );
+	if( changeRing.eventfd != NULL )
+	{
+		eventfd_ctx_put( changeRing.eventfd );
+		changeRing.eventfd = NULL;
+	}
+	mutex_unlock( &changeRing.producerMutex );
+
+	atomic_set( &changeRing.consumerAttached, 0 );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The whole ring, control page and data area, is mapped in one go.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int ring_mmap( struct file* fp, struct vm_area_struct* vma )
+{
+	if( vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != changeRing.mappingSize )
+	{
+		LOG_ERROR( -EINVAL, "Ring must be mapped whole, %zu bytes.", changeRing.mappingSize );
+		return -EINVAL;
+	}
+
+	return remap_vmalloc_range( vma, changeRing.base, 0 );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static __poll_t ring_poll( struct file* fp, struct poll_table_struct* wait )
+{
+	poll_wait( fp, &changeRing.dataWait, wait );
+
+	if( READ_ONCE( changeRing.control->head ) != READ_ONCE( changeRing.control->tail ) )
+	{
+		return EPOLLIN | EPOLLRDNORM;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// RING_SET_EVENTFD registers an eventfd that is signalled along with poll wakeups; a negative
+// descriptor removes it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static long ring_ioctl( struct file* fp, unsigned int cmd, unsigned long arg )
+{
+	if( cmd != RING_SET_EVENTFD )
+	{
+		LOG_ERROR( -EINVAL, "Invalid ring ioctl called." );
+		return -EINVAL;
+	}
+
+	int32_t fd;
+	if( copy_from_user( &fd, ( void * )arg, sizeof( fd ) ) )
+	{
+		LOG_ERROR( -EFAULT, "Failed to copy eventfd from user space." );
+		return -EFAULT;
+	}
+
+	struct eventfd_ctx* eventfd = NULL;
+	if( fd >= 0 )
+	{
+		eventfd = eventfd_ctx_fdget( fd );
+		if( IS_ERR( eventfd ) )
+		{
+			LOG_ERROR( PTR_ERR( eventfd ), "Invalid eventfd." );
+			return PTR_ERR( eventfd );
+		}
+	}
+
+	mutex_lock( &changeRing.producerMutex );
+	swap( changeRing.eventfd, eventfd );
+	mutex_unlock( &changeRing.producerMutex );
+
+	if( eventfd != NULL )
+	{
+		eventfd_ctx_put( eventfd );
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct file_operations ringFops =
+{
+	.open = ring_open,
+	.release = ring_release,
+	.mmap = ring_mmap,
+	.poll = ring_poll,
+	.unlocked_ioctl = ring_ioctl,
+	.owner = THIS_MODULE
+};
+static struct miscdevice ringDevice =
+{
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = SZS_TRACKER_RING_DEVICE_NAME,
+	.fops = &ringFops
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function allocates the ring and registers the ring device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int ring_transport_init( void )
+{
+	struct change_ring* ring = &changeRing;
+	memset( ring, 0, sizeof( *ring ) );
+
+	ring->dataSize = roundup_pow_of_two( ( uint64_t )max_t( unsigned int, ringSizeMb, 1 ) << 20 );
+	ring->mappingSize = PAGE_SIZE + ring->dataSize;
+	ring->base = vmalloc_user( ring->mappingSize );
+	if( ring->base == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate %zu bytes for the change ring.", ring->mappingSize );
+		return -ENOMEM;
+	}
+
+	ring->control = ring->base;
+	ring->data = ( char* )ring->base + PAGE_SIZE;
+	ring->control->dataOffset = PAGE_SIZE;
+	ring->control->dataSize = ring->dataSize;
+	ring->control->version = SZS_RING_VERSION;
+	mutex_init( &ring->producerMutex );
+	init_waitqueue_head( &ring->dataWait );
+	atomic_set( &ring->consumerAttached, 0 );
+
+	int ret = misc_register( &ringDevice );
+	if( ret )
+	{
+		LOG_ERROR( ret, "Failed to register ring device." );
+		vfree( ring->base );
+		ring->base = NULL;
+		return ret;
+	}
+
+	ringInitialized = true;
+	LOG_INFO( "Change ring of %llu bytes ready on /dev/%s.", ring->dataSize, SZS_TRACKER_RING_DEVICE_NAME );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function removes the ring device and frees the ring. The module cannot go away while
+// the device is open; pages still mapped after close are kept alive by the mapping.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void ring_transport_cleanup( void )
+{
+	if( !ringInitialized )
+	{
+		return;
+	}
+
+	misc_deregister( &ringDevice );
+	vfree( changeRing.base );
+	changeRing.base = NULL;
+	ringInitialized = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,27 @@
+#ifndef SZS_TRACKER_RING_TRANSPORT_H
+#define SZS_TRACKER_RING_TRANSPORT_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <change_record.h>
+#include <ring_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int ring_transport_init( void );
+void ring_transport_cleanup( void );
+int ring_transport_write( struct change_record* record );
+
+#endif // SZS_TRACKER_RING_TRANSPORT_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
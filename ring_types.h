@@ -0,0 +1,73 @@
+#ifndef SZS_TRACKER_RING_TYPES_H
+#define SZS_TRACKER_RING_TYPES_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Layout of the change record ring shared with the user space consumer through mmap of the
+// ring device. This header is shared with user space tools, so it must only depend on fixed
+// width types.
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The mapping starts with one page holding 'struct szs_ring_control', followed by
+// 'dataSize' bytes of data area. 'head' and 'tail' are free running byte counters; the
+// offset of a position in the data area is 'position & ( dataSize - 1 )'.
+//
+// The kernel is the only producer: it writes entries at 'head' and then publishes them with a
+// release store of 'head'. The consumer reads entries between 'tail' and an acquire load of
+// 'head', then hands the space back with a release store of 'tail'.
+//
+// Before sleeping on the eventfd, the consumer sets 'consumerWaiting', issues a full barrier
+// and checks 'head' once more; the kernel only signals the eventfd while the flag is set.
+// Sleepers in poll() are always woken up.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_ring_control
+{
+	uint64_t head;                // Written by the kernel
+	uint64_t reserved0[7];
+	uint64_t tail;                // Written by the consumer
+	uint32_t consumerWaiting;     // Written by the consumer
+	uint32_t reserved1;
+	uint64_t reserved2[6];
+	uint64_t dataOffset;          // Offset of the data area in the mapping
+	uint64_t dataSize;            // Size of the data area, a power of two
+	uint64_t dropped;             // Records dropped because the ring was full
+	uint32_t version;
+	uint32_t reserved3;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Every entry starts 8-byte aligned with this header; 'length' includes the header and the
+// padding. An entry never wraps: when it does not fit before the end of the data area, a
+// padding entry fills the rest and the record starts at offset 0. A record entry carries one
+// record of wire_format.h exactly as it is sent on a socket, header first. There is no stream
+// preamble; the ring version implies the wire format version.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_ring_entry
+{
+	uint32_t length;
+	uint32_t flags;
+};
+
+#define SZS_RING_VERSION       3
+#define SZS_RING_ENTRY_ALIGN   8
+#define SZS_RING_ENTRY_PADDING 0x1
+
+#endif // SZS_TRACKER_RING_TYPES_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
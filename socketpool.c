@@ -9,7 +9,30 @@
 /*                                                                 */
 /*******************************************************************/
 #include <socketpool.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <net/sock.h>
 #include <logging.h>
+#include <stats.h>
+#include <wire_format.h>
+#include <szs_tracker_trace.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int socketPoolMin = SOCKET_POOL_MIN_SOCKETS;
+module_param_named( socket_pool_min, socketPoolMin, uint, 0644 );
+MODULE_PARM_DESC( socket_pool_min, "Number of connections kept open at all times" );
+
+static unsigned int socketPoolMax = SOCKET_POOL_DEFAULT_MAX_SOCKETS;
+module_param_named( socket_pool_max, socketPoolMax, uint, 0644 );
+MODULE_PARM_DESC( socket_pool_max, "Maximum number of connections (at most " __stringify( SOCKET_POOL_MAX_SOCKETS ) ")" );
+
+static unsigned int socketPoolIdleTimeoutMs = SOCKET_POOL_IDLE_TIMEOUT_MS;
+module_param_named( socket_pool_idle_timeout_ms, socketPoolIdleTimeoutMs, uint, 0644 );
+MODULE_PARM_DESC( socket_pool_idle_timeout_ms, "Idle time after which connections above the minimum are closed" );
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 static int create_socket( struct socket** sock )
@@ -54,8 +77,265 @@ static void destroy_socket( struct socket* sock )
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function initializes a socket pool with SOCKET_POOL_MIN_SOCKETS number of sockets connected
-// to the specified IP and port.
+// This function creates a socket and connects it to the pool endpoint, whose generation is
+// returned in 'generation'. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int create_connected_socket( struct socket_pool* socketPool, struct socket** sock, uint64_t* generation )
+{
+	int ret = create_socket( sock );
+	if( ret != 0 )
+	{
+		LOG_ERROR( ret, "Failed to create socket." );
+		return ret;
+	}
+
+	char ip[TARGET_IP_LEN];
+	mutex_lock( &socketPool->endpointLock );
+	strscpy( ip, socketPool->ip, sizeof( ip ) );
+	unsigned short port = socketPool->port;
+	*generation = socketPool->endpointGeneration;
+	mutex_unlock( &socketPool->endpointLock );
+
+	ret = connect( *sock, ip, port );
+	if( ret != 0 )
+	{
+		LOG_ERROR( ret, "Failed to connect socket to %s:%u.", ip, port );
+		*sock = NULL;
+		return ret;
+	}
+
+	// A stalled receiver must not block senders forever; the hook may be waiting on them
+	( *sock )->sk->sk_sndtimeo = msecs_to_jiffies( SOCKET_SEND_TIMEOUT_MS );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool has_pending_requests( struct socket_pool_entry* entry )
+{
+	return !skb_queue_empty_lockless( &entry->socket->sk->sk_receive_queue );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands the resync requests the receiver sent on a claimed connection to the
+// pool owner, without waiting for more. A request is only taken once it has fully arrived. A
+// connection closed by the receiver or carrying anything else is marked broken.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void receive_requests( struct socket_pool* socketPool, struct socket_pool_entry* entry )
+{
+	while( !READ_ONCE( entry->broken ) )
+	{
+		struct szs_resync_request request;
+		struct kvec vec = { .iov_base = &request, .iov_len = sizeof( request ) };
+		struct msghdr msg = { .msg_flags = MSG_DONTWAIT };
+		int ret = kernel_recvmsg( entry->socket, &msg, &vec, 1, sizeof( request ), MSG_DONTWAIT | MSG_PEEK );
+		if( ret == -EAGAIN || ( ret > 0 && ret < ( int )sizeof( request ) ) )
+		{
+			return;
+		}
+
+		if( ret == ( int )sizeof( request ) )
+		{
+			memset( &msg, 0, sizeof( msg ) );
+			ret = kernel_recvmsg( entry->socket, &msg, &vec, 1, sizeof( request ), MSG_DONTWAIT );
+		}
+
+		if( ret != ( int )sizeof( request ) || request.magic != SZS_RESYNC_MAGIC )
+		{
+			LOG_ERROR( ret < 0 ? ret : -EPROTO, "Socket %ld: connection closed by the receiver or bad request.",
+				   ( long )( entry - socketPool->entries ) );
+			WRITE_ONCE( entry->broken, true );
+			return;
+		}
+
+		if( socketPool->resync != NULL )
+		{
+			socketPool->resync( request.deviceId, request.sector, request.length );
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function publishes a new connected socket in the slot right above the current size.
+// Only the pool manager (and the pool initialization, before the manager runs) may call it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void publish_socket( struct socket_pool* socketPool, struct socket* sock, uint64_t generation )
+{
+	unsigned int index = socketPool->size;
+	socketPool->entries[index].socket = sock;
+	socketPool->entries[index].lastUsed = jiffies;
+	socketPool->entries[index].mapGeneration = 0;
+	socketPool->entries[index].endpointGeneration = generation;
+	socketPool->entries[index].broken = false;
+
+	// The slot bit is still set, so the slot only becomes claimable once it is fully set up
+	smp_store_release( &socketPool->size, index + 1 );
+	clear_bit_unlock( index, socketPool->inUse );
+
+	if( wq_has_sleeper( &socketPool->waitQueue ) )
+	{
+		wake_up( &socketPool->waitQueue );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function replaces the connection of every slot marked broken. Broken slots are still
+// claimed, so they are handed out again only once reconnected. A slot whose reconnection fails
+// is retried on the next run.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void repair_broken_sockets( struct socket_pool* socketPool )
+{
+	unsigned int index = 0;
+	while( index < socketPool->size )
+	{
+		struct socket_pool_entry* entry = &socketPool->entries[index];
+		if( !READ_ONCE( entry->broken ) )
+		{
+			index++;
+			continue;
+		}
+
+		struct socket* sock = NULL;
+		uint64_t generation = 0;
+		if( create_connected_socket( socketPool, &sock, &generation ) != 0 )
+		{
+			return;
+		}
+
+		destroy_socket( entry->socket );
+		entry->socket = sock;
+		entry->lastUsed = jiffies;
+		entry->mapGeneration = 0;
+		entry->endpointGeneration = generation;
+		WRITE_ONCE( entry->broken, false );
+		clear_bit_unlock( index, socketPool->inUse );
+
+		LOG_INFO( "Socket %u reconnected.", index );
+		if( wq_has_sleeper( &socketPool->waitQueue ) )
+		{
+			wake_up( &socketPool->waitQueue );
+		}
+
+		index++;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands every free connection to a previous endpoint over to
+// repair_broken_sockets. Connections in use are handed over by put_socket.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void retarget_stale_sockets( struct socket_pool* socketPool )
+{
+	uint64_t generation = READ_ONCE( socketPool->endpointGeneration );
+	unsigned int index = 0;
+	while( index < socketPool->size )
+	{
+		struct socket_pool_entry* entry = &socketPool->entries[index];
+		if( entry->endpointGeneration != generation && !test_and_set_bit_lock( index, socketPool->inUse ) )
+		{
+			WRITE_ONCE( entry->broken, true );
+		}
+
+		index++;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reads the requests waiting on free connections, which put_socket does not
+// see while nobody sends on them.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void receive_idle_requests( struct socket_pool* socketPool )
+{
+	unsigned int index = 0;
+	while( index < socketPool->size )
+	{
+		struct socket_pool_entry* entry = &socketPool->entries[index];
+		if( has_pending_requests( entry ) && !test_and_set_bit_lock( index, socketPool->inUse ) )
+		{
+			put_socket( socketPool, entry );
+		}
+
+		index++;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function closes the socket in the topmost slot if it has been idle for longer than the
+// idle timeout. The slot is claimed first, so it cannot be handed out while it is retired.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static bool retire_idle_socket( struct socket_pool* socketPool, unsigned long idleTimeout )
+{
+	unsigned int index = socketPool->size - 1;
+	if( time_before( jiffies, READ_ONCE( socketPool->entries[index].lastUsed ) + idleTimeout ) )
+	{
+		return false;
+	}
+
+	if( test_and_set_bit_lock( index, socketPool->inUse ) )
+	{
+		return false;
+	}
+
+	smp_store_release( &socketPool->size, index );
+	destroy_socket( socketPool->entries[index].socket );
+	socketPool->entries[index].socket = NULL;
+
+	return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Pool manager. The target size is the number of busy sockets plus a few spare ones, one more
+// for every caller that found the pool exhausted since the last run and one more while the
+// capture backlog is high. Missing sockets are connected here, in process context; sockets
+// above the target are closed once idle, one per run.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void socket_pool_manager_fn( struct work_struct* work )
+{
+	struct socket_pool* socketPool = container_of( to_delayed_work( work ), struct socket_pool, manager );
+
+	unsigned int minSize = clamp_t( unsigned int, READ_ONCE( socketPoolMin ), 1, SOCKET_POOL_MAX_SOCKETS );
+	unsigned int maxSize = clamp_t( unsigned int, READ_ONCE( socketPoolMax ), minSize, SOCKET_POOL_MAX_SOCKETS );
+	WRITE_ONCE( socketPool->minSize, minSize );
+	WRITE_ONCE( socketPool->maxSize, maxSize );
+
+	receive_idle_requests( socketPool );
+	retarget_stale_sockets( socketPool );
+	repair_broken_sockets( socketPool );
+
+	unsigned int busy = bitmap_weight( socketPool->inUse, socketPool->size );
+	unsigned int target = busy + SOCKET_POOL_SPARE_SOCKETS + atomic_xchg( &socketPool->misses, 0 );
+	if( socketPool->backlog != NULL && socketPool->backlog() >= SOCKET_POOL_BACKLOG_THRESHOLD )
+	{
+		target++;
+	}
+
+	target = clamp( target, minSize, maxSize );
+
+	while( socketPool->size < target )
+	{
+		struct socket* sock = NULL;
+		uint64_t generation = 0;
+		if( create_connected_socket( socketPool, &sock, &generation ) != 0 )
+		{
+			break;
+		}
+
+		publish_socket( socketPool, sock, generation );
+		trace_szs_socket_pool_resized( socketPool->size, target );
+	}
+
+	// Sockets above a lowered maximum do not wait for the idle timeout
+	unsigned long idleTimeout = socketPool->size > maxSize ? 0 : msecs_to_jiffies( READ_ONCE( socketPoolIdleTimeoutMs ) );
+	if( socketPool->size > target && retire_idle_socket( socketPool, idleTimeout ) )
+	{
+		trace_szs_socket_pool_resized( socketPool->size, target );
+	}
+
+	queue_delayed_work( system_long_wq, &socketPool->manager, msecs_to_jiffies( SOCKET_POOL_MANAGER_INTERVAL_MS ) );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function initializes a socket pool with 'socket_pool_min' sockets connected to the
+// specified IP and port, and starts its manager.
 /////////////////////////////////////////////////////////////////////////////////////////////
 int socket_pool_init( struct socket_pool* socketPool, const char *ip, unsigned short port )
 {
@@ -65,49 +345,45 @@ int socket_pool_init( struct socket_pool* socketPool, const char *ip, unsigned s
 		return -1;
 	}
 
-	socketPool->size = SOCKET_POOL_MIN_SOCKETS;
-	socketPool->minSize = SOCKET_POOL_MIN_SOCKETS;
-	socketPool->maxSize = SOCKET_POOL_MAX_SOCKETS;
-	socketPool->socketPoolSpinlock = __SPIN_LOCK_UNLOCKED( socketPool->socketPoolSpinlock );
+	memset( socketPool, 0, sizeof( *socketPool ) );
+	socketPool->minSize = clamp_t( unsigned int, READ_ONCE( socketPoolMin ), 1, SOCKET_POOL_MAX_SOCKETS );
+	socketPool->maxSize = clamp_t( unsigned int, READ_ONCE( socketPoolMax ), socketPool->minSize, SOCKET_POOL_MAX_SOCKETS );
+	bitmap_fill( socketPool->inUse, SOCKET_POOL_MAX_SOCKETS );
+	init_waitqueue_head( &socketPool->waitQueue );
+	atomic_set( &socketPool->misses, 0 );
+	INIT_DELAYED_WORK( &socketPool->manager, socket_pool_manager_fn );
+	mutex_init( &socketPool->endpointLock );
+	socketPool->endpointGeneration = 1;
 	socketPool->port = port;
-	socketPool->ip = kmalloc( strlen( ip ), GFP_KERNEL);
+	socketPool->ip = kstrdup( ip, GFP_KERNEL );
 	if( socketPool->ip == NULL )
 	{
 		LOG_ERROR( -ENOMEM, "Failed to allocate memory for IP." );
 		return -ENOMEM;
 	}
 
-	strcpy( socketPool->ip, ip );
-
-	unsigned int index = 0;
-	while( index < socketPool->size )
+	while( socketPool->size < socketPool->minSize )
 	{
 		struct socket* sock = NULL;
-		int ret = create_socket( &sock );
+		uint64_t generation = 0;
+		int ret = create_connected_socket( socketPool, &sock, &generation );
 		if( ret != 0 )
 		{
-			LOG_ERROR( ret, "Sock[%u]: Failed to create socket.", index );
+			LOG_ERROR( ret, "Sock[%u]: Failed to set up socket.", socketPool->size );
+			socket_pool_cleanup( socketPool );
 			return ret;
 		}
 
-		ret = connect( sock, ip, port );
-		if( ret != 0 )
-		{
-			LOG_ERROR( ret, "Sock[%u]: Failed to connect socket.", index );
-			return ret;
-		}
-
-		socketPool->entries[index].socket = sock;
-		socketPool->entries[index].inUse = false;
-
-		index++;
+		publish_socket( socketPool, sock, generation );
 	}
 
+	queue_delayed_work( system_long_wq, &socketPool->manager, msecs_to_jiffies( SOCKET_POOL_MANAGER_INTERVAL_MS ) );
 	return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function cleans up and release resources associated with a socket pool.
+// This function stops the pool manager, cleans up and release resources associated with a
+// socket pool. No socket may be in use any more.
 /////////////////////////////////////////////////////////////////////////////////////////////
 void socket_pool_cleanup( struct socket_pool* socketPool )
 {
@@ -117,10 +393,14 @@ void socket_pool_cleanup( struct socket_pool* socketPool )
 		return;
 	}
 
+	cancel_delayed_work_sync( &socketPool->manager );
+
 	unsigned int index = 0;
 	while( index < socketPool->size )
 	{
+		WARN_ON( test_bit( index, socketPool->inUse ) && !socketPool->entries[index].broken );
 		destroy_socket( socketPool->entries[index].socket );
+		socketPool->entries[index].socket = NULL;
 		index++;
 	}
 
@@ -130,87 +410,96 @@ void socket_pool_cleanup( struct socket_pool* socketPool )
 	socketPool->maxSize = 0;
 
 	kfree( socketPool->ip );
+	socketPool->ip = NULL;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function is used to obtain a free socket from a given socket pool. If a free socket is
-// available in the pool, it is returned. If the pool is not full, and no free sockets are available,
-// a new socket will be created and returned.
+// This function tries to claim the socket in the given slot.
 /////////////////////////////////////////////////////////////////////////////////////////////
-struct socket* get_free_socket( struct socket_pool* socketPool )
+static inline struct socket_pool_entry* try_claim_socket( struct socket_pool* socketPool, unsigned int index )
 {
-	if( socketPool == NULL )
+	if( test_bit( index, socketPool->inUse ) || test_and_set_bit_lock( index, socketPool->inUse ) )
 	{
-		LOG_ERROR( -1, "Socket pool is NULL." );
 		return NULL;
 	}
 
-	spin_lock( &socketPool->socketPoolSpinlock );
-	struct socket* sock = NULL;
+	return &socketPool->entries[index];
+}
 
-	// Check if any free socket available in pool
-	unsigned int index = 0;
-	while( index < socketPool->size )
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function claims the preferred slot if it is free, any other free slot otherwise.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct socket_pool_entry* claim_free_socket( struct socket_pool* socketPool, unsigned int affinity )
+{
+	unsigned int size = smp_load_acquire( &socketPool->size );
+	if( size == 0 )
 	{
-		if( !socketPool->entries[index].inUse )
-		{
-			socketPool->entries[index].inUse = true;
-			sock = socketPool->entries[index].socket;
-			break;
-		}
-
-		index++;
+		return NULL;
 	}
 
-	// If no free socket availble in pool check if socket pool is full
-	if( sock == NULL && socketPool->size >= socketPool->maxSize )
+	struct socket_pool_entry* entry = try_claim_socket( socketPool, affinity % size );
+	if( entry != NULL )
 	{
-		LOG_ERROR( -1, "Socket pool is full. No more sockets can be created." );
-		spin_unlock( &socketPool->socketPoolSpinlock );
-		
-		return NULL;
+		return entry;
 	}
 
-	// If no free socket available and socket pool is not full
-	// Create and connect new socket.
-	if( sock == NULL )
+	unsigned int index;
+	for_each_clear_bit( index, socketPool->inUse, size )
 	{
-		int ret = create_socket( &sock );
-		if ( ret != 0)
+		entry = try_claim_socket( socketPool, index );
+		if( entry != NULL )
 		{
-			LOG_ERROR( ret, "Failed to create new socket." );
-			spin_unlock( &socketPool->socketPoolSpinlock );
-
-			return NULL;
+			return entry;
 		}
+	}
 
-		ret = connect( sock, socketPool->ip, socketPool->port );
-		if( ret != 0 )
-		{
-			LOG_ERROR( ret, "Failed to connect new socket." );
-			spin_unlock( &socketPool->socketPoolSpinlock );
-
-			return NULL;
-		}
+	return NULL;
+}
 
-		socketPool->entries[socketPool->size].socket = sock;
-		socketPool->entries[socketPool->size].inUse = true;
-		socketPool->size++;
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function is used to obtain a free socket from a given socket pool. The slot selected by
+// 'affinity' is tried first, so a CPU or worker keeps reusing the same connection; then any
+// other free slot. If the pool is exhausted, the manager is asked to grow it and the caller
+// waits up to SOCKET_POOL_WAIT_TIMEOUT_MS for a socket to be released or added.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct socket_pool_entry* get_free_socket( struct socket_pool* socketPool, unsigned int affinity )
+{
+	if( socketPool == NULL )
+	{
+		LOG_ERROR( -1, "Socket pool is NULL." );
+		return NULL;
+	}
 
-		LOG_DEBUG( "New socket added to socket pool, number of sockets in pool : %u", socketPool->size );
+	struct socket_pool_entry* entry = claim_free_socket( socketPool, affinity );
+	if( entry != NULL )
+	{
+		trace_szs_socket_acquired( entry - socketPool->entries, affinity, false );
+		return entry;
 	}
 
-	spin_unlock( &socketPool->socketPoolSpinlock );
+	atomic_inc( &socketPool->misses );
+	stats_add( NULL, STATS_POOL_EXHAUSTED, 1 );
+	mod_delayed_work( system_long_wq, &socketPool->manager, 0 );
+
+	if( !wait_event_timeout( socketPool->waitQueue,
+				 ( entry = claim_free_socket( socketPool, affinity ) ) != NULL,
+				 msecs_to_jiffies( SOCKET_POOL_WAIT_TIMEOUT_MS ) ) )
+	{
+		LOG_ERROR( -1, "No free socket in pool after %u ms, %u sockets in use.",
+			   SOCKET_POOL_WAIT_TIMEOUT_MS, READ_ONCE( socketPool->size ) );
+		return NULL;
+	}
 
-	return sock;
+	trace_szs_socket_acquired( entry - socketPool->entries, affinity, true );
+	return entry;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function is used to release a socket back to a given socket pool. It marks the specified
-// socket as available for reuse by setting the 'inUse' flag to false within the socket pool's
-// entries
+// This function is used to release a socket back to a given socket pool. It reads the requests
+// the receiver sent on it, marks the slot as available for reuse and wakes up a caller waiting
+// for one. A broken socket is handed to the manager instead. It may sleep.
 /////////////////////////////////////////////////////////////////////////////////////////////
-void put_socket( struct socket_pool* socketPool, struct socket* sock )
+void put_socket( struct socket_pool* socketPool, struct socket_pool_entry* entry )
 {
 	if( socketPool == NULL )
 	{
@@ -218,23 +507,92 @@ void put_socket( struct socket_pool* socketPool, struct socket* sock )
 		return;
 	}
 
-	if( sock == NULL )
+	if( entry == NULL )
 	{
 		LOG_ERROR( -1, "Socket is NULL." );
 		return;
 	}
 
-	unsigned int index = 0;
-	while( index < socketPool->size )
+	unsigned int index = entry - socketPool->entries;
+	if( WARN_ON( index >= SOCKET_POOL_MAX_SOCKETS ) )
 	{
-		if( socketPool->entries[index].socket == sock )
-		{
-			socketPool->entries[index].inUse = false;
-			break;
-		}
+		return;
+	}
 
-		index++;
+	if( !READ_ONCE( entry->broken ) && has_pending_requests( entry ) )
+	{
+		receive_requests( socketPool, entry );
+	}
+
+	// A connection to a previous endpoint is replaced like a broken one
+	if( entry->endpointGeneration != READ_ONCE( socketPool->endpointGeneration ) )
+	{
+		WRITE_ONCE( entry->broken, true );
 	}
+
+	WRITE_ONCE( entry->lastUsed, jiffies );
+	trace_szs_socket_released( index, READ_ONCE( entry->broken ) );
+	if( READ_ONCE( entry->broken ) )
+	{
+		mod_delayed_work( system_long_wq, &socketPool->manager, 0 );
+		return;
+	}
+
+	clear_bit_unlock( index, socketPool->inUse );
+
+	if( wq_has_sleeper( &socketPool->waitQueue ) )
+	{
+		wake_up( &socketPool->waitQueue );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function points the pool to a new endpoint. Existing connections keep carrying the
+// records they were given; the manager replaces them as they are released. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int socket_pool_set_endpoint( struct socket_pool* socketPool, const char* ip, unsigned short port )
+{
+	char* newIp = kstrdup( ip, GFP_KERNEL );
+	if( newIp == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for IP." );
+		return -ENOMEM;
+	}
+
+	mutex_lock( &socketPool->endpointLock );
+	char* oldIp = socketPool->ip;
+	socketPool->ip = newIp;
+	socketPool->port = port;
+	WRITE_ONCE( socketPool->endpointGeneration, socketPool->endpointGeneration + 1 );
+	mutex_unlock( &socketPool->endpointLock );
+
+	kfree( oldIp );
+
+	LOG_INFO( "Socket pool endpoint set to %s:%u.", ip, port );
+	mod_delayed_work( system_long_wq, &socketPool->manager, 0 );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets the bounds of the pool size, which the caller has validated. The
+// manager of 'socketPool', if there is one yet, applies them right away.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void socket_pool_set_limits( struct socket_pool* socketPool, unsigned int minSize, unsigned int maxSize )
+{
+	WRITE_ONCE( socketPoolMin, minSize );
+	WRITE_ONCE( socketPoolMax, maxSize );
+
+	if( socketPool != NULL )
+	{
+		mod_delayed_work( system_long_wq, &socketPool->manager, 0 );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void socket_pool_get_limits( unsigned int* minSize, unsigned int* maxSize )
+{
+	*minSize = READ_ONCE( socketPoolMin );
+	*maxSize = READ_ONCE( socketPoolMax );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
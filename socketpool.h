@@ -14,32 +14,70 @@
 // #include <includes.h>
 #include <linux/net.h>
 #include <linux/inet.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <constants.h>
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 struct socket_pool_entry
 {
 	struct socket* socket;
-	bool inUse;
+	unsigned long lastUsed;       // jiffies of the last release
+	uint64_t mapGeneration;       // Device map sent on this connection, 0 = nothing sent yet
+	uint64_t endpointGeneration;  // Endpoint the connection was made to
+	bool broken;                  // A send failed, the manager reconnects the slot
 };
 
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Sockets are claimed and released by flipping their bit in 'inUse' with atomic bitops, so
+// the send path never takes a lock. Each caller passes an affinity hint (a CPU or worker
+// number) that selects its preferred slot; other free slots are only scanned when that one is
+// busy. Slots at or above 'size' keep their bit set, so they can never be claimed.
+//
+// The send path never connects. The pool manager, a delayed work item, is the only one that
+// changes 'size': it keeps spare connections ready according to utilization, misses and the
+// capture backlog, and closes sockets that stayed idle for too long. A caller that finds no
+// free socket kicks the manager and waits a bounded time for one.
+//
+// Sends time out after SOCKET_SEND_TIMEOUT_MS. A caller whose send failed marks the entry
+// broken before releasing it; the slot then stays claimed until the manager has replaced its
+// connection, since the stream may have been cut in the middle of a record.
+//
+// The endpoint may change while sockets are in use. Connections to the previous endpoint are
+// treated like broken ones once released, so a caller always finishes its batch on the
+// connection it started it on.
+//
+// Receivers send resync requests back on the connections. They are read by whoever holds the
+// slot: put_socket before releasing it, the manager for slots that stay free.
 /////////////////////////////////////////////////////////////////////////////////////////////
 struct socket_pool
 {
 	struct socket_pool_entry entries[SOCKET_POOL_MAX_SOCKETS];
+	DECLARE_BITMAP( inUse, SOCKET_POOL_MAX_SOCKETS );
 	unsigned int size;
 	unsigned int minSize;
 	unsigned int maxSize;
+	struct mutex endpointLock;    // Protects 'ip' and 'port'
 	char* ip;
 	unsigned short port;
-	spinlock_t socketPoolSpinlock;
+	uint64_t endpointGeneration;
+	wait_queue_head_t waitQueue;
+	atomic_t misses;
+	struct delayed_work manager;
+	unsigned int (*backlog)( void );  // Number of records waiting to be sent, may be NULL
+	int (*resync)( uint32_t deviceId, sector_t sector, uint64_t size );  // Range a receiver asks for again, may be NULL
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 int socket_pool_init( struct socket_pool* socketPool, const char* ip, unsigned short port );
 void socket_pool_cleanup( struct socket_pool* socketPool );
-struct socket* get_free_socket( struct socket_pool* socketPool );
-void put_socket( struct socket_pool* socketPool, struct socket* sock );
+struct socket_pool_entry* get_free_socket( struct socket_pool* socketPool, unsigned int affinity );
+void put_socket( struct socket_pool* socketPool, struct socket_pool_entry* entry );
+int socket_pool_set_endpoint( struct socket_pool* socketPool, const char* ip, unsigned short port );
+void socket_pool_set_limits( struct socket_pool* socketPool, unsigned int minSize, unsigned int maxSize );
+void socket_pool_get_limits( unsigned int* minSize, unsigned int* maxSize );
 
 #endif // SZS_TRACKER_SOCKETPOOL_H
 
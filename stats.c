@@ -0,0 +1,272 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <stats.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+
+#include <logging.h>
+#include <constants.h>
+#include <capture_queue.h>
+#include <transport.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+DEFINE_PER_CPU( struct stats_counters, globalCounters );
+
+static struct kobject* statsRoot = NULL;
+static struct kset* devicesKset = NULL;
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Counters are summed over all CPUs when read, without locking. Each per-CPU value only grows,
+// so a sum may miss concurrent increments but never goes backwards between reads.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static u64 sum_counter( struct stats_counters __percpu* counters, enum stats_counter counter )
+{
+	u64 sum = 0;
+	unsigned int cpu;
+	for_each_possible_cpu( cpu )
+	{
+		sum += READ_ONCE( per_cpu_ptr( counters, cpu )->values[counter] );
+	}
+
+	return sum;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct counter_attribute
+{
+	struct kobj_attribute attr;
+	enum stats_counter counter;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The same attributes serve the global directory and the device directories; the kobject
+// tells which counters to read.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t counter_show( struct kobject* kobj, struct kobj_attribute* attr, char* buf )
+{
+	struct counter_attribute* counterAttr = container_of( attr, struct counter_attribute, attr );
+	struct stats_counters __percpu* counters = &globalCounters;
+	if( kobj != statsRoot )
+	{
+		counters = container_of( kobj, struct device_stats, kobj )->counters;
+	}
+
+	return sysfs_emit( buf, "%llu\n", sum_counter( counters, counterAttr->counter ) );
+}
+
+#define COUNTER_ATTR( _name, _counter )						\
+	static struct counter_attribute counter_attr_##_name =			\
+	{									\
+		.attr = __ATTR( _name, 0444, counter_show, NULL ),		\
+		.counter = _counter						\
+	}
+
+COUNTER_ATTR( bios_seen, STATS_BIOS_SEEN );
+COUNTER_ATTR( bios_tracked, STATS_BIOS_TRACKED );
+COUNTER_ATTR( bytes_captured, STATS_BYTES_CAPTURED );
+COUNTER_ATTR( bytes_sent, STATS_BYTES_SENT );
+COUNTER_ATTR( records_dropped, STATS_RECORDS_DROPPED );
+COUNTER_ATTR( send_errors, STATS_SEND_ERRORS );
+COUNTER_ATTR( bytes_absorbed, STATS_BYTES_ABSORBED );
+COUNTER_ATTR( bytes_deduplicated, STATS_BYTES_DEDUPLICATED );
+COUNTER_ATTR( pool_exhausted, STATS_POOL_EXHAUSTED );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t queue_depth_show( struct kobject* kobj, struct kobj_attribute* attr, char* buf )
+{
+	return sysfs_emit( buf, "%u\n", capture_queue_backlog() );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t sockets_show( struct kobject* kobj, struct kobj_attribute* attr, char* buf )
+{
+	return sysfs_emit( buf, "%u\n", transport_socket_count() );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static ssize_t device_id_show( struct kobject* kobj, struct kobj_attribute* attr, char* buf )
+{
+	return sysfs_emit( buf, "%u\n", container_of( kobj, struct device_stats, kobj )->deviceId );
+}
+
+static struct kobj_attribute queueDepthAttr = __ATTR_RO( queue_depth );
+static struct kobj_attribute socketsAttr = __ATTR_RO( sockets );
+static struct kobj_attribute deviceIdAttr = __ATTR_RO( device_id );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct attribute* globalAttrs[] =
+{
+	&counter_attr_bios_seen.attr.attr,
+	&counter_attr_bios_tracked.attr.attr,
+	&counter_attr_bytes_captured.attr.attr,
+	&counter_attr_bytes_sent.attr.attr,
+	&counter_attr_records_dropped.attr.attr,
+	&counter_attr_send_errors.attr.attr,
+	&counter_attr_bytes_absorbed.attr.attr,
+	&counter_attr_bytes_deduplicated.attr.attr,
+	&counter_attr_pool_exhausted.attr.attr,
+	&queueDepthAttr.attr,
+	&socketsAttr.attr,
+	NULL
+};
+
+static const struct attribute_group globalGroup =
+{
+	.attrs = globalAttrs
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct attribute* deviceAttrs[] =
+{
+	&counter_attr_bios_seen.attr.attr,
+	&counter_attr_bios_tracked.attr.attr,
+	&counter_attr_bytes_captured.attr.attr,
+	&counter_attr_bytes_sent.attr.attr,
+	&counter_attr_records_dropped.attr.attr,
+	&counter_attr_send_errors.attr.attr,
+	&counter_attr_bytes_absorbed.attr.attr,
+	&counter_attr_bytes_deduplicated.attr.attr,
+	&deviceIdAttr.attr,
+	NULL
+};
+
+static const struct attribute_group deviceGroup =
+{
+	.attrs = deviceAttrs
+};
+
+static const struct attribute_group* deviceGroups[] =
+{
+	&deviceGroup,
+	NULL
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void device_stats_release( struct kobject* kobj )
+{
+	struct device_stats* stats = container_of( kobj, struct device_stats, kobj );
+
+	free_percpu( stats->counters );
+	kfree( stats );
+}
+
+static struct kobj_type deviceStatsType =
+{
+	.release = device_stats_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_groups = deviceGroups
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the counters of a tracked device and its sysfs directory, named after
+// the block device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct device_stats* device_stats_create( struct block_device* blockDevice, uint32_t deviceId )
+{
+	struct device_stats* stats = kzalloc( sizeof( *stats ), GFP_KERNEL );
+	if( stats == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device counters." );
+		return NULL;
+	}
+
+	stats->deviceId = deviceId;
+	stats->counters = alloc_percpu( struct stats_counters );
+	if( stats->counters == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device counters." );
+		kfree( stats );
+		return NULL;
+	}
+
+	stats->kobj.kset = devicesKset;
+	int ret = kobject_init_and_add( &stats->kobj, &deviceStatsType, NULL, "%pg", blockDevice );
+	if( ret )
+	{
+		LOG_ERROR( ret, "Failed to add device counters to sysfs." );
+		kobject_put( &stats->kobj );
+		return NULL;
+	}
+
+	kobject_uevent( &stats->kobj, KOBJ_ADD );
+	return stats;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function removes the sysfs directory of a device and drops the reference taken at
+// creation. Records still in flight keep the counters alive.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void device_stats_remove( struct device_stats* stats )
+{
+	if( stats == NULL )
+	{
+		return;
+	}
+
+	kobject_del( &stats->kobj );
+	kobject_put( &stats->kobj );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates /sys/kernel/szs_tracker with the global counters and the directory
+// that holds the device counters.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int stats_init( void )
+{
+	statsRoot = kobject_create_and_add( SZS_TRACKER_SYSFS_NAME, kernel_kobj );
+	if( statsRoot == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to create sysfs directory." );
+		return -ENOMEM;
+	}
+
+	int ret = sysfs_create_group( statsRoot, &globalGroup );
+	if( ret )
+	{
+		LOG_ERROR( ret, "Failed to create global counters in sysfs." );
+		stats_cleanup();
+		return ret;
+	}
+
+	devicesKset = kset_create_and_add( "devices", NULL, statsRoot );
+	if( devicesKset == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to create sysfs device directory." );
+		stats_cleanup();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function removes the sysfs directories. All devices must have been removed.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void stats_cleanup( void )
+{
+	if( devicesKset != NULL )
+	{
+		kset_unregister( devicesKset );
+		devicesKset = NULL;
+	}
+
+	if( statsRoot != NULL )
+	{
+		kobject_put( statsRoot );
+		statsRoot = NULL;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
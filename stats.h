@@ -0,0 +1,103 @@
+#ifndef SZS_TRACKER_STATS_H
+#define SZS_TRACKER_STATS_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/blkdev.h>
+#include <linux/kobject.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Counters exported under /sys/kernel/szs_tracker. Every counter exists once per tracked
+// device and once globally; the global value also includes devices that are gone and work
+// that belongs to no device, such as resent ranges. Counters after STATS_NR_DEVICE_COUNTERS
+// are global only.
+/////////////////////////////////////////////////////////////////////////////////////////////
+enum stats_counter
+{
+	STATS_BIOS_SEEN,              // Write bios seen by the submission hook
+	STATS_BIOS_TRACKED,           // Bios whose change was sent, queued or marked in the CBT
+	STATS_BYTES_CAPTURED,         // Payload bytes put into change records
+	STATS_BYTES_SENT,             // Bytes handed to the transport, headers included
+	STATS_RECORDS_DROPPED,        // Changes not delivered, left to the overflow tracker
+	STATS_SEND_ERRORS,            // Records the transport failed to deliver
+	STATS_BYTES_ABSORBED,         // Payload bytes overwritten within the absorption window
+	STATS_BYTES_DEDUPLICATED,     // Payload bytes replaced by a reference to identical data
+	STATS_NR_DEVICE_COUNTERS,
+	STATS_POOL_EXHAUSTED = STATS_NR_DEVICE_COUNTERS, // Callers that found no free socket
+	STATS_NR_COUNTERS
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct stats_counters
+{
+	u64 values[STATS_NR_COUNTERS];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// The counters of one device, exported as /sys/kernel/szs_tracker/devices/<name>. Change
+// records hold a reference, so the counters outlive the device until its last record is sent.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct device_stats
+{
+	struct kobject kobj;
+	struct stats_counters __percpu *counters;
+	uint32_t deviceId;
+};
+
+DECLARE_PER_CPU( struct stats_counters, globalCounters );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int stats_init( void );
+void stats_cleanup( void );
+struct device_stats* device_stats_create( struct block_device* blockDevice, uint32_t deviceId );
+void device_stats_remove( struct device_stats* stats );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function adds to a counter of the local CPU. It is safe in any context and never
+// takes a lock. 'stats' may be NULL for work that belongs to no device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void stats_add( struct device_stats* stats, enum stats_counter counter, u64 value )
+{
+	this_cpu_add( globalCounters.values[counter], value );
+	if( stats != NULL )
+	{
+		this_cpu_add( stats->counters->values[counter], value );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline struct device_stats* device_stats_get( struct device_stats* stats )
+{
+	if( stats != NULL )
+	{
+		kobject_get( &stats->kobj );
+	}
+
+	return stats;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void device_stats_put( struct device_stats* stats )
+{
+	if( stats != NULL )
+	{
+		kobject_put( &stats->kobj );
+	}
+}
+
+#endif // SZS_TRACKER_STATS_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
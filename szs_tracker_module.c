@@ -12,16 +12,37 @@
 #include <linux/blkdev.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
-#include <linux/version.h>
 #include <linux/ftrace.h>
 #include <linux/time.h>
 #include <linux/net.h>
 #include <linux/inet.h>
-
+#include <linux/log2.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/srcu.h>
+#include <linux/jump_label.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/wait_bit.h>
+
+#include <kernel_compat.h>
 #include <logging.h>
 #include <constants.h>
-#include <socketpool.h>
 #include <ioctl_handler.h>
+#include <transport.h>
+#include <change_record.h>
+#include <capture_queue.h>
+#include <cbt_bitmap.h>
+#include <compression.h>
+#include <device_map.h>
+#include <overflow.h>
+#include <absorption.h>
+#include <dedup.h>
+#include <stats.h>
+#include <latency.h>
+
+#define CREATE_TRACE_POINTS
+#include <szs_tracker_trace.h>
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Basic Information
@@ -31,50 +52,26 @@ MODULE_AUTHOR      ( SZS_TRACKER_AUTHOR       );
 MODULE_DESCRIPTION ( SZS_TRACKER_DESCRIPTION  );
 MODULE_VERSION     ( SZS_TRACKER_VERSION      );
 
-/////////////////////////////////////////////////////////////////////////////////////////////
-// Directives based on kernel versions
-/////////////////////////////////////////////////////////////////////////////////////////////
-#ifdef LINUX_VERSION_CODE
-
-// From kernel version 5.9, make_request_fn is removed from request_queue
-// Thus the interception happens differently from this version 
-// https://lore.kernel.org/lkml/20200629193947.2705954-17-hch@lst.de/
-#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 9, 0 )
-    #define KERNEL_VERSION_5_9_OR_NEWER 
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 12, 0 )
-    #define USE_BI_BDEV
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION( 6, 2, 0 )
-    #define USE_SET_INSTRUCTION_POINTER
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION( 5, 11, 0 )
-    #define HAS_FTRACE_REGS
-#endif
-
-#else
-#error "LINUX_VERSION_CODE is not defined."
-#endif
-
-/////////////////////////////////////////////////////////////////////////////////////////////
-#pragma pack(push, 1)
-struct block_device_change_metadata
-{
-	char deviceName[BLOCK_DEVICE_NAME_LEN];  //32 Bytes
-	struct timespec64 timestamp;             //16 Bytes
-	uint64_t startingSector;                 // 8 Bytes
-	uint64_t dataSize;                       // 8 Bytes
-};
-#pragma pack(pop)
-
 /////////////////////////////////////////////////////////////////////////////////////////////
 struct block_device_node
 {
 	struct block_device *blockDevice;
-	struct list_head list;
+	struct hlist_node hash;
+	void *key;
+	uint32_t deviceId;
+	atomic64_t sequence;          // Last sequence number handed out
+	unsigned int mode;
+	struct cbt_bitmap __rcu *cbt;
+	bool compress;
+	unsigned int compressMinSize;
+	struct overflow_tracker *overflow;
+	struct device_stats *stats;
+	struct absorption_window *absorption;
+	struct dedup_cache *dedup;
+	atomic_t inflightCompletions; // Writes whose completion is chained to capture_on_completion
+	spinlock_t completedLock;
+	struct list_head completedWrites; // Completed writes waiting for completionWork, in completion order
+	struct work_struct completionWork;
 
 	#ifndef KERNEL_VERSION_5_9_OR_NEWER
 	blk_qc_t (*original_make_request_fn)( struct request_queue*, struct bio* );
@@ -93,184 +90,426 @@ static struct miscdevice trackerControlDevice =
 	.name = SZS_TRACKER_CONTROL_DEVICE_NAME,
 	.fops = &trackerControlFops
 };
+static bool controlDeviceRegistered = false;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-static struct socket_pool socketPool;
-static struct list_head deviceList;
-bool socketPoolInitialized = false;
-unsigned short port = 1234; //TO DO: Add a way to customize socket port, min/max socket config 
+// Tracked devices are kept in a hash table keyed by the object bios point at. The submission
+// hook looks devices up inside an SRCU read section, so it never takes a lock and may sleep
+// while it sends; registration, mode changes and removal are serialized by deviceTableMutex
+// and wait for the readers before freeing anything.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static DEFINE_HASHTABLE( deviceTable, DEVICE_TABLE_BITS );
+static DEFINE_MUTEX( deviceTableMutex );
+static struct srcu_struct deviceTableSrcu;
+static unsigned int trackedDeviceCount = 0;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function adds the given block device to the tracked device list.
-// Note: For kernel version < 5.9.0, the original make_request_fn function of the block device
-// will be stored in block_device_node struct 
+// The interception hook is only armed while at least one device is tracked. When it is not,
+// the ftrace handler returns through a patched-out branch and bios reach submit_bio_noacct
+// untouched.
 /////////////////////////////////////////////////////////////////////////////////////////////
-#ifdef KERNEL_VERSION_5_9_OR_NEWER
-static int add_block_device_to_devicelist( struct block_device *blockDevice )
-#else
-static int add_block_device_to_devicelist( struct block_device *blockDevice, blk_qc_t (*original_make_request_fn)( struct request_queue*, struct bio* ) )
-#endif
+static DEFINE_STATIC_KEY_FALSE( trackingActive );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// In TRACKING_MODE_COMPLETION the hook saves what it needs to restore the completion of a
+// write and points the bio at capture_on_completion. The submitted range is saved as well,
+// since the driver advances the iterator of the bio as it completes. The completion only
+// queues the bio for the completion work of its device, which copies it in process context.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct completion_capture
+{
+	struct block_device_node *node;
+	bio_end_io_t *originalEndIo;
+	void *originalPrivate;
+	struct bvec_iter iter;
+	struct bio *bio;
+	struct list_head list;
+};
+
+static struct kmem_cache *completionCaptureCache = NULL;
+static struct workqueue_struct *completionWorkqueue = NULL;
+
+static void capture_completed_writes( struct work_struct* work );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Bios refer to the block device from kernel 5.12, to the gendisk before that.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void* block_device_key( struct block_device *blockDevice )
+{
+	#ifdef USE_BI_BDEV
+	return blockDevice;
+	#else
+	// Assuming that there will be no partitions for the disk
+	// Note: This assumption can be removed by making use of
+	// block device minor number
+	return blockDevice->bd_disk;
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline void* bio_device_key( struct bio *bio )
+{
+	#ifdef USE_BI_BDEV
+	return bio->bi_bdev;
+	#else
+	return bio->bi_disk;
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function looks up the tracked device node for the given key. The caller must either be
+// inside a deviceTableSrcu read section or hold deviceTableMutex.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct block_device_node* lookup_block_device_node( void *key )
 {
-	struct block_device_node *node = NULL, *temp = NULL;
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+	struct block_device_node *node = NULL;
+	hash_for_each_possible_rcu( deviceTable, node, hash, ( unsigned long )key )
 	{
-		if( node->blockDevice == blockDevice )
+		if( node->key == key )
 		{
-			LOG_ERROR( -1, "Block device is already being tracked." );
-			return -1;
+			return node;
 		}
 	}
 
-	struct block_device_node *newNode = kmalloc( sizeof( *newNode ), GFP_KERNEL );
+	return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function adds the given block device to the tracked device table.
+// Note: For kernel version < 5.9.0, the original make_request_fn function of the block device
+// will be stored in block_device_node struct 
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#ifdef KERNEL_VERSION_5_9_OR_NEWER
+static int add_block_device_to_device_table( struct block_device *blockDevice )
+#else
+static int add_block_device_to_device_table( struct block_device *blockDevice, blk_qc_t (*original_make_request_fn)( struct request_queue*, struct bio* ) )
+#endif
+{
+	struct block_device_node *newNode = kzalloc( sizeof( *newNode ), GFP_KERNEL );
 	if( !newNode )
 	{
 		LOG_ERROR( -ENOMEM, "Failed to allocate memory for block device node." );
 		return -ENOMEM;
 	}
 
+	int ret = device_map_add( blockDevice->bd_disk->disk_name, &newNode->deviceId );
+	if( ret )
+	{
+		kfree( newNode );
+		return ret;
+	}
+
 	newNode->blockDevice = blockDevice;
+	newNode->key = block_device_key( blockDevice );
+	atomic64_set( &newNode->sequence, 0 );
+	atomic_set( &newNode->inflightCompletions, 0 );
+	spin_lock_init( &newNode->completedLock );
+	INIT_LIST_HEAD( &newNode->completedWrites );
+	INIT_WORK( &newNode->completionWork, capture_completed_writes );
+	newNode->mode = TRACKING_MODE_SYNC;
+	newNode->compress = false;
+	newNode->compressMinSize = COMPRESS_DEFAULT_MIN_SIZE;
+	RCU_INIT_POINTER( newNode->cbt, NULL );
+
+	newNode->overflow = overflow_create( blockDevice, newNode->deviceId, &newNode->sequence );
+	if( newNode->overflow == NULL )
+	{
+		device_map_remove( newNode->deviceId );
+		kfree( newNode );
+		return -ENOMEM;
+	}
+
+	newNode->stats = device_stats_create( blockDevice, newNode->deviceId );
+	if( newNode->stats == NULL )
+	{
+		overflow_destroy( newNode->overflow );
+		device_map_remove( newNode->deviceId );
+		kfree( newNode );
+		return -ENOMEM;
+	}
+
+	newNode->absorption = absorption_create( newNode->deviceId, &newNode->sequence, newNode->overflow, newNode->stats );
+	if( newNode->absorption == NULL )
+	{
+		device_stats_remove( newNode->stats );
+		overflow_destroy( newNode->overflow );
+		device_map_remove( newNode->deviceId );
+		kfree( newNode );
+		return -ENOMEM;
+	}
+
+	newNode->dedup = dedup_create();
+	if( newNode->dedup == NULL )
+	{
+		absorption_destroy( newNode->absorption );
+		device_stats_remove( newNode->stats );
+		overflow_destroy( newNode->overflow );
+		device_map_remove( newNode->deviceId );
+		kfree( newNode );
+		return -ENOMEM;
+	}
 
 	#ifndef KERNEL_VERSION_5_9_OR_NEWER
 	newNode->original_make_request_fn = original_make_request_fn;
 	#endif
 
-	list_add( &newNode->list, &deviceList );
+	hash_add_rcu( deviceTable, &newNode->hash, ( unsigned long )newNode->key );
 
 	return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function removes the given block device from the tracked device list
+// This function frees a node that has left the tracked device table, once every hook that may
+// have found it has returned, and releases its reference on the block device.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void destroy_block_device_node( struct block_device_node *node )
+{
+	// Writes chained to the node before it left the table still capture on completion
+	wait_var_event( &node->inflightCompletions, atomic_read( &node->inflightCompletions ) == 0 );
+	flush_work( &node->completionWork );
+
+	// Pending records are queued, they may still be dropped to the overflow tracker
+	absorption_destroy( node->absorption );
+	dedup_destroy( node->dedup );
+
+	// A resync pass may be reading from the device
+	overflow_destroy( node->overflow );
+
+	#ifdef KERNEL_VERSION_5_9_OR_NEWER
+	blkdev_put( node->blockDevice, FMODE_READ );
+	#endif
+
+	cbt_bitmap_destroy( rcu_dereference_protected( node->cbt, lockdep_is_held( &deviceTableMutex ) ) );
+	device_stats_remove( node->stats );
+	device_map_remove( node->deviceId );
+	kfree( node );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function gives up on delivering the change of a BIO: its range is left to the overflow
+// tracker of the device.
 /////////////////////////////////////////////////////////////////////////////////////////////
-static void remove_block_device_from_devicelist( struct block_device *blockDevice )
+static void drop_bio( struct block_device_node* node, struct bio* bio, enum szs_drop_reason reason )
 {
-	struct block_device_node *node = NULL, *temp = NULL;
+	stats_add( node->stats, STATS_RECORDS_DROPPED, 1 );
+	trace_szs_record_dropped( node->deviceId, bio->bi_iter.bi_sector, bio->bi_iter.bi_size, reason );
+	overflow_mark( node->overflow, bio->bi_iter.bi_sector, bio->bi_iter.bi_size );
+}
 
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies the data of a BIO into a change record and hands it to the absorption
+// window of the device, which numbers it and queues it for the capture workers. A payload the
+// device captured recently is replaced by a reference first. Compression,
+// when enabled on the device, is left to the workers. When the change cannot be captured or
+// queued, its range is left to the overflow tracker. It never sleeps if 'gfpMask' does not
+// allow it to.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void enqueue_bio( struct block_device_node* node, struct bio* bio, gfp_t gfpMask )
+{
+	struct change_record* record = capture_change_record( bio, node->deviceId, 0, gfpMask );
+	if( record == NULL )
 	{
-		if( node->blockDevice == blockDevice )
+		if( printk_ratelimit() )
 		{
-			#ifdef KERNEL_VERSION_5_9_OR_NEWER
-			blkdev_put( blockDevice, FMODE_READ );
-			#endif
-
-			list_del( &node->list );
-			kfree( node );
-			
-			return;
+			LOG_WARN( "Failed to capture block change, range marked for resync." );
 		}
+
+		drop_bio( node, bio, DROP_CAPTURE_FAILED );
+		return;
 	}
 
-	LOG_WARN( "Didn't found block device for removal" );
-	return;
+	stats_add( node->stats, STATS_BYTES_CAPTURED, record->header->payloadLength );
+	trace_szs_bio_captured( record->header, record->header->payloadLength );
+	record->stats = device_stats_get( node->stats );
+	record->compress = READ_ONCE( node->compress ) && bio->bi_iter.bi_size >= READ_ONCE( node->compressMinSize );
+	dedup_change_record( node->dedup, record );
+
+	absorption_add( node->absorption, record );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function writes data to a specified socket.
+// This function captures the writes of a device that completed in TRACKING_MODE_COMPLETION,
+// in the order they completed, so that the stream follows the order in which writes reached
+// the disk. A successful write is captured from its saved range. The original completion is
+// restored and called afterwards, the pages of the bio belong to the submitter again after
+// that.
 /////////////////////////////////////////////////////////////////////////////////////////////
-static int write_to_socket( char *data, size_t len, struct socket* socket )
+static void capture_completed_writes( struct work_struct* work )
 {
-	struct msghdr msg;
-	struct kvec vec;
-	int result, written = 0;
+	struct block_device_node* node = container_of( work, struct block_device_node, completionWork );
+	LIST_HEAD( completed );
 
-	memset( &msg, 0, sizeof( struct msghdr ) );
-	memset( &vec, 0, sizeof( struct kvec ) );
+	spin_lock_irq( &node->completedLock );
+	list_splice_init( &node->completedWrites, &completed );
+	spin_unlock_irq( &node->completedLock );
 
-repeat_send:
-	vec.iov_base = ( void * )data + written;
-	vec.iov_len = len;
-	result = kernel_sendmsg( socket, &msg, &vec, 1, len );
-    
-	if( result < 0 )
+	struct completion_capture *capture, *next;
+	list_for_each_entry_safe( capture, next, &completed, list )
 	{
-		// Fatal error, tracking should stop here
-		LOG_ERROR( result, "Failed to write data to socket." );
-		return result;
-	}
-	else
-	{
-		written = written + result;
-		len = len - result;
-		if( len )
+		struct bio* bio = capture->bio;
+		bio->bi_end_io = capture->originalEndIo;
+		bio->bi_private = capture->originalPrivate;
+
+		if( bio->bi_status == BLK_STS_OK )
+		{
+			struct bvec_iter completedIter = bio->bi_iter;
+			bio->bi_iter = capture->iter;
+			enqueue_bio( node, bio, GFP_NOIO | __GFP_NOWARN );
+			bio->bi_iter = completedIter;
+		}
+
+		kmem_cache_free( completionCaptureCache, capture );
+
+		if( bio->bi_end_io != NULL )
 		{
-			LOG_DEBUG( "Partially sent, sending remaining data ..." );
-			goto repeat_send;
+			bio->bi_end_io( bio );
 		}
+
+		// The node may go away once the last chained write is accounted for
+		if( atomic_dec_and_test( &node->inflightCompletions ) )
+		{
+			wake_up_var( &node->inflightCompletions );
+		}
+
+		cond_resched();
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Completion handler of the writes chained in TRACKING_MODE_COMPLETION. It may run in
+// interrupt context, so it only takes the place of the write in the completion order of its
+// device and leaves the copy to capture_completed_writes.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void capture_on_completion( struct bio* bio )
+{
+	struct completion_capture* capture = bio->bi_private;
+	struct block_device_node* node = capture->node;
+	capture->bio = bio;
+
+	unsigned long flags;
+	spin_lock_irqsave( &node->completedLock, flags );
+	list_add_tail( &capture->list, &node->completedWrites );
+	spin_unlock_irqrestore( &node->completedLock, flags );
+
+	queue_work( completionWorkqueue, &node->completionWork );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function chains the completion of a write to capture_on_completion. A bio that gets
+// split is submitted again with the remainder of its range; it is already chained with the
+// whole range, so it is left alone.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int chain_bio_completion( struct block_device_node* node, struct bio* bio )
+{
+	if( bio->bi_end_io == capture_on_completion )
+	{
+		return 0;
+	}
+
+	struct completion_capture* capture = kmem_cache_alloc( completionCaptureCache, GFP_NOIO | __GFP_NOWARN );
+	if( capture == NULL )
+	{
+		return -ENOMEM;
 	}
 
+	capture->node = node;
+	capture->originalEndIo = bio->bi_end_io;
+	capture->originalPrivate = bio->bi_private;
+	capture->iter = bio->bi_iter;
+
+	atomic_inc( &node->inflightCompletions );
+	bio->bi_end_io = capture_on_completion;
+	bio->bi_private = capture;
+
 	return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function populates a struct 'block_device_change_metadata' with information extracted
-// from a BIO.
+// This function finds the node of a device by its identifier.
+// Must be called within a deviceTableSrcu read side critical section.
 /////////////////////////////////////////////////////////////////////////////////////////////
+static struct block_device_node* lookup_block_device_node_by_id( uint32_t deviceId )
+{
+	struct block_device_node *node = NULL;
+	unsigned int bucket;
+	hash_for_each_rcu( deviceTable, bucket, node, hash )
+	{
+		if( node->deviceId == deviceId )
+		{
+			return node;
+		}
+	}
+
+	return NULL;
+}
 
-static void populate_block_device_change_metadata( struct bio* bio, struct block_device_change_metadata* blockDeviceChangeMetadata )
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands a change that a capture worker failed to deliver to the overflow tracker
+// of its device. The device may have been removed in the meantime.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void mark_device_overflow( uint32_t deviceId, sector_t sector, uint64_t size )
 {
-	blockDeviceChangeMetadata->startingSector  = bio->bi_iter.bi_sector;
-	blockDeviceChangeMetadata->dataSize        = bio_sectors( bio )* BIO_SECTOR_SIZE;
-	ktime_get_real_ts64( &blockDeviceChangeMetadata->timestamp );
-	
-	#ifdef USE_BI_BDEV
-	strcpy( blockDeviceChangeMetadata->deviceName, bio->bi_bdev->bd_disk->disk_name );
-	#else
-	strcpy( blockDeviceChangeMetadata->deviceName, bio->bi_disk->disk_name );
-	#endif
+	int srcuIndex = srcu_read_lock( &deviceTableSrcu );
+
+	struct block_device_node *node = lookup_block_device_node_by_id( deviceId );
+	if( node != NULL )
+	{
+		overflow_mark( node->overflow, sector, size );
+	}
+
+	srcu_read_unlock( &deviceTableSrcu, srcuIndex );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function writes actual block change data from a BIO to a specified socket.
-// It iterates through bio segments, maps the page where block data exists, copies the
-// data and unmaps the page. The copied data is then written to the specified socket.
+// This function asks for a range of a device to be sent again, as a receiver does when it
+// cannot resolve a deduplication reference. The range is left to the overflow tracker, which
+// reads it back from the device.
 /////////////////////////////////////////////////////////////////////////////////////////////
-static void write_actual_block_change_to_socket( struct bio* bio, struct socket* socket )
+int resync_device_range( uint32_t deviceId, sector_t sector, uint64_t size )
 {
-	struct bio_vec bvec;
-	struct bvec_iter bvecItr;
+	int ret = 0;
+	int srcuIndex = srcu_read_lock( &deviceTableSrcu );
 
-	bio_for_each_segment( bvec, bio, bvecItr )
+	struct block_device_node *node = lookup_block_device_node_by_id( deviceId );
+	if( node == NULL )
 	{
-		char* data = kmap_atomic( bio_iter_page( bio, bvecItr ) );
-		char* dst  = kmalloc( bio_iter_len( bio, bvecItr ), GFP_KERNEL);
-		
-		if( dst == NULL )
-		{
-			// Fatal error, tracking should stop here
-			LOG_ERROR( -ENOMEM, "Failed to allocate memory for block data." );
-			kunmap_atomic( data );
-			return;
-		}
+		ret = -ENOENT;
+		LOG_ERROR( ret, "No tracked device with id %u", deviceId );
+		goto out;
+	}
 
-		memcpy( dst, data + bio_iter_offset( bio, bvecItr ), bio_iter_len( bio, bvecItr ) );
-		kunmap_atomic( data );
-		
-		write_to_socket( dst, bio_iter_len( bio, bvecItr ), socket );
-		
-		kfree( dst );
+	if( size == 0 || sector >= node->overflow->capacity ||
+	    DIV_ROUND_UP( size, BIO_SECTOR_SIZE ) > node->overflow->capacity - sector )
+	{
+		ret = -EINVAL;
+		LOG_ERROR( ret, "Resync range out of device bounds" );
+		goto out;
 	}
+
+	overflow_mark( node->overflow, sector, size );
+
+out:
+	srcu_read_unlock( &deviceTableSrcu, srcuIndex );
+	return ret;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function obtains a free socket from a socket pool, processes a specified BIO,
-// populates block device change metadata, and writes both metadata and actual block change data to the socket.
+// This function records the region written by a BIO in the CBT bitmap of the device. No data
+// is copied or sent in this mode.
 /////////////////////////////////////////////////////////////////////////////////////////////
-static void write_bio_to_socket( struct bio* bio )
+static void mark_bio_in_cbt( struct block_device_node* node, struct bio* bio )
 {
-	struct socket *socket = get_free_socket( &socketPool );
-	if( socket == NULL )
+	rcu_read_lock();
+
+	struct cbt_bitmap* cbt = rcu_dereference( node->cbt );
+	if( cbt != NULL )
 	{
-		// Fatal error, tracking should stop here
-		LOG_ERROR( -1 , "Failed to get free socket from socket pool." );
-		return;
+		cbt_bitmap_mark( cbt, bio->bi_iter.bi_sector, bio_sectors( bio ) * BIO_SECTOR_SIZE );
 	}
 
-	struct block_device_change_metadata blockDeviceChangeMetadata;
-	populate_block_device_change_metadata( bio, &blockDeviceChangeMetadata );
-	write_to_socket( (char*)&blockDeviceChangeMetadata, sizeof( blockDeviceChangeMetadata ), socket );
-	write_actual_block_change_to_socket( bio, socket );
-	put_socket( &socketPool, socket );
+	rcu_read_unlock();
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -292,17 +531,41 @@ static void write_bio_to_socket( struct bio* bio )
 // Instead we will use predefined directives/functions to access the data from bio struct
 // to ensure compatibility .
 /////////////////////////////////////////////////////////////////////////////////////////////
-static void extract_bios( struct bio* bio )
+static void extract_bios( struct block_device_node* node, struct bio* bio )
 {
+	unsigned int mode = READ_ONCE( node->mode );
 	while( bio != NULL ) 
 	{       
-		if( bio_has_data( bio ) )
+		stats_add( node->stats, STATS_BIOS_SEEN, 1 );
+		trace_szs_bio_intercepted( node->deviceId, bio );
+
+		if( mode == TRACKING_MODE_CBT )
 		{
-			write_bio_to_socket( bio );
+			// Data-less writes such as discards change blocks too
+			mark_bio_in_cbt( node, bio );
+			stats_add( node->stats, STATS_BIOS_TRACKED, 1 );
 		}
-		else
+		else if( bio_has_change( bio ) )
 		{
-			LOG_DEBUG( "Bio struct has no data" );
+			overflow_note_write( node->overflow, bio->bi_iter.bi_sector, bio->bi_iter.bi_size );
+			stats_add( node->stats, STATS_BIOS_TRACKED, 1 );
+
+			if( mode == TRACKING_MODE_COMPLETION )
+			{
+				if( chain_bio_completion( node, bio ) )
+				{
+					// The completion cannot be chained, capture the write now
+					enqueue_bio( node, bio, GFP_NOIO | __GFP_NOWARN );
+				}
+			}
+			else if( mode == TRACKING_MODE_ASYNC )
+			{
+				enqueue_bio( node, bio, GFP_NOIO | __GFP_NOWARN );
+			}
+			else if( transport_write_bio( bio, node->deviceId, atomic64_inc_return( &node->sequence ), node->stats ) )
+			{
+				drop_bio( node, bio, DROP_SEND_FAILED );
+			}
 		}
 
 		bio = bio->bi_next;
@@ -324,29 +587,25 @@ void (*submit_bio_noacct_passthrough)( struct bio * ) =
 /////////////////////////////////////////////////////////////////////////////////////////////
 void tracing_fn( struct bio* bio ) 
 {
-	struct bio* initialBio = bio;
-	struct block_device_node *node = NULL, *temp = NULL;
-	struct block_device *blockDevice = NULL;
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+	if( static_branch_likely( &trackingActive ) && bio_data_dir( bio ) == WRITE )
 	{
-		blockDevice = node->blockDevice;
-		#ifdef USE_BI_BDEV
-		if( bio->bi_bdev == blockDevice )
-		#else
-		// Assuming that there will be no partitions for the disk
-		// Note: This assumption can be removed by making use of
-		// block device minor number
-		if( bio->bi_disk == blockDevice->bd_disk )
-		#endif
+		int srcuIndex = srcu_read_lock( &deviceTableSrcu );
+
+		u64 lookupStart = latency_start();
+		struct block_device_node *node = lookup_block_device_node( bio_device_key( bio ) );
+		latency_end( STAGE_LOOKUP, lookupStart );
+		if( node != NULL )
 		{
-			if( bio_data_dir( bio ) == WRITE )
-			{
-				extract_bios( bio );
-			}
+			u64 hookStart = ktime_get_ns();
+			extract_bios( node, bio );
+			capture_queue_account_hook( ktime_get_ns() - hookStart );
+			latency_end( STAGE_HOOK, lookupStart );
 		}
+
+		srcu_read_unlock( &deviceTableSrcu, srcuIndex );
 	}
 
-	submit_bio_noacct_passthrough( initialBio );
+	submit_bio_noacct_passthrough( bio );
 }
 #else
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -356,25 +615,28 @@ void tracing_fn( struct bio* bio )
 /////////////////////////////////////////////////////////////////////////////////////////////
 blk_qc_t misc_make_request_fn( struct request_queue *requestQueue, struct bio* bio ) 
 {
-	struct bio* initialBio = bio;
-	if( bio_data_dir( bio ) == WRITE )
-	{
-		extract_bios( bio );
-	}
+	blk_qc_t ret = BLK_QC_T_NONE;
+	int srcuIndex = srcu_read_lock( &deviceTableSrcu );
 
-	struct block_device_node *node = NULL, *temp = NULL;
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+	u64 lookupStart = latency_start();
+	struct block_device_node *node = lookup_block_device_node( bio_device_key( bio ) );
+	latency_end( STAGE_LOOKUP, lookupStart );
+	if( node != NULL )
 	{
-		// Assuming that there will be no partitions for the disk
-		// Note: This assumption can be removed by making use of
-		// block device minor number
-		if( initialBio->bi_disk == node->blockDevice->bd_disk )
+		if( bio_data_dir( bio ) == WRITE )
 		{
-			return node->original_make_request_fn( requestQueue, initialBio );
+			u64 hookStart = ktime_get_ns();
+			extract_bios( node, bio );
+			capture_queue_account_hook( ktime_get_ns() - hookStart );
+			latency_end( STAGE_HOOK, lookupStart );
 		}
+
+		ret = node->original_make_request_fn( requestQueue, bio );
 	}
 
-	return BLK_QC_T_NONE;
+	srcu_read_unlock( &deviceTableSrcu, srcuIndex );
+
+	return ret;
 }
 #endif
 
@@ -385,6 +647,11 @@ static void notrace ftrace_handler_submit_bio_noacct( unsigned long ip,
 						      struct ftrace_ops *fops,
 						      struct ftrace_regs *fregs )
 {
+	if( !static_branch_unlikely( &trackingActive ) )
+	{
+		return;
+	}
+
 	#ifdef USE_SET_INSTRUCTION_POINTER
 	ftrace_regs_set_instruction_pointer( fregs, ( unsigned long ) tracing_fn );
 	#else
@@ -397,6 +664,11 @@ static void notrace ftrace_handler_submit_bio_noacct( unsigned long ip,
 						      struct ftrace_ops *fops,
 						      struct pt_regs *fregs )
 {
+	if( !static_branch_unlikely( &trackingActive ) )
+	{
+		return;
+	}
+
 	fregs->ip = ( unsigned long )tracing_fn;
 }
 #endif
@@ -418,7 +690,7 @@ int register_tracer_filter( void )
 	int ret = ftrace_set_filter( &opsSubmitBioNoacct,
 				     funcname_submit_bio_noacct,
 				     strlen( funcname_submit_bio_noacct ),
-				     /*reset*/ 0 );
+				     /*reset*/ 1 );
 	
 	if( ret )
 	{
@@ -449,47 +721,79 @@ void unregister_tracer_filter( void )
 		{
 			LOG_WARN( "Failed to unregister tracer filter. ERR : %d", ret );
 		}
+
+		tracerRegistered = false;
 	}
 }
 #endif
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function registers the block device specified by its path for tracking.  
+// This function arms the interception hook when the first device gets tracked.
+// Must be called with deviceTableMutex held.
 /////////////////////////////////////////////////////////////////////////////////////////////
-int register_block_device_by_path( char *blockDevicePath )
+static int get_tracking_hook( void )
 {
 	int ret = 0;
-	if( !blockDevicePath )
+	if( trackedDeviceCount == 0 )
 	{
-		ret = -1;
-		LOG_ERROR( ret, "Block device path is empty." );
-		return ret;
+		#ifdef KERNEL_VERSION_5_9_OR_NEWER
+		ret = register_tracer_filter();
+		if( ret )
+		{
+			return ret;
+		}
+		#endif
+
+		static_branch_enable( &trackingActive );
+		LOG_INFO( "Tracking hook armed." );
 	}
 
-	struct block_device* blockDevice = NULL;
-	#ifdef KERNEL_VERSION_5_9_OR_NEWER
-	blockDevice = blkdev_get_by_path( blockDevicePath, FMODE_READ, /*holder*/ NULL );
-	#else
-	blockDevice = lookup_bdev( blockDevicePath );
-	#endif
+	trackedDeviceCount++;
+	return ret;
+}
 
-	if( blockDevice == NULL || IS_ERR( blockDevice ) )
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function disarms the interception hook when the last tracked device goes away.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void put_tracking_hook( void )
+{
+	if( WARN_ON( trackedDeviceCount == 0 ) )
 	{
-		ret = -ENODEV;
-		LOG_ERROR( ret, "Block device %s not found.", blockDevicePath );
-		return ret;
+		return;
 	}
 
-	if( !socketPoolInitialized )
+	trackedDeviceCount--;
+	if( trackedDeviceCount == 0 )
 	{
-		ret = socket_pool_init( &socketPool, LOCALHOST, port );
-		if( ret )
-		{
-			LOG_ERROR( ret, "Error creating socket pool." );
-			return ret;
-		}
+		static_branch_disable( &trackingActive );
 
-		socketPoolInitialized = true;
+		#ifdef KERNEL_VERSION_5_9_OR_NEWER
+		unregister_tracer_filter();
+		#endif
+
+		LOG_INFO( "Tracking hook disarmed." );
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function starts tracking a block device the caller has opened. On success the node
+// takes over the reference of the caller on the device. 'name' is only used in messages.
+// Must be called with deviceTableMutex held, once the transport is initialized.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int register_block_device( struct block_device *blockDevice, const char *name )
+{
+	if( lookup_block_device_node( block_device_key( blockDevice ) ) != NULL )
+	{
+		LOG_ERROR( -EEXIST, "Block device %s is already being tracked.", name );
+		return -EEXIST;
+	}
+
+	int ret = get_tracking_hook();
+	if( ret )
+	{
+		LOG_ERROR( ret, "Failed to arm tracking hook." );
+		return ret;
 	}
 
 	#ifndef KERNEL_VERSION_5_9_OR_NEWER
@@ -503,7 +807,8 @@ int register_block_device_by_path( char *blockDevicePath )
 	{
 		ret = -1;
 		LOG_ERROR( ret, "Block device queue is NULL.");
-		return ret; 
+		put_tracking_hook();
+		return ret;
 	}
 
 	blk_qc_t (*original_make_request_fn)(struct request_queue*, struct bio*) = blockDeviceQueue->make_request_fn;
@@ -511,43 +816,124 @@ int register_block_device_by_path( char *blockDevicePath )
 	#endif
 
 	#ifdef KERNEL_VERSION_5_9_OR_NEWER
-	ret = add_block_device_to_devicelist( blockDevice );
+	ret = add_block_device_to_device_table( blockDevice );
 	#else
-	ret = add_block_device_to_devicelist( blockDevice, original_make_request_fn );
+	ret = add_block_device_to_device_table( blockDevice, original_make_request_fn );
 	#endif
 
 	if( ret )
 	{
 		LOG_ERROR( ret, "Failed add block device to device list." );
-		return ret;
+		#ifndef KERNEL_VERSION_5_9_OR_NEWER
+		blockDeviceQueue->make_request_fn = original_make_request_fn;
+		#endif
+		put_tracking_hook();
 	}
 
 	return ret;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// This function unregisters the specified block device from tracking  
+// This function registers the block device specified by its path for tracking.  
 /////////////////////////////////////////////////////////////////////////////////////////////
-static void unregister_block_device( struct block_device *blockDevice )
+int register_block_device_by_path( char *blockDevicePath )
 {
-	#ifndef KERNEL_VERSION_5_9_OR_NEWER
-	// For kernel version < 5.9.0, replace back make_request_fn function
-	// by device's original make_request_fn.
-	struct block_device_node *node = NULL, *temp = NULL;
-	struct request_queue *blockDeviceQueue = blockDevice->bd_queue;
-	
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+	int ret = 0;
+	if( !blockDevicePath )
 	{
-		if( node->blockDevice == blockDevice )
-		{
-			blockDeviceQueue->make_request_fn = node->original_make_request_fn;
-		}
+		ret = -1;
+		LOG_ERROR( ret, "Block device path is empty." );
+		return ret;
 	}
+
+	struct block_device* blockDevice = NULL;
+	#ifdef KERNEL_VERSION_5_9_OR_NEWER
+	blockDevice = blkdev_get_by_path( blockDevicePath, FMODE_READ, /*holder*/ NULL );
+	#else
+	blockDevice = lookup_bdev( blockDevicePath );
 	#endif
 
-	remove_block_device_from_devicelist( blockDevice );
+	if( blockDevice == NULL || IS_ERR( blockDevice ) )
+	{
+		ret = -ENODEV;
+		LOG_ERROR( ret, "Block device %s not found.", blockDevicePath );
+		return ret;
+	}
+
+	mutex_lock( &deviceTableMutex );
+
+	ret = transport_init();
+	if( ret == 0 )
+	{
+		ret = register_block_device( blockDevice, blockDevicePath );
+	}
+
+	mutex_unlock( &deviceTableMutex );
+
+	#ifdef KERNEL_VERSION_5_9_OR_NEWER
+	if( ret )
+	{
+		blkdev_put( blockDevice, FMODE_READ );
+	}
+	#endif
 
-	return;
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function takes a node out of the tracked device table, so that the hook stops finding
+// it. The node must then be handed to release_block_device_nodes.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void unlink_block_device_node( struct block_device_node *node )
+{
+	#ifndef KERNEL_VERSION_5_9_OR_NEWER
+	// For kernel version < 5.9.0, replace back make_request_fn function
+	// by device's original make_request_fn.
+	node->blockDevice->bd_queue->make_request_fn = node->original_make_request_fn;
+	#endif
+
+	hash_del_rcu( &node->hash );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function frees unlinked nodes and drops their hook references. A single grace period
+// covers all of them.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void release_block_device_nodes( struct block_device_node **nodes, unsigned int nrNodes )
+{
+	if( nrNodes == 0 )
+	{
+		return;
+	}
+
+	synchronize_srcu( &deviceTableSrcu );
+
+	unsigned int index = 0;
+	while( index < nrNodes )
+	{
+		destroy_block_device_node( nodes[index] );
+		put_tracking_hook();
+		index++;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function unregisters the specified block device from tracking  
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void unregister_block_device( struct block_device *blockDevice )
+{
+	struct block_device_node *node = lookup_block_device_node( block_device_key( blockDevice ) );
+	if( node == NULL )
+	{
+		LOG_WARN( "Didn't found block device for removal" );
+		return;
+	}
+
+	unlink_block_device_node( node );
+	release_block_device_nodes( &node, 1 );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -577,7 +963,9 @@ int unregister_block_device_by_path( char *blockDevicePath )
 		return ret;
 	}
 
+	mutex_lock( &deviceTableMutex );
 	unregister_block_device( blockDevice );
+	mutex_unlock( &deviceTableMutex );
 	
 	#ifdef KERNEL_VERSION_5_9_OR_NEWER
 	blkdev_put( blockDevice, FMODE_READ );
@@ -586,28 +974,495 @@ int unregister_block_device_by_path( char *blockDevicePath )
 	return ret;
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function finds the tracked device node of the block device specified by its path.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int find_block_device_node_by_path( char *blockDevicePath, struct block_device_node **foundNode )
+{
+	int ret = 0;
+	if( !blockDevicePath )
+	{
+		ret = -1;
+		LOG_ERROR( ret, "Block device path is empty." );
+		return ret;
+	}
+
+	struct block_device* blockDevice = NULL;
+	#ifdef KERNEL_VERSION_5_9_OR_NEWER
+	blockDevice = blkdev_get_by_path( blockDevicePath, FMODE_READ, /*holder*/ NULL );
+	#else
+	blockDevice = lookup_bdev( blockDevicePath );
+	#endif
+
+	if( blockDevice == NULL || IS_ERR( blockDevice ) )
+	{
+		ret = -ENODEV;
+		LOG_ERROR( ret, "Block device %s not found.", blockDevicePath );
+		return ret;
+	}
+
+	ret = 0;
+	*foundNode = lookup_block_device_node( block_device_key( blockDevice ) );
+	if( *foundNode == NULL )
+	{
+		ret = -ENOENT;
+		LOG_ERROR( ret, "Block device %s is not being tracked.", blockDevicePath );
+	}
+
+	#ifdef KERNEL_VERSION_5_9_OR_NEWER
+	blkdev_put( blockDevice, FMODE_READ );
+	#endif
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function switches a tracked device node to the given mode. Entering CBT mode
+// allocates the dirty bitmap, leaving it frees the bitmap once the hook can no longer see it.
+// Must be called with deviceTableMutex held.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int set_block_device_node_mode( struct block_device_node *node, unsigned int mode, unsigned int cbtGranularity )
+{
+	struct cbt_bitmap* oldCbt = rcu_dereference_protected( node->cbt, lockdep_is_held( &deviceTableMutex ) );
+
+	if( mode == TRACKING_MODE_CBT )
+	{
+		if( oldCbt != NULL )
+		{
+			if( oldCbt->granularity != cbtGranularity )
+			{
+				LOG_ERROR( -EBUSY, "CBT granularity cannot be changed while the device is in CBT mode." );
+				return -EBUSY;
+			}
+
+			return 0;
+		}
+
+		sector_t capacity = i_size_read( node->blockDevice->bd_inode ) >> SECTOR_SHIFT;
+		struct cbt_bitmap* cbt = cbt_bitmap_create( capacity, cbtGranularity );
+		if( cbt == NULL )
+		{
+			return -ENOMEM;
+		}
+
+		rcu_assign_pointer( node->cbt, cbt );
+		WRITE_ONCE( node->mode, mode );
+
+		return 0;
+	}
+
+	WRITE_ONCE( node->mode, mode );
+
+	// Records still pending must not be numbered after those the synchronous path sends
+	if( mode == TRACKING_MODE_SYNC )
+	{
+		absorption_flush( node->absorption );
+	}
+
+	if( oldCbt != NULL )
+	{
+		RCU_INIT_POINTER( node->cbt, NULL );
+		synchronize_rcu();
+		cbt_bitmap_destroy( oldCbt );
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function checks a tracking mode and its CBT granularity, which is replaced by the
+// default when 0.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int validate_tracking_mode( unsigned int mode, unsigned int *cbtGranularity )
+{
+	if( mode != TRACKING_MODE_SYNC && mode != TRACKING_MODE_ASYNC && mode != TRACKING_MODE_CBT &&
+	    mode != TRACKING_MODE_COMPLETION )
+	{
+		LOG_ERROR( -EINVAL, "Invalid tracking mode %u.", mode );
+		return -EINVAL;
+	}
+
+	if( *cbtGranularity == 0 )
+	{
+		*cbtGranularity = CBT_DEFAULT_GRANULARITY;
+	}
+
+	if( mode == TRACKING_MODE_CBT &&
+	    ( !is_power_of_2( *cbtGranularity ) || *cbtGranularity < CBT_MIN_GRANULARITY || *cbtGranularity > CBT_MAX_GRANULARITY ) )
+	{
+		LOG_ERROR( -EINVAL, "Invalid CBT granularity %u.", *cbtGranularity );
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function changes the tracking mode of a block device that is already being tracked.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int set_block_device_mode_by_path( char *blockDevicePath, unsigned int mode, unsigned int cbtGranularity )
+{
+	int ret = validate_tracking_mode( mode, &cbtGranularity );
+	if( ret )
+	{
+		return ret;
+	}
+
+	mutex_lock( &deviceTableMutex );
+
+	struct block_device_node *node = NULL;
+	ret = find_block_device_node_by_path( blockDevicePath, &node );
+	if( ret == 0 )
+	{
+		ret = set_block_device_node_mode( node, mode, cbtGranularity );
+	}
+
+	mutex_unlock( &deviceTableMutex );
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function copies the CBT bitmap of a block device to user space and resets it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int fetch_block_device_cbt_by_path( char *blockDevicePath, struct cbt_fetch_request *request )
+{
+	mutex_lock( &deviceTableMutex );
+
+	struct block_device_node *node = NULL;
+	int ret = find_block_device_node_by_path( blockDevicePath, &node );
+	if( ret )
+	{
+		mutex_unlock( &deviceTableMutex );
+		return ret;
+	}
+
+	struct cbt_bitmap* cbt = rcu_dereference_protected( node->cbt, lockdep_is_held( &deviceTableMutex ) );
+	if( node->mode != TRACKING_MODE_CBT || cbt == NULL )
+	{
+		ret = -EINVAL;
+		LOG_ERROR( ret, "Block device %s is not in CBT mode.", blockDevicePath );
+		mutex_unlock( &deviceTableMutex );
+		return ret;
+	}
+
+	request->nrBits      = cbt->nrBits;
+	request->bitmapSize  = cbt_bitmap_size( cbt );
+	request->granularity = cbt->granularity;
+
+	ret = cbt_bitmap_fetch_and_reset( cbt, u64_to_user_ptr( request->bitmapBuffer ), request->bitmapBufferSize );
+
+	mutex_unlock( &deviceTableMutex );
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function switches payload compression of the block device specified by its path. Only
+// changes captured in TRACKING_MODE_ASYNC and TRACKING_MODE_COMPLETION are compressed, by the
+// capture workers.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int set_block_device_compression_by_path( char *blockDevicePath, bool enable, unsigned int minSize )
+{
+	if( enable && !compression_supported() )
+	{
+		LOG_ERROR( -EOPNOTSUPP, "Kernel was built without LZ4 compression." );
+		return -EOPNOTSUPP;
+	}
+
+	mutex_lock( &deviceTableMutex );
+
+	struct block_device_node *node = NULL;
+	int ret = find_block_device_node_by_path( blockDevicePath, &node );
+	if( ret == 0 )
+	{
+		WRITE_ONCE( node->compressMinSize, minSize ? minSize : COMPRESS_DEFAULT_MIN_SIZE );
+		WRITE_ONCE( node->compress, enable );
+		LOG_INFO( "Compression %s for %s.", enable ? "enabled" : "disabled", blockDevicePath );
+	}
+
+	mutex_unlock( &deviceTableMutex );
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function opens the block device of a batch entry, by number or by path. 'name' receives
+// a printable name of the device.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct block_device* open_batch_entry( struct block_device_batch_entry *entry, char *name, size_t nameSize )
+{
+	struct block_device* blockDevice = NULL;
+	if( entry->major != 0 || entry->minor != 0 )
+	{
+		snprintf( name, nameSize, "%u:%u", entry->major, entry->minor );
+
+		#ifdef KERNEL_VERSION_5_9_OR_NEWER
+		blockDevice = blkdev_get_by_dev( MKDEV( entry->major, entry->minor ), FMODE_READ, /*holder*/ NULL );
+		#else
+		blockDevice = bdget( MKDEV( entry->major, entry->minor ) );
+		#endif
+	}
+	else
+	{
+		entry->blockDevicePath[BLOCK_DEVICE_PATH_LEN - 1] = '\0';
+		strscpy( name, entry->blockDevicePath, nameSize );
+
+		#ifdef KERNEL_VERSION_5_9_OR_NEWER
+		blockDevice = blkdev_get_by_path( entry->blockDevicePath, FMODE_READ, /*holder*/ NULL );
+		#else
+		blockDevice = lookup_bdev( entry->blockDevicePath );
+		#endif
+	}
+
+	if( blockDevice == NULL || IS_ERR( blockDevice ) )
+	{
+		LOG_ERROR( -ENODEV, "Block device %s not found.", name );
+		return NULL;
+	}
+
+	return blockDevice;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function registers the device of a batch entry and switches it to the requested mode.
+// A device whose mode cannot be set is not left tracked.
+// Must be called with deviceTableMutex held, once the transport is initialized.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int add_batch_entry( struct block_device_batch_entry *entry, struct block_device_node **addedNode )
+{
+	unsigned int cbtGranularity = entry->cbtGranularity;
+	int ret = validate_tracking_mode( entry->mode, &cbtGranularity );
+	if( ret )
+	{
+		return ret;
+	}
+
+	char name[BLOCK_DEVICE_PATH_LEN];
+	struct block_device* blockDevice = open_batch_entry( entry, name, sizeof( name ) );
+	if( blockDevice == NULL )
+	{
+		return -ENODEV;
+	}
+
+	ret = register_block_device( blockDevice, name );
+	if( ret )
+	{
+		#ifdef KERNEL_VERSION_5_9_OR_NEWER
+		blkdev_put( blockDevice, FMODE_READ );
+		#endif
+		return ret;
+	}
+
+	struct block_device_node *node = lookup_block_device_node( block_device_key( blockDevice ) );
+	ret = set_block_device_node_mode( node, entry->mode, cbtGranularity );
+	if( ret )
+	{
+		unlink_block_device_node( node );
+		release_block_device_nodes( &node, 1 );
+		return ret;
+	}
+
+	*addedNode = node;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function registers the devices of a batch in one pass and stores the result of each
+// entry. The batch holds a hook reference of its own, so the hook is armed at most once. With
+// BLOCK_DEVICE_BATCH_ATOMIC, the first failure stops the batch and undoes it; the entries
+// that were not kept report -ECANCELED. It returns the error of the first failed entry.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int register_block_device_batch( struct block_device_batch_entry *entries, unsigned int nrEntries, unsigned int flags, unsigned int *nrSucceeded )
+{
+	*nrSucceeded = 0;
+
+	struct block_device_node **added = kvcalloc( nrEntries, sizeof( *added ), GFP_KERNEL );
+	if( added == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device batch." );
+		return -ENOMEM;
+	}
+
+	unsigned int index = 0;
+	while( index < nrEntries )
+	{
+		entries[index].result = -ECANCELED;
+		index++;
+	}
+
+	mutex_lock( &deviceTableMutex );
+
+	int ret = transport_init();
+	if( ret == 0 )
+	{
+		ret = get_tracking_hook();
+	}
+
+	if( ret )
+	{
+		mutex_unlock( &deviceTableMutex );
+		kvfree( added );
+		return ret;
+	}
+
+	unsigned int nrAdded = 0;
+	index = 0;
+	while( index < nrEntries )
+	{
+		struct block_device_batch_entry *entry = &entries[index];
+		entry->result = add_batch_entry( entry, &added[nrAdded] );
+		if( entry->result == 0 )
+		{
+			nrAdded++;
+		}
+		else if( ret == 0 )
+		{
+			ret = entry->result;
+			if( flags & BLOCK_DEVICE_BATCH_ATOMIC )
+			{
+				break;
+			}
+		}
+
+		index++;
+	}
+
+	if( ret && ( flags & BLOCK_DEVICE_BATCH_ATOMIC ) )
+	{
+		index = 0;
+		while( index < nrAdded )
+		{
+			unlink_block_device_node( added[index] );
+			index++;
+		}
+
+		release_block_device_nodes( added, nrAdded );
+		nrAdded = 0;
+
+		index = 0;
+		while( index < nrEntries )
+		{
+			entries[index].result = entries[index].result ? entries[index].result : -ECANCELED;
+			index++;
+		}
+	}
+
+	put_tracking_hook();
+	mutex_unlock( &deviceTableMutex );
+
+	kvfree( added );
+	*nrSucceeded = nrAdded;
+	LOG_INFO( "Batch registered %u of %u block devices.", nrAdded, nrEntries );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function unregisters the devices of a batch in one pass and stores the result of each
+// entry. All of them are released after a single grace period. It returns the error of the
+// first failed entry.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int unregister_block_device_batch( struct block_device_batch_entry *entries, unsigned int nrEntries, unsigned int *nrSucceeded )
+{
+	*nrSucceeded = 0;
+
+	struct block_device_node **removed = kvcalloc( nrEntries, sizeof( *removed ), GFP_KERNEL );
+	if( removed == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for device batch." );
+		return -ENOMEM;
+	}
+
+	mutex_lock( &deviceTableMutex );
+
+	int ret = 0;
+	unsigned int nrRemoved = 0;
+	unsigned int index = 0;
+	while( index < nrEntries )
+	{
+		struct block_device_batch_entry *entry = &entries[index];
+		char name[BLOCK_DEVICE_PATH_LEN];
+		struct block_device* blockDevice = open_batch_entry( entry, name, sizeof( name ) );
+		struct block_device_node *node = NULL;
+		if( blockDevice != NULL )
+		{
+			node = lookup_block_device_node( block_device_key( blockDevice ) );
+
+			#ifdef KERNEL_VERSION_5_9_OR_NEWER
+			blkdev_put( blockDevice, FMODE_READ );
+			#endif
+		}
+
+		if( blockDevice == NULL )
+		{
+			entry->result = -ENODEV;
+		}
+		else if( node == NULL )
+		{
+			entry->result = -ENOENT;
+			LOG_ERROR( entry->result, "Block device %s is not being tracked.", name );
+		}
+		else
+		{
+			// Unlinked right away, so that the same device named twice is reported once
+			unlink_block_device_node( node );
+			removed[nrRemoved++] = node;
+			entry->result = 0;
+		}
+
+		if( entry->result && ret == 0 )
+		{
+			ret = entry->result;
+		}
+
+		index++;
+	}
+
+	release_block_device_nodes( removed, nrRemoved );
+	mutex_unlock( &deviceTableMutex );
+
+	kvfree( removed );
+	*nrSucceeded = nrRemoved;
+	LOG_INFO( "Batch unregistered %u of %u block devices.", nrRemoved, nrEntries );
+	return ret;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////
 // This function unregisters all tracked block devices.  
 /////////////////////////////////////////////////////////////////////////////////////////////
 static void unregister_block_devices( void )
 {
-	struct block_device_node *node = NULL, *temp = NULL;
-	list_for_each_entry_safe( node, temp, &deviceList, list )
+	struct block_device_node *node = NULL;
+	struct hlist_node *temp = NULL;
+	unsigned int bucket;
+
+	mutex_lock( &deviceTableMutex );
+	hash_for_each_safe( deviceTable, bucket, temp, node, hash )
 	{
 		unregister_block_device( node->blockDevice );
 	}
+	mutex_unlock( &deviceTableMutex );
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 static int register_ioctl_control_interface( void )
 {
-	return misc_register( &trackerControlDevice );
+	int ret = misc_register( &trackerControlDevice );
+	controlDeviceRegistered = ret == 0;
+	return ret;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 static void unregister_ioctl_control_interface( void )
 {
+	if( !controlDeviceRegistered )
+	{
+		return;
+	}
+
 	misc_deregister( &trackerControlDevice );
+	controlDeviceRegistered = false;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -617,13 +1472,28 @@ void tracker_exit( void )
 
 	unregister_ioctl_control_interface();
 	
-	#ifdef KERNEL_VERSION_5_9_OR_NEWER
-	unregister_tracer_filter();
-	#endif
- 
+	// Removing the last tracked device disarms the tracking hook
 	unregister_block_devices();
+	kmem_cache_destroy( completionCaptureCache );
+	if( completionWorkqueue != NULL )
+	{
+		destroy_workqueue( completionWorkqueue );
+		completionWorkqueue = NULL;
+	}
 
-	socket_pool_cleanup( &socketPool );
+	device_map_cleanup();
+
+	// Send whatever is still queued before the sockets go away
+	capture_queue_cleanup();
+	change_record_cleanup();
+
+	transport_cleanup();
+
+	// Queued records hold the device counters, so they go last
+	stats_cleanup();
+	latency_cleanup();
+
+	cleanup_srcu_struct( &deviceTableSrcu );
 
 	LOG_INFO( "Module unloaded." );
 }
@@ -633,25 +1503,67 @@ static int __init tracker_init( void )
 {
 	LOG_INFO( "Initializing module..." );
 
-	int ret = 0;
-	ret = register_ioctl_control_interface();
+	int ret = init_srcu_struct( &deviceTableSrcu );
 	if( ret )
 	{
-		LOG_ERROR( ret, "Error registering SZS control device." );
+		LOG_ERROR( ret, "Error initializing device table." );
+		return ret;
+	}
+
+	ret = stats_init();
+	if( ret )
+	{
+		LOG_ERROR( ret, "Error creating sysfs counters." );
+		goto error;
+	}
+
+	ret = latency_init();
+	if( ret )
+	{
+		LOG_ERROR( ret, "Error creating latency histograms." );
 		goto error;
 	}
 
-	INIT_LIST_HEAD( &deviceList );
+	completionCaptureCache = KMEM_CACHE( completion_capture, 0 );
+	if( completionCaptureCache == NULL )
+	{
+		ret = -ENOMEM;
+		LOG_ERROR( ret, "Error creating completion capture cache." );
+		goto error;
+	}
 
-	#ifdef KERNEL_VERSION_5_9_OR_NEWER
-	ret = register_tracer_filter();
+	// Completed writes wait for this queue, which must make progress under memory pressure
+	completionWorkqueue = alloc_workqueue( "szs_completion", WQ_MEM_RECLAIM | WQ_UNBOUND, 0 );
+	if( completionWorkqueue == NULL )
+	{
+		ret = -ENOMEM;
+		LOG_ERROR( ret, "Error creating completion workqueue." );
+		goto error;
+	}
+
+	ret = transport_setup();
 	if( ret )
 	{
-		LOG_ERROR( ret, "Error registering tracer filter." );
+		LOG_ERROR( ret, "Error setting up transport." );
+		goto error;
+	}
+
+	ret = capture_queue_init();
+	if( ret )
+	{
+		LOG_ERROR( ret, "Error starting capture queue." );
+		goto error;
+	}
+
+	// Devices can be added as soon as the control device exists, so it comes last
+	ret = register_ioctl_control_interface();
+	if( ret )
+	{
+		LOG_ERROR( ret, "Error registering SZS control device." );
 		goto error;
 	}
-	#endif
 
+	// The tracer filter is registered when the first block device gets tracked
 	LOG_INFO( "Module initialized successfully." );
 	return ret;
 
@@ -11,8 +11,18 @@
 /*  applicable RackWare license agreement.                         */
 /*                                                                 */
 /*******************************************************************/
+#include <ioctl_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
 int register_block_device_by_path  ( char *blockDevicePath );
 int unregister_block_device_by_path( char *blockDevicePath );
+int register_block_device_batch  ( struct block_device_batch_entry *entries, unsigned int nrEntries, unsigned int flags, unsigned int *nrSucceeded );
+int unregister_block_device_batch( struct block_device_batch_entry *entries, unsigned int nrEntries, unsigned int *nrSucceeded );
+int set_block_device_mode_by_path  ( char *blockDevicePath, unsigned int mode, unsigned int cbtGranularity );
+int set_block_device_compression_by_path( char *blockDevicePath, bool enable, unsigned int minSize );
+int fetch_block_device_cbt_by_path ( char *blockDevicePath, struct cbt_fetch_request *request );
+void mark_device_overflow( uint32_t deviceId, sector_t sector, uint64_t size );
+int resync_device_range( uint32_t deviceId, sector_t sector, uint64_t size );
 
 #endif // SZS_TRACKER_MODULE_H
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,239 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM szs_tracker
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Why a change did not make it to the transport. Whatever the reason, its range is left to the
+// overflow tracker.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#ifndef SZS_TRACKER_TRACE_TYPES
+#define SZS_TRACKER_TRACE_TYPES
+enum szs_drop_reason
+{
+	DROP_CAPTURE_FAILED,          // No memory or capture budget exhausted
+	DROP_QUEUE_FULL,              // Capture queue selected by the device and range is full
+	DROP_SEND_FAILED,             // The transport failed to deliver the record
+};
+#endif
+
+#if !defined( SZS_TRACKER_TRACE_H ) || defined( TRACE_HEADER_MULTI_READ )
+#define SZS_TRACKER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <wire_format.h>
+
+TRACE_DEFINE_ENUM( DROP_CAPTURE_FAILED );
+TRACE_DEFINE_ENUM( DROP_QUEUE_FULL );
+TRACE_DEFINE_ENUM( DROP_SEND_FAILED );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// A write bio to a tracked device entered the submission hook.
+/////////////////////////////////////////////////////////////////////////////////////////////
+TRACE_EVENT( szs_bio_intercepted,
+
+	TP_PROTO( uint32_t deviceId, struct bio* bio ),
+
+	TP_ARGS( deviceId, bio ),
+
+	TP_STRUCT__entry(
+		__field( uint32_t, deviceId )
+		__field( sector_t, sector )
+		__field( unsigned int, size )
+		__field( unsigned int, opf )
+	),
+
+	TP_fast_assign(
+		__entry->deviceId = deviceId;
+		__entry->sector   = bio->bi_iter.bi_sector;
+		__entry->size     = bio->bi_iter.bi_size;
+		__entry->opf      = bio->bi_opf;
+	),
+
+	TP_printk( "device=%u sector=%llu size=%u opf=0x%x",
+		   __entry->deviceId, ( unsigned long long )__entry->sector, __entry->size, __entry->opf )
+);
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Change record events share the identifying fields of the record header.
+/////////////////////////////////////////////////////////////////////////////////////////////
+DECLARE_EVENT_CLASS( szs_record_class,
+
+	TP_PROTO( struct szs_record_header* header, unsigned int bytes ),
+
+	TP_ARGS( header, bytes ),
+
+	TP_STRUCT__entry(
+		__field( uint32_t, deviceId )
+		__field( uint64_t, sequence )
+		__field( uint64_t, sector )
+		__field( uint32_t, length )
+		__field( unsigned int, bytes )
+	),
+
+	TP_fast_assign(
+		__entry->deviceId = header->deviceId;
+		__entry->sequence = header->sequence;
+		__entry->sector   = header->sector;
+		__entry->length   = header->length;
+		__entry->bytes    = bytes;
+	),
+
+	TP_printk( "device=%u seq=%llu sector=%llu length=%u bytes=%u",
+		   __entry->deviceId, __entry->sequence, __entry->sector, __entry->length, __entry->bytes )
+);
+
+// A bio was copied or mapped into a change record, 'bytes' is the payload size
+DEFINE_EVENT( szs_record_class, szs_bio_captured,
+	TP_PROTO( struct szs_record_header* header, unsigned int bytes ),
+	TP_ARGS( header, bytes ) );
+
+// A record was queued for the capture workers, 'bytes' is the queue depth after it
+DEFINE_EVENT( szs_record_class, szs_record_enqueued,
+	TP_PROTO( struct szs_record_header* header, unsigned int bytes ),
+	TP_ARGS( header, bytes ) );
+
+// A record was handed to the transport, 'bytes' is its size on the wire
+DEFINE_EVENT( szs_record_class, szs_record_sent,
+	TP_PROTO( struct szs_record_header* header, unsigned int bytes ),
+	TP_ARGS( header, bytes ) );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// A change was not delivered and its range was left to the overflow tracker.
+/////////////////////////////////////////////////////////////////////////////////////////////
+TRACE_EVENT( szs_record_dropped,
+
+	TP_PROTO( uint32_t deviceId, uint64_t sector, uint32_t length, enum szs_drop_reason reason ),
+
+	TP_ARGS( deviceId, sector, length, reason ),
+
+	TP_STRUCT__entry(
+		__field( uint32_t, deviceId )
+		__field( uint64_t, sector )
+		__field( uint32_t, length )
+		__field( unsigned int, reason )
+	),
+
+	TP_fast_assign(
+		__entry->deviceId = deviceId;
+		__entry->sector   = sector;
+		__entry->length   = length;
+		__entry->reason   = reason;
+	),
+
+	TP_printk( "device=%u sector=%llu length=%u reason=%s",
+		   __entry->deviceId, __entry->sector, __entry->length,
+		   __print_symbolic( __entry->reason,
+				     { DROP_CAPTURE_FAILED, "capture_failed" },
+				     { DROP_QUEUE_FULL,     "queue_full" },
+				     { DROP_SEND_FAILED,    "send_failed" } ) )
+);
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Socket pool events. 'waited' tells whether the caller found the pool exhausted.
+/////////////////////////////////////////////////////////////////////////////////////////////
+TRACE_EVENT( szs_socket_acquired,
+
+	TP_PROTO( unsigned int index, unsigned int affinity, bool waited ),
+
+	TP_ARGS( index, affinity, waited ),
+
+	TP_STRUCT__entry(
+		__field( unsigned int, index )
+		__field( unsigned int, affinity )
+		__field( bool, waited )
+	),
+
+	TP_fast_assign(
+		__entry->index    = index;
+		__entry->affinity = affinity;
+		__entry->waited   = waited;
+	),
+
+	TP_printk( "slot=%u affinity=%u waited=%d", __entry->index, __entry->affinity, __entry->waited )
+);
+
+TRACE_EVENT( szs_socket_released,
+
+	TP_PROTO( unsigned int index, bool broken ),
+
+	TP_ARGS( index, broken ),
+
+	TP_STRUCT__entry(
+		__field( unsigned int, index )
+		__field( bool, broken )
+	),
+
+	TP_fast_assign(
+		__entry->index  = index;
+		__entry->broken = broken;
+	),
+
+	TP_printk( "slot=%u broken=%d", __entry->index, __entry->broken )
+);
+
+// The pool manager connected or closed a socket, 'size' is the new pool size
+TRACE_EVENT( szs_socket_pool_resized,
+
+	TP_PROTO( unsigned int size, unsigned int target ),
+
+	TP_ARGS( size, target ),
+
+	TP_STRUCT__entry(
+		__field( unsigned int, size )
+		__field( unsigned int, target )
+	),
+
+	TP_fast_assign(
+		__entry->size   = size;
+		__entry->target = target;
+	),
+
+	TP_printk( "size=%u target=%u", __entry->size, __entry->target )
+);
+
+// sock_sendmsg returned before the whole message was sent
+TRACE_EVENT( szs_partial_send,
+
+	TP_PROTO( int sent, size_t remaining ),
+
+	TP_ARGS( sent, remaining ),
+
+	TP_STRUCT__entry(
+		__field( int, sent )
+		__field( size_t, remaining )
+	),
+
+	TP_fast_assign(
+		__entry->sent      = sent;
+		__entry->remaining = remaining;
+	),
+
+	TP_printk( "sent=%d remaining=%zu", __entry->sent, __entry->remaining )
+);
+
+#endif // SZS_TRACKER_TRACE_H
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This part must be outside the header guard. The module is built with its own directory on
+// the include path, so define_trace.h finds this file there.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE szs_tracker_trace
+#include <trace/define_trace.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,548 @@
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <transport.h>
+#include <linux/inet.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/random.h>
+#include <linux/tcp.h>
+#include <linux/uio.h>
+#include <net/tcp.h>
+
+#include <kernel_compat.h>
+#include <logging.h>
+#include <constants.h>
+#include <socketpool.h>
+#include <capture_queue.h>
+#include <ring_transport.h>
+#include <device_map.h>
+#include <latency.h>
+#include <szs_tracker_module.h>
+#include <szs_tracker_trace.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static unsigned int transportType = TRANSPORT_TCP;
+module_param_named( transport, transportType, uint, 0444 );
+MODULE_PARM_DESC( transport, "Where change records go: 0 = TCP socket pool, 1 = shared memory ring" );
+
+static unsigned int batchSize = TRANSPORT_DEFAULT_BATCH_SIZE;
+module_param_named( batch_size, batchSize, uint, 0644 );
+MODULE_PARM_DESC( batch_size, "Bytes a capture worker sends on one corked socket before flushing (0 = no batching)" );
+
+static unsigned int batchFlushDelayUs = TRANSPORT_DEFAULT_FLUSH_DELAY_US;
+module_param_named( batch_flush_delay_us, batchFlushDelayUs, uint, 0644 );
+MODULE_PARM_DESC( batch_flush_delay_us, "Maximum time in microseconds a record waits in an open batch" );
+
+static char targetIp[TARGET_IP_LEN] = LOCALHOST;
+module_param_string( target_ip, targetIp, sizeof( targetIp ), 0444 );
+MODULE_PARM_DESC( target_ip, "IPv4 address of the receiver" );
+
+static unsigned int targetPort = TRANSPORT_DEFAULT_PORT;
+module_param_named( target_port, targetPort, uint, 0444 );
+MODULE_PARM_DESC( target_port, "TCP port of the receiver" );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static struct socket_pool socketPool;
+static bool socketPoolInitialized = false;
+static DEFINE_MUTEX( endpointMutex );   // Serializes endpoint changes and the pool creation
+static uint64_t sessionId = 0;          // Tells receivers which load of the module they hear from
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sends a message until its iterator is exhausted. sock_sendmsg advances the
+// iterator by the amount it consumed, so a partial send is resumed exactly where it stopped.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int send_message( struct msghdr* msg, struct socket* socket )
+{
+	while( msg_data_left( msg ) )
+	{
+		size_t length = msg_data_left( msg );
+		int result = sock_sendmsg( socket, msg );
+		if( result <= 0 )
+		{
+			// Fatal error, tracking should stop here
+			result = result ? result : -EPIPE;
+			LOG_ERROR( result, "Failed to write data to socket." );
+			return result;
+		}
+
+		if( result < length )
+		{
+			trace_szs_partial_send( result, msg_data_left( msg ) );
+		}
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes the data described by an array of bio_vecs to a specified socket with
+// a single sendmsg.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_bvecs_to_socket( struct bio_vec* vecs, unsigned int nrVecs, size_t len, int flags, struct socket* socket )
+{
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( struct msghdr ) );
+	msg.msg_flags = flags;
+	iov_iter_bvec( &msg.msg_iter, WRITE, vecs, nrVecs, len );
+
+	return send_message( &msg, socket );
+}
+
+#ifndef HAS_MSG_SPLICE_PAGES
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function hands pages to the socket one by one with kernel_sendpage, which is the only
+// zero-copy interface before MSG_SPLICE_PAGES. MSG_MORE keeps the socket corked between the
+// pages, so the stream is still cut into full-sized TCP segments.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_pages_to_socket( struct bio_vec* vecs, unsigned int nrVecs, int lastFlags, struct socket* socket )
+{
+	unsigned int index = 0;
+	while( index < nrVecs )
+	{
+		struct bio_vec* vec = &vecs[index];
+		int flags = ( index + 1 < nrVecs ) ? MSG_MORE : lastFlags;
+		unsigned int sent = 0;
+
+		while( sent < vec->bv_len )
+		{
+			int result = kernel_sendpage( socket, vec->bv_page, vec->bv_offset + sent, vec->bv_len - sent, flags );
+			if( result <= 0 )
+			{
+				// Fatal error, tracking should stop here
+				result = result ? result : -EPIPE;
+				LOG_ERROR( result, "Failed to write page to socket." );
+				return result;
+			}
+
+			sent += result;
+		}
+
+		index++;
+	}
+
+	return 0;
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes a change record, header and payload, to a specified socket.
+//
+// A mapped record borrows the pages of a bio that has not been submitted yet. They are sent
+// with one sendmsg that copies them into the socket before returning, because the socket must
+// not keep pages the page cache is free to modify once the write completes.
+//
+// A captured record owns its pages, so they are spliced into the socket, which takes its own
+// page references: the record can be freed as soon as this function returns. From 6.5 this is
+// a single sendmsg with MSG_SPLICE_PAGES.
+//
+// 'flags' is passed on to the socket, e.g. MSG_MORE when more records follow.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_change_record( struct change_record* record, int flags, struct socket* socket )
+{
+	size_t len = change_record_wire_length( record );
+
+	if( !record->ownsPages )
+	{
+		return write_bvecs_to_socket( record->vecs, record->nrVecs + 1, len, flags, socket );
+	}
+
+	#ifdef HAS_MSG_SPLICE_PAGES
+	return write_bvecs_to_socket( record->vecs, record->nrVecs + 1, len, flags | MSG_SPLICE_PAGES, socket );
+	#else
+	return write_pages_to_socket( record->vecs, record->nrVecs + 1, flags, socket );
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function writes a buffer to a specified socket.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int write_buffer_to_socket( void* buffer, size_t len, int flags, struct socket* socket )
+{
+	struct kvec vec = { .iov_base = buffer, .iov_len = len };
+	struct msghdr msg;
+	memset( &msg, 0, sizeof( struct msghdr ) );
+	msg.msg_flags = flags;
+	iov_iter_kvec( &msg.msg_iter, WRITE, &vec, 1, len );
+
+	return send_message( &msg, socket );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function brings a connection up to date before records are written to it: a new
+// connection first gets the stream preamble, and any connection that has not seen the current
+// device map gets it now, so that every device ID it will carry is known to the receiver.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static int prepare_connection( struct socket_pool_entry* entry )
+{
+	int ret = 0;
+	if( entry->mapGeneration == 0 )
+	{
+		struct szs_stream_preamble preamble =
+		{
+			.magic = SZS_WIRE_MAGIC,
+			.version = SZS_WIRE_VERSION,
+			.headerSize = sizeof( struct szs_record_header ),
+			.sessionId = sessionId
+		};
+
+		ret = write_buffer_to_socket( &preamble, sizeof( preamble ), MSG_MORE, entry->socket );
+		if( ret )
+		{
+			return ret;
+		}
+	}
+
+	if( entry->mapGeneration == device_map_generation() )
+	{
+		return 0;
+	}
+
+	size_t length = 0;
+	uint64_t generation = 0;
+	void* mapRecord = device_map_build_record( &length, &generation );
+	if( mapRecord == NULL )
+	{
+		return -ENOMEM;
+	}
+
+	ret = write_buffer_to_socket( mapRecord, length, MSG_MORE, entry->socket );
+	kfree( mapRecord );
+	if( ret == 0 )
+	{
+		entry->mapGeneration = generation;
+	}
+
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function maps a specified BIO into a change record, obtains a free socket from a socket
+// pool and writes both the record header and actual block change data to the socket in one
+// send. It is used by the synchronous path, so the record is never batched. On failure the
+// change has not been delivered and the caller must keep track of it.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int transport_write_bio( struct bio* bio, uint32_t deviceId, uint64_t sequence, struct device_stats* stats )
+{
+	struct change_record* record = map_change_record( bio, deviceId, sequence, GFP_NOIO );
+	if( record == NULL )
+	{
+		LOG_ERROR( -ENOMEM, "Failed to allocate memory for block change." );
+		stats_add( stats, STATS_SEND_ERRORS, 1 );
+		return -ENOMEM;
+	}
+
+	stats_add( stats, STATS_BYTES_CAPTURED, record->header->payloadLength );
+	trace_szs_bio_captured( record->header, record->header->payloadLength );
+	seal_change_record( record );
+
+	int ret = 0;
+	u64 stageStart = 0;
+	struct socket_pool_entry *entry = NULL;
+	if( transportType == TRANSPORT_RING )
+	{
+		ret = ring_transport_write( record );
+		goto out;
+	}
+
+	stageStart = latency_start();
+	entry = get_free_socket( &socketPool, raw_smp_processor_id() );
+	latency_end( STAGE_SOCKET_WAIT, stageStart );
+	if( entry == NULL )
+	{
+		ret = -EBUSY;
+		LOG_ERROR( ret, "Failed to get free socket from socket pool." );
+		goto out;
+	}
+
+	ret = prepare_connection( entry );
+	if( ret == 0 )
+	{
+		stageStart = latency_start();
+		ret = write_change_record( record, 0, entry->socket );
+		latency_end( STAGE_SEND, stageStart );
+	}
+
+	if( ret )
+	{
+		entry->broken = true;
+	}
+
+	put_socket( &socketPool, entry );
+
+out:
+	if( ret )
+	{
+		stats_add( stats, STATS_SEND_ERRORS, 1 );
+	}
+	else
+	{
+		stats_add( stats, STATS_BYTES_SENT, change_record_wire_length( record ) );
+		trace_szs_record_sent( record->header, change_record_wire_length( record ) );
+	}
+
+	free_change_record( record );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// While a socket is corked, TCP only sends full-sized segments. Uncorking pushes out whatever
+// is left.
+/////////////////////////////////////////////////////////////////////////////////////////////
+static void set_socket_cork( struct socket* socket, bool cork )
+{
+	#ifdef HAS_TCP_SOCK_SET_CORK
+	tcp_sock_set_cork( socket->sk, cork );
+	#else
+	int value = cork ? 1 : 0;
+	kernel_setsockopt( socket, SOL_TCP, TCP_CORK, ( char * )&value, sizeof( value ) );
+	#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function closes a batch: the socket is uncorked, which sends the last partial segment,
+// and returned to the pool.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void send_batch_flush( struct send_batch* batch )
+{
+	if( batch->entry == NULL )
+	{
+		return;
+	}
+
+	set_socket_cork( batch->entry->socket, false );
+	put_socket( &socketPool, batch->entry );
+
+	batch->entry = NULL;
+	batch->pendingBytes = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sends a change record as part of a batch. The first record of a batch takes
+// a socket from the pool and corks it; the batch is flushed once it holds 'batch_size' bytes
+// or its flush delay has expired. The caller flushes idle batches on the deadline.
+//
+// On failure the record has not been delivered and the caller must keep track of it. The
+// connection is handed back to the pool manager, as the stream may end in a partial record.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int send_batch_add( struct send_batch* batch, struct change_record* record )
+{
+	seal_change_record( record );
+
+	// The ring is shared memory, there is nothing to batch
+	if( transportType == TRANSPORT_RING )
+	{
+		int ret = ring_transport_write( record );
+		if( ret )
+		{
+			stats_add( record->stats, STATS_SEND_ERRORS, 1 );
+			return ret;
+		}
+
+		stats_add( record->stats, STATS_BYTES_SENT, change_record_wire_length( record ) );
+		trace_szs_record_sent( record->header, change_record_wire_length( record ) );
+		return 0;
+	}
+
+	if( batch->entry == NULL )
+	{
+		u64 stageStart = latency_start();
+		batch->entry = get_free_socket( &socketPool, batch->affinity );
+		latency_end( STAGE_SOCKET_WAIT, stageStart );
+		if( batch->entry == NULL )
+		{
+			LOG_ERROR( -EBUSY, "Failed to get free socket from socket pool." );
+			stats_add( record->stats, STATS_SEND_ERRORS, 1 );
+			return -EBUSY;
+		}
+
+		set_socket_cork( batch->entry->socket, true );
+		batch->pendingBytes = 0;
+		batch->deadline = ktime_add_us( ktime_get(), READ_ONCE( batchFlushDelayUs ) );
+	}
+
+	// A device registered while the batch was open must be announced before its records
+	int ret = prepare_connection( batch->entry );
+	if( ret == 0 )
+	{
+		u64 stageStart = latency_start();
+		ret = write_change_record( record, MSG_MORE, batch->entry->socket );
+		latency_end( STAGE_SEND, stageStart );
+	}
+
+	if( ret )
+	{
+		batch->entry->broken = true;
+		send_batch_flush( batch );
+		stats_add( record->stats, STATS_SEND_ERRORS, 1 );
+		return ret;
+	}
+
+	stats_add( record->stats, STATS_BYTES_SENT, change_record_wire_length( record ) );
+	trace_szs_record_sent( record->header, change_record_wire_length( record ) );
+	batch->pendingBytes += change_record_wire_length( record );
+
+	if( batch->pendingBytes >= READ_ONCE( batchSize ) || ktime_after( ktime_get(), batch->deadline ) )
+	{
+		send_batch_flush( batch );
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets up the transport selected at load time and draws the session ID sent
+// to receivers. The ring device must exist before any device is tracked, so that the consumer
+// can attach first.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int transport_setup( void )
+{
+	sessionId = get_random_u64();
+
+	if( transportType == TRANSPORT_RING )
+	{
+		return ring_transport_init();
+	}
+
+	if( transportType != TRANSPORT_TCP )
+	{
+		LOG_ERROR( -EINVAL, "Unknown transport %u.", transportType );
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function creates the socket pool on first use, connected to the current endpoint.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int transport_init( void )
+{
+	if( transportType == TRANSPORT_RING )
+	{
+		return 0;
+	}
+
+	mutex_lock( &endpointMutex );
+	if( socketPoolInitialized )
+	{
+		mutex_unlock( &endpointMutex );
+		return 0;
+	}
+
+	int ret = socket_pool_init( &socketPool, targetIp, targetPort );
+	if( ret )
+	{
+		LOG_ERROR( ret, "Error creating socket pool." );
+		mutex_unlock( &endpointMutex );
+		return ret;
+	}
+
+	socketPool.backlog = capture_queue_backlog;
+	socketPool.resync = resync_device_range;
+
+	socketPoolInitialized = true;
+	mutex_unlock( &endpointMutex );
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function changes the receiver endpoint. Before the pool exists, it only changes where
+// the pool will connect to. It may sleep.
+/////////////////////////////////////////////////////////////////////////////////////////////
+int transport_set_endpoint( const char* ip, unsigned short port )
+{
+	u8 address[4];
+	if( !in4_pton( ip, -1, address, '\0', NULL ) || port == 0 )
+	{
+		LOG_ERROR( -EINVAL, "Invalid endpoint %s:%u.", ip, port );
+		return -EINVAL;
+	}
+
+	int ret = 0;
+	mutex_lock( &endpointMutex );
+	if( socketPoolInitialized )
+	{
+		ret = socket_pool_set_endpoint( &socketPool, ip, port );
+	}
+
+	if( ret == 0 )
+	{
+		kernel_param_lock( THIS_MODULE );
+		strscpy( targetIp, ip, sizeof( targetIp ) );
+		targetPort = port;
+		kernel_param_unlock( THIS_MODULE );
+	}
+
+	mutex_unlock( &endpointMutex );
+	return ret;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets the bounds of the socket pool size, which the caller has validated.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void transport_set_pool_limits( unsigned int minSize, unsigned int maxSize )
+{
+	mutex_lock( &endpointMutex );
+	socket_pool_set_limits( socketPoolInitialized ? &socketPool : NULL, minSize, maxSize );
+	mutex_unlock( &endpointMutex );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function sets the batching parameters. Batches already open keep their deadline.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void transport_set_batching( unsigned int size, unsigned int flushDelayUs )
+{
+	WRITE_ONCE( batchSize, size );
+	WRITE_ONCE( batchFlushDelayUs, flushDelayUs );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function reports the current transport settings.
+/////////////////////////////////////////////////////////////////////////////////////////////
+void transport_get_config( struct tracker_config_request* config )
+{
+	kernel_param_lock( THIS_MODULE );
+	strscpy( config->targetIp, targetIp, sizeof( config->targetIp ) );
+	config->targetPort = targetPort;
+	kernel_param_unlock( THIS_MODULE );
+
+	socket_pool_get_limits( &config->socketPoolMin, &config->socketPoolMax );
+	config->batchSize = READ_ONCE( batchSize );
+	config->batchFlushDelayUs = READ_ONCE( batchFlushDelayUs );
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This function returns the number of connections in the socket pool, read without locking.
+/////////////////////////////////////////////////////////////////////////////////////////////
+unsigned int transport_socket_count( void )
+{
+	return socketPoolInitialized ? READ_ONCE( socketPool.size ) : 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void transport_cleanup( void )
+{
+	ring_transport_cleanup();
+
+	if( !socketPoolInitialized )
+	{
+		return;
+	}
+
+	socket_pool_cleanup( &socketPool );
+	socketPoolInitialized = false;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
@@ -0,0 +1,59 @@
+#ifndef SZS_TRACKER_TRANSPORT_H
+#define SZS_TRACKER_TRANSPORT_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+#include <linux/ktime.h>
+#include <linux/net.h>
+#include <change_record.h>
+#include <socketpool.h>
+#include <ioctl_types.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// A send batch packs consecutive change records into one corked socket, so that small
+// records leave as full-sized TCP segments. It is flushed when 'batch_size' bytes are pending
+// or 'batch_flush_delay_us' after its first record, whichever comes first. Each capture
+// worker owns one batch, so no locking is needed.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct send_batch
+{
+	struct socket_pool_entry *entry;
+	size_t pendingBytes;
+	ktime_t deadline;
+	unsigned int affinity;        // Preferred socket pool slot
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+int transport_setup( void );
+int transport_init( void );
+void transport_cleanup( void );
+int transport_write_bio( struct bio* bio, uint32_t deviceId, uint64_t sequence, struct device_stats* stats );
+unsigned int transport_socket_count( void );
+int transport_set_endpoint( const char* ip, unsigned short port );
+void transport_set_pool_limits( unsigned int minSize, unsigned int maxSize );
+void transport_set_batching( unsigned int size, unsigned int flushDelayUs );
+void transport_get_config( struct tracker_config_request* config );
+
+int send_batch_add( struct send_batch* batch, struct change_record* record );
+void send_batch_flush( struct send_batch* batch );
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+static inline bool send_batch_is_open( struct send_batch* batch )
+{
+	return batch->entry != NULL;
+}
+
+#endif // SZS_TRACKER_TRANSPORT_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End:
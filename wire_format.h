@@ -0,0 +1,123 @@
+#ifndef SZS_TRACKER_WIRE_FORMAT_H
+#define SZS_TRACKER_WIRE_FORMAT_H
+
+/*******************************************************************/
+/*                                                                 */
+/*                  Copyright 2023 RackWare, Inc.                  */
+/*                                                                 */
+/*  This is an unpublished work, is confidential and proprietary   */
+/*  to RackWare as a trade secret and is not to be used or         */
+/*  disclosed except and to the extent expressly permitted in an   */
+/*  applicable RackWare license agreement.                         */
+/*                                                                 */
+/*******************************************************************/
+// Format of the change stream sent to receivers. This header is shared with user space
+// tools, so it must only depend on fixed width types. All fields are in host byte order.
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+#include <constants.h>
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Every connection starts with a preamble. It is followed by a stream of records, each made of
+// a 'struct szs_record_header' and 'payloadLength' bytes of payload. In the other direction, a
+// receiver may send 'struct szs_resync_request' messages on any connection.
+//
+// The preamble carries a session ID drawn when the tracker is loaded. Device IDs, map
+// generations and sequence numbers only have a meaning within a session: they start over
+// when the tracker is reloaded or its host restarts. A receiver that sees a new session must
+// forget the devices and the map of the previous one, and ignore connections still carrying
+// it. A receiver serves a single tracker.
+//
+// Devices are identified by a numeric ID assigned at registration. Before the first record of
+// a device goes out on a connection, the connection receives a SZS_OP_DEVICE_MAP record whose
+// payload is an array of 'struct szs_device_map_entry' describing every tracked device; a new
+// map replaces the previous one. Its 'sequence' carries the generation of the map. The ID of
+// a removed device is not given to another one before every other ID has been used, so its
+// late records cannot be mistaken for those of a device that came after it.
+//
+// Sequence numbers are per device and start at 1. They let a receiver restore the submission
+// order of records spread over several connections. A number may never arrive: the tracker
+// consumes numbers for changes it fails to deliver and sends their range again later under a
+// new number. Nothing tells such a gap from a slow record, so a receiver that moves on without
+// a number must still apply its record if it shows up, except over the sectors that records of
+// higher numbers have written since.
+//
+// Discards and write-zeroes are SZS_OP_WRITE records flagged SZS_RECORD_FLAG_DISCARD or
+// SZS_RECORD_FLAG_ZERO; they carry the range in 'sector' and 'length' but no payload. Writes of
+// all-zero data are sent as zero ranges as well, unless 'zero_detection' is off. A flush
+// is a SZS_OP_FLUSH record: the changes of lower sequence numbers must be durable on the
+// replica before the changes of higher ones are applied. A write flagged
+// SZS_RECORD_FLAG_PREFLUSH is a flush followed by the write, and SZS_RECORD_FLAG_FUA asks for
+// the write itself to be durable before later changes are applied. Writes between two barriers
+// may be applied in any order that preserves the order of overlapping ranges.
+/////////////////////////////////////////////////////////////////////////////////////////////
+#pragma pack(push, 1)
+struct szs_stream_preamble
+{
+	uint32_t magic;               // SZS_WIRE_MAGIC
+	uint16_t version;             // SZS_WIRE_VERSION
+	uint16_t headerSize;          // sizeof( struct szs_record_header )
+	uint64_t sessionId;           // Random, drawn when the tracker is loaded
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_record_header
+{
+	uint16_t version;             // SZS_WIRE_VERSION
+	uint8_t opType;               // SZS_OP_*
+	uint8_t flags;                // SZS_RECORD_FLAG_*
+	uint32_t deviceId;
+	uint64_t sequence;
+	uint64_t sector;              // First 512-byte sector of the change
+	uint32_t length;              // Bytes of the change on the device
+	uint32_t payloadLength;       // Bytes following the header
+	uint32_t crc32c;              // CRC32C of the payload if SZS_RECORD_FLAG_CRC32C is set
+	uint32_t reserved;
+	uint64_t timestampNs;         // Wall clock time of the capture
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_device_map_entry
+{
+	uint32_t deviceId;
+	uint32_t reserved;
+	char name[BLOCK_DEVICE_NAME_LEN];
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Payload of a record flagged SZS_RECORD_FLAG_DEDUP. The data written is the same as the
+// 'length' bytes at 'sourceSector' of the same device, as they are once every record of a
+// lower sequence number has been applied, provided their xxh64 digest (seed 0) is 'digest'.
+// When it is not, the receiver asks for the range again with a 'struct szs_resync_request'.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_dedup_reference
+{
+	uint64_t digest;
+	uint64_t sourceSector;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Sent by a receiver to have a range of a device sent again under a fresh sequence number.
+// The tracker reads these messages when a connection is released or idle. A message with a
+// wrong magic closes the connection.
+/////////////////////////////////////////////////////////////////////////////////////////////
+struct szs_resync_request
+{
+	uint32_t magic;               // SZS_RESYNC_MAGIC
+	uint32_t deviceId;
+	uint64_t sector;
+	uint32_t length;              // Bytes
+	uint32_t reserved;
+};
+
+#pragma pack(pop)
+
+#endif // SZS_TRACKER_WIRE_FORMAT_H
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Local Variables:
+// indent-tabs-mode: t
+// fill-column: 100
+// End: